@@ -0,0 +1,949 @@
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFuture>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QSet>
+#include <QSysInfo>
+#include <QThread>
+#include <QTimer>
+
+#include <oclero/QtAppInstanceManager.hpp>
+#include <oclero/FrameDecoder.hpp>
+#include <oclero/LocalEndpointProtocol.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <vector>
+
+#if defined(Q_OS_UNIX)
+#  include <signal.h>
+#endif
+
+// Spawns real primary and secondary processes (this same executable, with --child), and prints a JSON report.
+// Each child prints its results as JSON lines on its standard output; the orchestrator gathers them.
+
+using oclero::FrameDecoder;
+using oclero::QtAppInstanceManager;
+namespace protocol = oclero::protocol;
+
+namespace {
+constexpr auto ChildTimeout = 60000;
+constexpr auto SmallPayloadSize = 64;
+constexpr auto MediumPayloadSize = 64 * 1024;
+constexpr auto LargePayloadSize = 1024 * 1024;
+constexpr auto FailoverHeartbeatInterval = 50;
+constexpr auto FailoverMissedHeartbeats = 3;
+
+const auto QuitRequest = QByteArrayLiteral("quit");
+const auto ReadyMessage = QByteArrayLiteral("ready");
+const auto DoneMessage = QByteArrayLiteral("done");
+
+// Started as soon as the process starts, to measure the time to role resolution.
+QElapsedTimer processTimer;
+
+// Monotonic and system-wide, so that the orchestrator can compare its timestamps with the children's ones.
+qint64 getSteadyTime() {
+  const auto time = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+struct ChildOptions {
+  QString mode;
+  int count{ 0 };
+  int size{ 0 };
+  int clients{ 0 };
+  QtAppInstanceManager::FlushPolicy flushPolicy{ QtAppInstanceManager::FlushPolicy::Immediate };
+};
+
+QString toString(QtAppInstanceManager::FlushPolicy flushPolicy) {
+  switch (flushPolicy) {
+    case QtAppInstanceManager::FlushPolicy::EndOfIteration:
+      return QStringLiteral("endOfIteration");
+    case QtAppInstanceManager::FlushPolicy::Threshold:
+      return QStringLiteral("threshold");
+    default:
+      return QStringLiteral("immediate");
+  }
+}
+
+QtAppInstanceManager::FlushPolicy toFlushPolicy(const QString& str) {
+  if (str == QStringLiteral("endOfIteration")) {
+    return QtAppInstanceManager::FlushPolicy::EndOfIteration;
+  } else if (str == QStringLiteral("threshold")) {
+    return QtAppInstanceManager::FlushPolicy::Threshold;
+  }
+  return QtAppInstanceManager::FlushPolicy::Immediate;
+}
+
+template<typename Predicate>
+bool waitFor(Predicate&& predicate, int timeout = ChildTimeout) {
+  const QDeadlineTimer deadline(timeout);
+  // Wakes the event loop up regularly, to check the deadline.
+  QTimer wakeUpTimer;
+  wakeUpTimer.start(100);
+  while (!predicate()) {
+    if (deadline.hasExpired()) {
+      return false;
+    }
+    QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+  }
+  return true;
+}
+
+bool waitForRole(const QtAppInstanceManager& manager) {
+  return waitFor([&manager]() {
+    return manager.isPrimaryInstance() || manager.isSecondaryInstance();
+  });
+}
+
+bool sendRequest(QtAppInstanceManager& manager, const QByteArray& data) {
+  auto future = manager.sendRequestToPrimary(data, ChildTimeout);
+  return waitFor([&future]() {
+    return future.isFinished();
+  }) && !future.isCanceled();
+}
+
+void printResult(const QJsonObject& result) {
+  const auto line = QJsonDocument(result).toJson(QJsonDocument::Compact) + '\n';
+  std::fputs(line.constData(), stdout);
+  std::fflush(stdout);
+}
+
+int fail(const char* message) {
+  qWarning("%s", message);
+  return EXIT_FAILURE;
+}
+
+// Adds the percentiles of samples (in nanoseconds) to the result, in microseconds.
+void addPercentiles(QJsonObject& result, const QString& prefix, std::vector<qint64> samples) {
+  if (samples.empty()) {
+    return;
+  }
+
+  std::sort(samples.begin(), samples.end());
+  const auto percentile = [&samples](double p) {
+    const auto index = static_cast<size_t>(p * static_cast<double>(samples.size() - 1));
+    return static_cast<double>(samples[index]) / 1000.;
+  };
+  const auto sum = std::accumulate(samples.cbegin(), samples.cend(), 0.);
+  result[prefix + QStringLiteral("P50Us")] = percentile(.5);
+  result[prefix + QStringLiteral("P90Us")] = percentile(.9);
+  result[prefix + QStringLiteral("P99Us")] = percentile(.99);
+  result[prefix + QStringLiteral("MaxUs")] = percentile(1.);
+  result[prefix + QStringLiteral("MeanUs")] = sum / static_cast<double>(samples.size()) / 1000.;
+}
+
+#pragma region Children
+
+// Primary instance that answers each request with its own data, until it receives QuitRequest.
+int runEchoPrimary() {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isPrimaryInstance()) {
+    return fail("A primary instance is already running.");
+  }
+
+  QObject::connect(&manager, &QtAppInstanceManager::secondaryInstanceRequestReceived, &manager,
+    [&manager](const quint64 id, const unsigned int requestId, const QByteArray& data) {
+      manager.sendResponseToSecondary(id, requestId, data);
+      if (data == QuitRequest) {
+        manager.flush();
+        QTimer::singleShot(0, qApp, &QCoreApplication::quit);
+      }
+    });
+
+  printResult({ { "ready", true } });
+  return QCoreApplication::exec();
+}
+
+// Secondary instance that sends requests one after the other, and measures their round trip.
+int runLatency(const ChildOptions& options) {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+
+  // The first request also waits for the handshake.
+  const auto payload = QByteArray(options.size, 'x');
+  if (!sendRequest(manager, payload)) {
+    return fail("Primary instance did not answer.");
+  }
+
+  std::vector<qint64> samples;
+  samples.reserve(static_cast<size_t>(options.count));
+  QElapsedTimer timer;
+  for (auto i = 0; i < options.count; ++i) {
+    timer.start();
+    if (!sendRequest(manager, payload)) {
+      return fail("Primary instance did not answer.");
+    }
+    samples.push_back(timer.nsecsElapsed());
+  }
+
+  QJsonObject result{
+    { "name", "latency" },
+    { "payloadSize", options.size },
+    { "samples", options.count },
+  };
+  addPercentiles(result, QStringLiteral("roundTrip"), std::move(samples));
+  printResult(result);
+  return EXIT_SUCCESS;
+}
+
+// Secondary instance that sends messages as fast as possible.
+int runThroughput(const ChildOptions& options) {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+  manager.setFlushPolicy(options.flushPolicy);
+
+  if (!sendRequest(manager, {})) {
+    return fail("Primary instance did not answer.");
+  }
+
+  const auto payload = QByteArray(options.size, 'x');
+  QElapsedTimer timer;
+  timer.start();
+  for (auto i = 0; i < options.count; ++i) {
+    manager.sendMessageToPrimary(payload);
+  }
+  // Messages and requests are delivered in order: the response means that all messages were received.
+  if (!sendRequest(manager, {})) {
+    return fail("Primary instance did not answer.");
+  }
+  const auto elapsedSeconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+
+  printResult({
+    { "name", "throughput" },
+    { "payloadSize", options.size },
+    { "messages", options.count },
+    { "flushPolicy", toString(options.flushPolicy) },
+    { "elapsedMs", elapsedSeconds * 1000. },
+    { "messagesPerSecond", options.count / elapsedSeconds },
+    { "megabytesPerSecond", static_cast<double>(options.count) * options.size / elapsedSeconds / (1024. * 1024.) },
+  });
+  return EXIT_SUCCESS;
+}
+
+// Secondary instance whose worker threads send messages, either directly (through the lock-free queue),
+// or marshalled to the manager's thread with QMetaObject::invokeMethod().
+int runWorkers(const ChildOptions& options, bool invokeMethod) {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+
+  if (!sendRequest(manager, {})) {
+    return fail("Primary instance did not answer.");
+  }
+
+  const auto payload = QByteArray(options.size, 'x');
+  const auto threadCount = std::max(options.clients, 1);
+  const auto messageCount = threadCount * options.count;
+  std::atomic<int> sentCount{ 0 };
+  auto finishedCount = 0;
+  std::vector<std::unique_ptr<QThread>> workers;
+
+  QElapsedTimer timer;
+  timer.start();
+  for (auto i = 0; i < threadCount; ++i) {
+    auto worker = std::unique_ptr<QThread>(QThread::create([&manager, &payload, &sentCount, &options, invokeMethod]() {
+      for (auto j = 0; j < options.count; ++j) {
+        if (invokeMethod) {
+          QMetaObject::invokeMethod(
+            &manager,
+            [&manager, &payload, &sentCount]() {
+              manager.sendMessageToPrimary(payload);
+              ++sentCount;
+            },
+            Qt::QueuedConnection);
+        } else {
+          manager.sendMessageToPrimary(payload);
+        }
+      }
+    }));
+    QObject::connect(worker.get(), &QThread::finished, &manager, [&finishedCount]() {
+      ++finishedCount;
+    });
+    worker->start();
+    workers.push_back(std::move(worker));
+  }
+
+  // The event loop runs meanwhile, and sends the messages.
+  if (!waitFor([&finishedCount, threadCount]() {
+        return finishedCount == threadCount;
+      })) {
+    return fail("Worker threads did not finish.");
+  }
+  const auto producersElapsedSeconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+  if (invokeMethod && !waitFor([&sentCount, messageCount]() {
+        return sentCount == messageCount;
+      })) {
+    return fail("Not all marshalled messages were sent.");
+  }
+  // Queued messages are sent before the request: the response means that all messages were received.
+  if (!sendRequest(manager, {})) {
+    return fail("Primary instance did not answer.");
+  }
+  const auto elapsedSeconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+
+  printResult({
+    { "name", "workers" },
+    { "marshalling", invokeMethod ? "invokeMethod" : "queue" },
+    { "threads", threadCount },
+    { "payloadSize", options.size },
+    { "messages", messageCount },
+    { "producersMs", producersElapsedSeconds * 1000. },
+    { "elapsedMs", elapsedSeconds * 1000. },
+    { "messagesPerSecond", messageCount / elapsedSeconds },
+  });
+  return EXIT_SUCCESS;
+}
+
+// Primary instance that broadcasts messages once all the sinks are ready, and waits for all of them to be received.
+int runBroadcastPrimary(const ChildOptions& options) {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isPrimaryInstance()) {
+    return fail("A primary instance is already running.");
+  }
+
+  QSet<quint64> readyClients;
+  auto doneCount = 0;
+  QObject::connect(&manager, &QtAppInstanceManager::secondaryInstanceMessageReceived, &manager,
+    [&readyClients, &doneCount](const quint64 id, const QByteArray& data) {
+      if (data == ReadyMessage) {
+        readyClients.insert(id);
+      } else if (data == DoneMessage) {
+        ++doneCount;
+      }
+    });
+
+  printResult({ { "ready", true } });
+  if (!waitFor([&readyClients, &options]() {
+        return readyClients.size() == options.clients;
+      })) {
+    return fail("Not all secondary instances are ready.");
+  }
+
+  const auto payload = QByteArray(options.size, 'x');
+  QElapsedTimer timer;
+  timer.start();
+  for (auto i = 0; i < options.count; ++i) {
+    manager.sendMessageToAllSecondaries(payload);
+  }
+  if (!waitFor([&doneCount, &options]() {
+        return doneCount == options.clients;
+      })) {
+    return fail("Not all secondary instances received the messages.");
+  }
+  const auto elapsedSeconds = static_cast<double>(timer.nsecsElapsed()) / 1e9;
+
+  printResult({
+    { "name", "broadcast" },
+    { "clients", options.clients },
+    { "payloadSize", options.size },
+    { "messages", options.count },
+    { "elapsedMs", elapsedSeconds * 1000. },
+    { "messageUs", elapsedSeconds * 1e6 / options.count },
+    { "deliveriesPerSecond", static_cast<double>(options.count) * options.clients / elapsedSeconds },
+  });
+  return EXIT_SUCCESS;
+}
+
+// Secondary instance that tells the primary instance when it has received all the broadcast messages.
+int runBroadcastSink(const ChildOptions& options) {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+
+  auto receivedCount = 0;
+  QObject::connect(&manager, &QtAppInstanceManager::primaryInstanceMessageReceived, &manager,
+    [&manager, &receivedCount, &options](const QByteArray&) {
+      if (++receivedCount == options.count) {
+        manager.sendMessageToPrimary(DoneMessage);
+      }
+    });
+
+  manager.sendMessageToPrimary(ReadyMessage);
+  if (!waitFor([&receivedCount, &options]() {
+        return receivedCount >= options.count;
+      })) {
+    return fail("Not all messages were received.");
+  }
+  manager.flush();
+  return EXIT_SUCCESS;
+}
+
+// Measures the time from the process start to the role resolution, and to the first response for a secondary.
+int runStartup() {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager)) {
+    return fail("No role was given.");
+  }
+
+  QJsonObject result{
+    { "role", manager.isPrimaryInstance() ? "primary" : "secondary" },
+    { "roleResolvedNs", processTimer.nsecsElapsed() },
+  };
+  if (manager.isSecondaryInstance()) {
+    // Synchronous fast path, as used by single-instance applications to forward their arguments.
+    if (manager.forwardToPrimary("startup", ChildTimeout) != QtAppInstanceManager::ForwardResult::Delivered) {
+      return fail("Can't forward message to primary instance.");
+    }
+    result[QStringLiteral("forwardedNs")] = processTimer.nsecsElapsed();
+
+    if (!sendRequest(manager, {})) {
+      return fail("Primary instance did not answer.");
+    }
+    result[QStringLiteral("firstResponseNs")] = processTimer.nsecsElapsed();
+  }
+  printResult(result);
+  return EXIT_SUCCESS;
+}
+
+// Heartbeats are enabled before the role is decided, so that the primary instance's lease expires with them.
+QtAppInstanceManager::StartupSettings getFailoverSettings() {
+  auto settings = QtAppInstanceManager::StartupSettings{};
+  settings.heartbeatPolicy = { FailoverHeartbeatInterval, FailoverMissedHeartbeats };
+  return settings;
+}
+
+// Primary instance with heartbeats, until the orchestrator kills or stops it.
+int runHeartbeatPrimary() {
+  QtAppInstanceManager manager(
+    QtAppInstanceManager::Mode::MultipleInstances, QtAppInstanceManager::AppExitMode::Auto, getFailoverSettings());
+  if (!waitForRole(manager) || !manager.isPrimaryInstance()) {
+    return fail("A primary instance is already running.");
+  }
+
+  printResult({ { "ready", true } });
+  return QCoreApplication::exec();
+}
+
+// Secondary instance with heartbeats, that prints when it replaced the primary instance, once it is lost.
+int runFailover() {
+  QtAppInstanceManager manager(
+    QtAppInstanceManager::Mode::MultipleInstances, QtAppInstanceManager::AppExitMode::Auto, getFailoverSettings());
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+  if (!waitFor([&manager]() {
+        return manager.instanceId() != 0u;
+      })) {
+    return fail("Can't connect to the primary instance.");
+  }
+  // Lets the instances exchange heartbeats.
+  QElapsedTimer timer;
+  timer.start();
+  waitFor([&timer]() {
+    return timer.hasExpired(FailoverHeartbeatInterval * 2);
+  });
+
+  auto promotedTime = qint64{ 0 };
+  QObject::connect(&manager, &QtAppInstanceManager::instanceRoleChanged, &manager, [&manager, &promotedTime]() {
+    if (manager.isPrimaryInstance() && promotedTime == 0) {
+      promotedTime = getSteadyTime();
+    }
+  });
+  printResult({ { "ready", true } });
+  if (!waitFor([&promotedTime]() {
+        return promotedTime != 0;
+      })) {
+    return fail("The primary instance was not replaced.");
+  }
+  printResult({ { "promotedNs", promotedTime } });
+  return EXIT_SUCCESS;
+}
+
+// Asks the echo primary instance to quit.
+int runStop() {
+  QtAppInstanceManager manager;
+  if (!waitForRole(manager) || !manager.isSecondaryInstance()) {
+    return fail("No primary instance is running.");
+  }
+  sendRequest(manager, QuitRequest);
+  return EXIT_SUCCESS;
+}
+
+int runChild(const ChildOptions& options) {
+  if (options.mode == QStringLiteral("primary")) {
+    return runEchoPrimary();
+  } else if (options.mode == QStringLiteral("latency")) {
+    return runLatency(options);
+  } else if (options.mode == QStringLiteral("throughput")) {
+    return runThroughput(options);
+  } else if (options.mode == QStringLiteral("workers")) {
+    return runWorkers(options, false);
+  } else if (options.mode == QStringLiteral("workersInvokeMethod")) {
+    return runWorkers(options, true);
+  } else if (options.mode == QStringLiteral("broadcast")) {
+    return runBroadcastPrimary(options);
+  } else if (options.mode == QStringLiteral("sink")) {
+    return runBroadcastSink(options);
+  } else if (options.mode == QStringLiteral("startup")) {
+    return runStartup();
+  } else if (options.mode == QStringLiteral("stop")) {
+    return runStop();
+  } else if (options.mode == QStringLiteral("heartbeatPrimary")) {
+    return runHeartbeatPrimary();
+  } else if (options.mode == QStringLiteral("failover")) {
+    return runFailover();
+  }
+  return fail("Unknown child mode.");
+}
+
+#pragma endregion
+
+#pragma region Orchestrator
+
+class Orchestrator {
+public:
+  explicit Orchestrator(bool quick)
+    : _quick(quick) {}
+
+  QJsonArray run() {
+    benchmarkStartup();
+    benchmarkLatency();
+    benchmarkThroughput();
+    benchmarkWorkers();
+    benchmarkBroadcast();
+    // A killed primary instance closes its socket, while a stopped one hangs: only heartbeats can tell.
+    benchmarkFailover(QStringLiteral("kill"));
+#if defined(Q_OS_UNIX)
+    benchmarkFailover(QStringLiteral("stop"));
+#endif
+    benchmarkFrameDecoder();
+    return _results;
+  }
+
+  bool hasFailed() const {
+    return _failed;
+  }
+
+private:
+  int count(int quickCount, int fullCount) const {
+    return _quick ? quickCount : fullCount;
+  }
+
+  static QStringList childArguments(const ChildOptions& options) {
+    return {
+      QStringLiteral("--child"),
+      options.mode,
+      QStringLiteral("--count"),
+      QString::number(options.count),
+      QStringLiteral("--size"),
+      QString::number(options.size),
+      QStringLiteral("--clients"),
+      QString::number(options.clients),
+      QStringLiteral("--flush-policy"),
+      toString(options.flushPolicy),
+    };
+  }
+
+  // Starts a child process. If waitForReady is true, waits until it prints that it is ready.
+  std::unique_ptr<QProcess> startChild(const ChildOptions& options, bool waitForReady) {
+    auto process = std::make_unique<QProcess>();
+    process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+    process->start(QCoreApplication::applicationFilePath(), childArguments(options));
+    if (!process->waitForStarted(ChildTimeout)) {
+      return nullptr;
+    }
+
+    while (waitForReady && !process->canReadLine()) {
+      if (!process->waitForReadyRead(ChildTimeout)) {
+        process->kill();
+        process->waitForFinished();
+        return nullptr;
+      }
+    }
+    if (waitForReady) {
+      process->readLine();
+    }
+    return process;
+  }
+
+  // Waits for the child process to exit, and returns the results it printed.
+  static std::optional<QList<QJsonObject>> finishChild(QProcess& process) {
+    if (!process.waitForFinished(ChildTimeout)) {
+      process.kill();
+      process.waitForFinished();
+      return std::nullopt;
+    }
+    if (process.exitStatus() != QProcess::NormalExit || process.exitCode() != EXIT_SUCCESS) {
+      return std::nullopt;
+    }
+
+    QList<QJsonObject> results;
+    const auto lines = process.readAllStandardOutput().split('\n');
+    for (const auto& line : lines) {
+      const auto document = QJsonDocument::fromJson(line);
+      if (document.isObject() && !document.object().contains(QStringLiteral("ready"))) {
+        results.append(document.object());
+      }
+    }
+    return results;
+  }
+
+  std::optional<QList<QJsonObject>> runChild(const ChildOptions& options) {
+    auto process = startChild(options, false);
+    return process ? finishChild(*process) : std::nullopt;
+  }
+
+  std::unique_ptr<QProcess> startEchoPrimary() {
+    return startChild(ChildOptions{ QStringLiteral("primary") }, true);
+  }
+
+  void stopEchoPrimary(std::unique_ptr<QProcess> primary) {
+    if (!primary) {
+      return;
+    }
+    runChild(ChildOptions{ QStringLiteral("stop") });
+    if (!primary->waitForFinished(ChildTimeout)) {
+      primary->kill();
+      primary->waitForFinished();
+    }
+  }
+
+  void addResults(const QString& name, const std::optional<QList<QJsonObject>>& results) {
+    if (!results || results->isEmpty()) {
+      addError(name);
+      return;
+    }
+    for (const auto& result : *results) {
+      _results.append(result);
+    }
+  }
+
+  void addError(const QString& name) {
+    _failed = true;
+    _results.append(QJsonObject{ { "name", name }, { "error", "child process failed or timed out" } });
+  }
+
+  void benchmarkStartup() {
+    const auto runs = count(5, 20);
+
+    // Without any other instance: the process becomes the primary instance.
+    std::vector<qint64> primarySamples;
+    for (auto i = 0; i < runs; ++i) {
+      const auto results = runChild(ChildOptions{ QStringLiteral("startup") });
+      if (!results || results->isEmpty()) {
+        addError(QStringLiteral("startup"));
+        return;
+      }
+      primarySamples.push_back(results->front()[QStringLiteral("roleResolvedNs")].toInteger());
+    }
+
+    // With a primary instance running: the process becomes a secondary instance and connects to it.
+    auto primary = startEchoPrimary();
+    if (!primary) {
+      addError(QStringLiteral("startup"));
+      return;
+    }
+    std::vector<qint64> secondarySamples;
+    std::vector<qint64> forwardedSamples;
+    std::vector<qint64> firstResponseSamples;
+    for (auto i = 0; i < runs; ++i) {
+      const auto results = runChild(ChildOptions{ QStringLiteral("startup") });
+      if (!results || results->isEmpty()) {
+        addError(QStringLiteral("startup"));
+        break;
+      }
+      secondarySamples.push_back(results->front()[QStringLiteral("roleResolvedNs")].toInteger());
+      forwardedSamples.push_back(results->front()[QStringLiteral("forwardedNs")].toInteger());
+      firstResponseSamples.push_back(results->front()[QStringLiteral("firstResponseNs")].toInteger());
+    }
+    stopEchoPrimary(std::move(primary));
+
+    QJsonObject result{ { "name", "startup" }, { "runs", runs } };
+    addPercentiles(result, QStringLiteral("primaryRoleResolved"), std::move(primarySamples));
+    addPercentiles(result, QStringLiteral("secondaryRoleResolved"), std::move(secondarySamples));
+    addPercentiles(result, QStringLiteral("secondaryForwarded"), std::move(forwardedSamples));
+    addPercentiles(result, QStringLiteral("secondaryFirstResponse"), std::move(firstResponseSamples));
+    _results.append(result);
+  }
+
+  void benchmarkLatency() {
+    auto primary = startEchoPrimary();
+    if (!primary) {
+      addError(QStringLiteral("latency"));
+      return;
+    }
+    for (const auto size : { SmallPayloadSize, MediumPayloadSize }) {
+      addResults(QStringLiteral("latency"), runChild(ChildOptions{ QStringLiteral("latency"), count(200, 5000), size }));
+    }
+    stopEchoPrimary(std::move(primary));
+  }
+
+  void benchmarkThroughput() {
+    auto primary = startEchoPrimary();
+    if (!primary) {
+      addError(QStringLiteral("throughput"));
+      return;
+    }
+    for (const auto flushPolicy :
+      { QtAppInstanceManager::FlushPolicy::Immediate, QtAppInstanceManager::FlushPolicy::EndOfIteration }) {
+      addResults(QStringLiteral("throughput"),
+        runChild(ChildOptions{
+          QStringLiteral("throughput"), count(2000, 50000), SmallPayloadSize, 0, flushPolicy }));
+      addResults(QStringLiteral("throughput"),
+        runChild(ChildOptions{ QStringLiteral("throughput"), count(20, 200), LargePayloadSize, 0, flushPolicy }));
+    }
+    stopEchoPrimary(std::move(primary));
+  }
+
+  void benchmarkWorkers() {
+    auto primary = startEchoPrimary();
+    if (!primary) {
+      addError(QStringLiteral("workers"));
+      return;
+    }
+    for (const auto threads : { 1, 4 }) {
+      for (const auto& mode : { QStringLiteral("workers"), QStringLiteral("workersInvokeMethod") }) {
+        addResults(QStringLiteral("workers"),
+          runChild(ChildOptions{ mode, count(2000, 50000), SmallPayloadSize, threads }));
+      }
+    }
+    stopEchoPrimary(std::move(primary));
+  }
+
+  void benchmarkBroadcast() {
+    for (const auto clients : { 1, 2, 4, 8 }) {
+      const auto messageCount = count(200, 2000);
+      auto primary = startChild(
+        ChildOptions{ QStringLiteral("broadcast"), messageCount, SmallPayloadSize, clients }, true);
+      if (!primary) {
+        addError(QStringLiteral("broadcast"));
+        continue;
+      }
+
+      std::vector<std::unique_ptr<QProcess>> sinks;
+      for (auto i = 0; i < clients; ++i) {
+        sinks.push_back(startChild(ChildOptions{ QStringLiteral("sink"), messageCount }, false));
+      }
+      addResults(QStringLiteral("broadcast"), finishChild(*primary));
+      for (auto& sink : sinks) {
+        if (sink) {
+          finishChild(*sink);
+        }
+      }
+    }
+  }
+
+  // Time for a secondary instance to replace the primary instance, from the moment it is lost.
+  void benchmarkFailover(const QString& method) {
+    const auto runs = count(3, 10);
+    std::vector<qint64> samples;
+    for (auto i = 0; i < runs; ++i) {
+      auto primary = startChild(ChildOptions{ QStringLiteral("heartbeatPrimary") }, true);
+      auto secondary = primary ? startChild(ChildOptions{ QStringLiteral("failover") }, true) : nullptr;
+      if (!secondary) {
+        if (primary) {
+          primary->kill();
+          primary->waitForFinished();
+        }
+        addError(QStringLiteral("failover"));
+        return;
+      }
+
+      const auto lostTime = getSteadyTime();
+#if defined(Q_OS_UNIX)
+      if (method == QStringLiteral("stop")) {
+        ::kill(static_cast<pid_t>(primary->processId()), SIGSTOP);
+      }
+#endif
+      if (method == QStringLiteral("kill")) {
+        primary->kill();
+      }
+      const auto results = finishChild(*secondary);
+      // Also ends a stopped process.
+      primary->kill();
+      primary->waitForFinished();
+      if (!results || results->isEmpty()) {
+        addError(QStringLiteral("failover"));
+        return;
+      }
+      samples.push_back(results->front()[QStringLiteral("promotedNs")].toInteger() - lostTime);
+    }
+
+    QJsonObject result{
+      { "name", "failover" },
+      { "method", method },
+      { "runs", runs },
+      { "heartbeatIntervalMs", FailoverHeartbeatInterval },
+      { "missedHeartbeats", FailoverMissedHeartbeats },
+    };
+    addPercentiles(result, QStringLiteral("failover"), std::move(samples));
+    _results.append(result);
+  }
+
+  // In-process: decoding of the same messages, by the former path (a QDataStream per field) and by FrameDecoder.
+  // Both read the same legacy stream, so that only the parsing differs; the framed protocol is measured apart.
+  void benchmarkFrameDecoder() {
+    const auto runs = count(20, 200);
+    for (const auto size : { SmallPayloadSize, MediumPayloadSize }) {
+      const auto messageCount = size == SmallPayloadSize ? 1000 : 100;
+      const auto payload = QByteArray(size, 'x');
+      auto legacyData = QByteArray{};
+      auto framedData = QByteArray{};
+      for (auto i = 0; i < messageCount; ++i) {
+        legacyData += protocol::encodeFrame(protocol::Version::Legacy, payload);
+        framedData += protocol::encodeFrame(protocol::Version::Framed, payload);
+      }
+
+      addFrameDecoderResult(QStringLiteral("dataStream"), QStringLiteral("legacy"), size, messageCount, runs,
+        [&legacyData]() {
+          return decodeWithDataStream(legacyData);
+        });
+      addFrameDecoderResult(QStringLiteral("frameDecoder"), QStringLiteral("legacy"), size, messageCount, runs,
+        [&legacyData]() {
+          return decodeWithFrameDecoder(legacyData, protocol::Version::Legacy);
+        });
+      addFrameDecoderResult(QStringLiteral("frameDecoder"), QStringLiteral("framed"), size, messageCount, runs,
+        [&framedData]() {
+          return decodeWithFrameDecoder(framedData, protocol::Version::Framed);
+        });
+    }
+  }
+
+  // Former path: a QDataStream is created for each field.
+  static int decodeWithDataStream(QByteArray& data) {
+    QBuffer device(&data);
+    device.open(QIODevice::ReadOnly);
+    auto decodedCount = 0;
+    while (device.bytesAvailable() > 0) {
+      auto bodySize = quint64{};
+      {
+        QDataStream stream(&device);
+        stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
+        stream >> bodySize;
+      }
+      auto body = QByteArray{};
+      {
+        QDataStream stream(&device);
+        stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
+        stream >> body;
+      }
+      decodedCount += body.size() == static_cast<qsizetype>(bodySize) ? 1 : 0;
+    }
+    return decodedCount;
+  }
+
+  static int decodeWithFrameDecoder(QByteArray& data, protocol::Version version) {
+    QBuffer device(&data);
+    device.open(QIODevice::ReadOnly);
+    auto decodedCount = 0;
+    FrameDecoder decoder(version);
+    auto frame = FrameDecoder::Frame{};
+    while (decoder.decode(device, frame) == FrameDecoder::Status::FrameReady) {
+      ++decodedCount;
+    }
+    return decodedCount;
+  }
+
+  template<typename Decode>
+  void addFrameDecoderResult(const QString& decoder, const QString& protocolVersion, int size, int messageCount,
+    int runs, Decode&& decode) {
+    std::vector<qint64> samples;
+    QElapsedTimer timer;
+    for (auto i = 0; i < runs; ++i) {
+      timer.start();
+      const auto decodedCount = decode();
+      samples.push_back(timer.nsecsElapsed() / messageCount);
+      if (decodedCount != messageCount) {
+        addError(QStringLiteral("frameDecoder"));
+        return;
+      }
+    }
+
+    QJsonObject result{
+      { "name", "frameDecoder" },
+      { "decoder", decoder },
+      { "protocol", protocolVersion },
+      { "payloadSize", size },
+      { "messages", messageCount },
+      { "runs", runs },
+    };
+    addPercentiles(result, QStringLiteral("perMessage"), std::move(samples));
+    _results.append(result);
+  }
+
+private:
+  bool _quick{ false };
+  bool _failed{ false };
+  QJsonArray _results;
+};
+
+#pragma endregion
+} // namespace
+
+int main(int argc, char* argv[]) {
+  processTimer.start();
+
+  // The socket name depends on these: benchmarks don't interfere with other applications.
+  QCoreApplication::setApplicationName("QtAppInstanceManagerBenchmarks");
+  QCoreApplication::setApplicationVersion(QTAPPINSTANCEMANAGER_VERSION);
+  QCoreApplication::setOrganizationName("oclero");
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Measures the latency and throughput of QtAppInstanceManager between processes.");
+  parser.addHelpOption();
+  const QCommandLineOption outputOption("output", "Writes the JSON report to this file instead of stdout.", "file");
+  const QCommandLineOption quickOption("quick", "Runs fewer iterations, e.g. for CI.");
+  const QCommandLineOption childOption("child", "Internal: runs as a child process.", "mode");
+  const QCommandLineOption countOption("count", "Internal: number of messages.", "count", "0");
+  const QCommandLineOption sizeOption("size", "Internal: payload size.", "size", "0");
+  const QCommandLineOption clientsOption("clients", "Internal: number of secondary instances.", "clients", "0");
+  const QCommandLineOption flushPolicyOption("flush-policy", "Internal: flush policy.", "policy", "immediate");
+  parser.addOptions(
+    { outputOption, quickOption, childOption, countOption, sizeOption, clientsOption, flushPolicyOption });
+  parser.process(app);
+
+  if (parser.isSet(childOption)) {
+    return runChild(ChildOptions{
+      parser.value(childOption),
+      parser.value(countOption).toInt(),
+      parser.value(sizeOption).toInt(),
+      parser.value(clientsOption).toInt(),
+      toFlushPolicy(parser.value(flushPolicyOption)),
+    });
+  }
+
+  Orchestrator orchestrator(parser.isSet(quickOption));
+  const QJsonObject report{
+    { "version", QTAPPINSTANCEMANAGER_VERSION },
+    { "qtVersion", qVersion() },
+    { "os", QSysInfo::prettyProductName() },
+    { "date", QDateTime::currentDateTimeUtc().toString(Qt::ISODate) },
+    { "quick", parser.isSet(quickOption) },
+    { "results", orchestrator.run() },
+  };
+  const auto json = QJsonDocument(report).toJson();
+
+  if (parser.isSet(outputOption)) {
+    QFile file(parser.value(outputOption));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+      return fail("Can't open output file.");
+    }
+    file.write(json);
+  } else {
+    std::fputs(json.constData(), stdout);
+  }
+
+  return orchestrator.hasFailed() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
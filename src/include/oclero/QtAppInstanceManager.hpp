@@ -1,11 +1,23 @@
 #pragma once
 
 #include <QObject>
+#include <QFuture>
+#include <QIODevice>
+#include <QList>
+#include <QSet>
+#include <array>
+#include <functional>
 #include <memory>
 
+#include <oclero/QtAppInstanceMessage.hpp>
+#include <oclero/QtAppInstanceTrace.hpp>
+
 namespace oclero {
 /**
  * @brief Used to ensure only one instance of the application is running at the same time.
+ * Methods may be called from any thread. Signals are emitted in the manager's thread.
+ * Messages sent from other threads go through a lock-free queue, without allocating, and keep their order, also
+ * with the other calls of the same thread. If the queue stays full, the sending thread waits for the connections'.
  */
 class QtAppInstanceManager : public QObject {
   Q_OBJECT
@@ -21,9 +33,140 @@ public:
     Auto,
   };
 
+  /// Defines when sent messages are actually written to the underlying sockets.
+  enum class FlushPolicy {
+    /// Each message is written as soon as it is sent (default).
+    Immediate,
+    /// Messages sent during the same event loop iteration are written at once, when the iteration ends.
+    EndOfIteration,
+    /// Messages are written at once when their accumulated size reaches a threshold, or when a delay expires.
+    Threshold,
+  };
+
+  /// Codec used to compress large messages.
+  enum class Compression {
+    /// Messages are sent as is (default).
+    None,
+    /// qCompress(): smaller output.
+    Zlib,
+    /// LZ4 block format: much faster, for a slightly larger output.
+    Lz4,
+  };
+
+  /// Outcome of forwarding data to the primary instance.
+  enum class ForwardResult {
+    /// The primary instance has acknowledged the data, after emitting secondaryInstanceMessageReceived().
+    Delivered,
+    TimedOut,
+    /// Not a secondary instance, or the connection to the primary instance was lost.
+    Failed,
+  };
+
+  /// Time, in milliseconds, after which a request without response is canceled by default.
+  static constexpr int DefaultRequestTimeout = 5000;
+
+  /// Maximum time, in milliseconds, to wait for the primary instance to acknowledge forwarded data by default.
+  static constexpr int DefaultForwardTimeout = 1000;
+
+  /**
+   * @brief Defines how secondary instances elect a new primary instance when it is lost. Delays are in milliseconds.
+   * The secondary instance with the lowest PID tries first; the other ones wait rankDelay before reconnecting.
+   * Failed attempts are retried after initialDelay, doubled at each consecutive failure up to maxDelay.
+   * A random extra time, up to jitter times the delay, spreads the secondary instances out.
+   */
+  struct ReelectionPolicy {
+    int initialDelay{ 10 };
+    int maxDelay{ 1000 };
+    double jitter{ 0.5 };
+    int rankDelay{ 20 };
+  };
+
+  /**
+   * @brief Defines how instances detect unresponsive ones, e.g. a primary instance that hangs while its process and
+   * socket are still alive. Each instance sends a heartbeat every interval, in milliseconds, to the primary instance
+   * or to each secondary instance. An instance is considered dead after missedThreshold (at least 2) heartbeats
+   * without anything received from it: a hung primary instance is then replaced by a secondary one, and a hung
+   * secondary instance is disconnected. Both instances of a connection must enable heartbeats. An interval of 0
+   * (default) disables them. Pass it to the constructor, in StartupSettings, so that the lease of a new primary
+   * instance expires with its heartbeats from the start.
+   */
+  struct HeartbeatPolicy {
+    int interval{ 0 };
+    int missedThreshold{ 3 };
+  };
+
+  /// Settings that must be known before the role is decided, i.e. before the constructor returns.
+  struct StartupSettings {
+    /// See setShardCount().
+    int shardCount{ 1 };
+    /// See HeartbeatPolicy.
+    HeartbeatPolicy heartbeatPolicy;
+  };
+
+  /// Durations since the manager's construction, in nanoseconds, or -1 if the step was not reached yet.
+  struct StartupTimings {
+    qint64 roleResolved{ -1 };
+    qint64 connectedToPrimary{ -1 };
+    qint64 forwardedToPrimary{ -1 };
+  };
+
+  /// Buffers used to encode and decode messages, since the manager's construction.
+  struct BufferStatistics {
+    /// Buffers allocated because none could be reused. Stays constant in steady state.
+    quint64 allocations{ 0u };
+    quint64 reuses{ 0u };
+  };
+
+  /// Traffic with another instance, since the connection was opened.
+  struct ConnectionStatistics {
+    /// The other instance's id: 0 for the primary instance.
+    quint64 id{ 0u };
+    quint64 messagesReceived{ 0u };
+    quint64 messagesSent{ 0u };
+    quint64 controlFramesReceived{ 0u };
+    quint64 controlFramesSent{ 0u };
+    quint64 bytesReceived{ 0u };
+    quint64 bytesSent{ 0u };
+    /// Queue depth: bytes counted in bytesSent, but not written to the connection yet.
+    qint64 bytesToWrite{ 0 };
+  };
+
+  /**
+   * @brief Totals since the manager's construction. Messages carry the application's data (including stream chunks,
+   * requests and responses), and control frames are the protocol's own ones (e.g. acknowledgments or heartbeats).
+   * Bytes include both, with their headers, and are counted when queued to the connections, whose bytesToWrite are
+   * not written yet. Durations are in nanoseconds.
+   */
+  struct Statistics {
+    /// Bucket i counts latencies from 2^i to 2^(i+1) microseconds. The first and last buckets are open-ended.
+    static constexpr int LatencyBucketCount = 24;
+
+    quint64 messagesReceived{ 0u };
+    quint64 messagesSent{ 0u };
+    quint64 controlFramesReceived{ 0u };
+    quint64 controlFramesSent{ 0u };
+    quint64 bytesReceived{ 0u };
+    quint64 bytesSent{ 0u };
+    /// Times the role was decided again after being lost.
+    quint64 reconnects{ 0u };
+    /// Time spent without role, while electing a new primary instance.
+    qint64 reelectionTime{ 0 };
+    /// Large messages sent through shared memory, and received from it. See setBulkTransferThreshold().
+    quint64 bulkTransfersSent{ 0u };
+    quint64 bulkTransfersReceived{ 0u };
+    /// Duration of the last handshake with the primary instance, or -1.
+    qint64 handshakeDuration{ -1 };
+    /// Round trips of requests and acknowledged messages, e.g. the arguments forwarded in Mode::SingleInstance.
+    std::array<quint64, LatencyBucketCount> latencyHistogram{};
+    /// Connections with the primary instance, the secondary instances, or the other secondary instances.
+    QList<ConnectionStatistics> connections;
+  };
+
   explicit QtAppInstanceManager(QObject* parent = nullptr);
   explicit QtAppInstanceManager(Mode mode, QObject* parent = nullptr);
   explicit QtAppInstanceManager(Mode mode, AppExitMode appExitMode, QObject* parent = nullptr);
+  explicit QtAppInstanceManager(
+    Mode mode, AppExitMode appExitMode, const StartupSettings& settings, QObject* parent = nullptr);
 
   ~QtAppInstanceManager();
 
@@ -31,25 +174,254 @@ public:
   bool isSecondaryInstance() const;
   int secondaryInstanceCount() const;
 
+  /**
+   * @brief Sharding, for applications with many secondary instances: up to this number of primary instances coexist,
+   * each one with its own name, and shares the secondary instances with the other ones. New instances become the
+   * primary instance of the first shard without one, otherwise a secondary instance of the least loaded shard, as
+   * published by each primary instance. Instances only communicate within their shard: ids, broadcasts and topics
+   * are per shard. 1 (default) disables sharding. Meant for Mode::MultipleInstances.
+   * Pass it to the constructor, in StartupSettings, so that the role is decided with it. Changing it later only
+   * affects the instances of removed shards, which decide their role again: the other ones keep their shard.
+   */
+  int shardCount() const;
+  void setShardCount(int count);
+  /// Shard of this instance, from 0 to shardCount() - 1, or -1 while the role is being decided.
+  int shardIndex() const;
+  /// Number of secondary instances of the shard, as published by its primary instance. 0 if it has none.
+  int secondaryInstanceCount(int shard) const;
+  /// Number of secondary instances of all the shards.
+  int totalSecondaryInstanceCount() const;
+
+  /// Id given by the primary instance to this secondary instance, as received by the other instances. 0 otherwise.
+  quint64 instanceId() const;
+
+  /**
+   * @brief Runs the connections in a dedicated thread, so that reading and writing messages doesn't compete with
+   * the manager's thread (e.g. the GUI thread). Signals are still emitted in the manager's thread.
+   * Sent messages are queued to the I/O thread, in order. Disabled by default.
+   * Devices passed to sendStreamToPrimary() or sendStreamToSecondary() are then moved to the I/O thread.
+   * The change is made in the manager's thread: when called from another thread, it waits for the manager's thread
+   * to make it, so it must not be called from the I/O thread (e.g. from a tracing::Sink).
+   */
+  bool ioThreadEnabled() const;
+  void setIoThreadEnabled(bool enabled);
+
+  /**
+   * @brief Fast path for single-instance applications, meant to be called before QCoreApplication::exec().
+   * On a secondary instance, connects to the primary instance, sends the data and waits until the primary instance
+   * acknowledges it, without running the event loop. Returns ForwardResult::Failed on the primary instance.
+   * Must not be used when the primary instance runs in the same thread, as it could not answer.
+   */
+  ForwardResult forwardToPrimary(const QByteArray& data, int timeout = DefaultForwardTimeout);
+
+  /**
+   * @brief Maximum time, in milliseconds, that a secondary instance waits for the primary instance to acknowledge
+   * its arguments in Mode::SingleInstance. The outcome is reported by argumentsForwarded(), then appExitRequested()
+   * is emitted. The arguments are forwarded in the first event loop iteration: set it right after construction.
+   */
+  int forwardTimeout() const;
+  void setForwardTimeout(int timeout);
+
+  /**
+   * @brief Writes all the messages that are waiting to be sent, and blocks until they are written, or until
+   * the timeout in milliseconds expires. Doesn't run the event loop. Call it right before exiting the application,
+   * e.g. in AppExitMode::Manual after the arguments have been sent to the primary instance.
+   */
+  bool waitForMessagesWritten(int timeout = DefaultForwardTimeout);
+
+  /// Where startup time was spent, e.g. to measure how long a secondary instance takes to forward its arguments.
+  StartupTimings startupTimings() const;
+
+  /**
+   * @brief Messages are encoded and decoded in pooled buffers. The data passed to the *Received() signals is such a
+   * buffer: use it in place (e.g. as a QByteArrayView) so that it can be reused for the next message.
+   * Copying it is cheap and safe, but takes it out of the pool. The pool keeps at most 16 buffers of up to 256 KiB,
+   * i.e. 4 MiB at most per manager: larger messages get a new buffer each time.
+   */
+  BufferStatistics bufferStatistics() const;
+
+  /**
+   * @brief Always-on metrics. Totals are relaxed atomic counters, read without waiting for the connections' thread.
+   * The per-connection part is gathered in that thread: when called from another thread (e.g. with the I/O thread
+   * enabled), it blocks until the connections' thread has handled the pending events. Poll it accordingly.
+   */
+  Statistics statistics() const;
+
+  /**
+   * @brief Records the lifecycle of each message (enqueued, written, read, dispatched) in the sink, e.g. a
+   * tracing::ChromeTraceSink, to see where time goes. The sink is called from the connections' thread.
+   * Only available when the library is built with QTAPPINSTANCEMANAGER_TRACING (see tracing::Enabled): otherwise,
+   * nothing is recorded and the hooks compile to nothing. nullptr (default) stops recording.
+   */
+  void setTraceSink(std::shared_ptr<tracing::Sink> sink);
+
   Mode mode() const;
   void setMode(Mode mode);
 
   AppExitMode appExitMode() const;
   void setAppExitMode(AppExitMode appExitMode);
 
+  ReelectionPolicy reelectionPolicy() const;
+  void setReelectionPolicy(const ReelectionPolicy& policy);
+
+  HeartbeatPolicy heartbeatPolicy() const;
+  void setHeartbeatPolicy(const HeartbeatPolicy& policy);
+
+  FlushPolicy flushPolicy() const;
+  void setFlushPolicy(FlushPolicy flushPolicy);
+
+  /// Only used with FlushPolicy::Threshold. Size is in bytes, delay in milliseconds.
+  void setFlushThreshold(qint64 size, int delay);
+
+  /**
+   * @brief Messages of at least this size, in bytes, are passed through shared memory instead of the socket.
+   * Only a small descriptor goes through the socket, and the receiver copies the message out of the segment once,
+   * instead of the several copies made by the socket. 0 (default) disables it.
+   */
+  qint64 bulkTransferThreshold() const;
+  void setBulkTransferThreshold(qint64 size);
+
+  /**
+   * @brief Messages of at least the threshold size, in bytes, are compressed with the codec, if the receiving
+   * instance supports it and if that makes them smaller. Smaller messages are sent as is. Decompression is
+   * transparent: received messages are always passed decompressed.
+   */
+  Compression compression() const;
+  void setCompression(Compression compression);
+  qint64 compressionThreshold() const;
+  void setCompressionThreshold(qint64 size);
+
+  /// Maximum size of the chunks of a stream, in bytes.
+  qint64 streamChunkSize() const;
+  void setStreamChunkSize(qint64 size);
+
+  /**
+   * @brief Maximum number of messages handled per connection before returning to the event loop,
+   * so that a chatty instance can't starve it. 0 (default) means no limit.
+   */
+  int maxMessagesPerRead() const;
+  void setMaxMessagesPerRead(int count);
+
+  /**
+   * @brief Sends a request, and returns a future that receives the response. Requests are matched with their
+   * response by an id, so many of them may be in flight at once. The future is canceled if no response arrives
+   * before the timeout in milliseconds (negative means never), if the connection is lost, or if the other
+   * instance runs an older version of the library.
+   */
+  QFuture<QByteArray> sendRequestToPrimary(const QByteArray& data, int timeout = DefaultRequestTimeout);
+  QFuture<QByteArray> sendRequestToSecondary(
+    const quint64 id, const QByteArray& data, int timeout = DefaultRequestTimeout);
+
+  /**
+   * @brief Topics: instances subscribe to named topics, and the primary instance routes each message published to a
+   * topic only to its subscribers, so that the other instances aren't woken up. Messages published by secondary
+   * instances are relayed by the primary instance. Publishers don't receive their own messages. Subscriptions are
+   * kept when the primary instance changes. Older versions of the library can't use topics.
+   */
+  void subscribe(const QString& topic);
+  void unsubscribe(const QString& topic);
+  bool isSubscribed(const QString& topic) const;
+
+  /**
+   * @brief Sends a typed message, encoded by messages::encode() and tagged with messages::MessageTag<T>, so that
+   * the receiver dispatches it to the callback registered with onMessage<T>() in constant time, without parsing it.
+   * Older versions of the library can't receive typed messages.
+   */
+  template<typename T>
+  void sendToPrimary(const T& message) {
+    sendTypedMessageToPrimary(messages::MessageTag<T>::value, messages::encode(message));
+  }
+
+  template<typename T>
+  void sendToSecondary(const quint64 id, const T& message) {
+    sendTypedMessageToSecondary(id, messages::MessageTag<T>::value, messages::encode(message));
+  }
+
+  template<typename T>
+  void sendToAllSecondaries(const T& message, const QSet<quint64>& exceptIds = {}) {
+    sendTypedMessageToAllSecondaries(messages::MessageTag<T>::value, messages::encode(message), exceptIds);
+  }
+
+  /**
+   * @brief Calls the callback, in the manager's thread, for each received message of type T, with the id of the
+   * sender: a secondary instance's id, or 0 for the primary instance. Replaces the previous callback for this type.
+   * Messages without callback, or that can't be decoded, are ignored.
+   */
+  template<typename T, typename Callback>
+  void onMessage(Callback&& callback) {
+    setMessageHandler(messages::MessageTag<T>::value,
+      [callback = std::forward<Callback>(callback)](const quint64 senderId, const QByteArray& data) {
+        T message{};
+        if (messages::decode(data, message)) {
+          callback(senderId, static_cast<const T&>(message));
+        }
+      });
+  }
+
+  template<typename T>
+  void removeMessageHandler() {
+    setMessageHandler(messages::MessageTag<T>::value, nullptr);
+  }
+
 public slots:
   void sendMessageToPrimary(const QByteArray& data);
-  void sendMessageToSecondary(const unsigned int id, const QByteArray& data);
+  /**
+   * @brief From a secondary instance, the message goes through a direct connection to the other secondary instance,
+   * opened on demand once the primary instance told where it listens, instead of being relayed by the primary
+   * instance. It is received with secondaryInstanceMessageReceived(), and dropped if the instance can't be reached.
+   * Instances only listen once looked up, and check that the connecting instance was looked up by the primary
+   * instance with the id it claims.
+   */
+  void sendMessageToSecondary(const quint64 id, const QByteArray& data);
+  /// Sends the same message to all secondary instances but the excluded ones. Only works on the primary instance.
+  void sendMessageToAllSecondaries(const QByteArray& data, const QSet<quint64>& exceptIds = {});
+  /// Sends the message to the instances subscribed to the topic. Works on both primary and secondary instances.
+  void publish(const QString& topic, const QByteArray& data);
+  /**
+   * @brief Sends the content of the device in chunks, so large payloads never sit whole in memory.
+   * Chunks are read from the device only when the socket has room for them. The device must stay
+   * open until it has been read to its end. Sequential devices (processes, sockets, pipes) end when their read
+   * channel is finished or when they are closed, not when no data is available yet.
+   * Chunks are received with the *StreamChunkReceived() signals.
+   * The device is read in the connections' thread. With the I/O thread, it is moved there: it must then have no
+   * parent and live in the calling thread, and must not be used by the caller anymore. Otherwise it is ignored.
+   */
+  void sendStreamToPrimary(QIODevice* device);
+  void sendStreamToSecondary(const quint64 id, QIODevice* device);
+  /// Answers a request received with primaryInstanceRequestReceived().
+  void sendResponseToPrimary(const unsigned int requestId, const QByteArray& data);
+  /// Answers a request received with secondaryInstanceRequestReceived().
+  void sendResponseToSecondary(const quint64 id, const unsigned int requestId, const QByteArray& data);
+  /**
+   * @brief Writes all the messages that are waiting to be sent, regardless of the flush policy. Messages sent before
+   * the connection to the primary instance is established are written as soon as it is.
+   */
+  void flush();
 
 signals:
   void instanceRoleChanged();
   void primaryInstanceMessageReceived(const QByteArray& data);
-  void secondaryInstanceMessageReceived(const unsigned int id, const QByteArray& data);
+  void secondaryInstanceMessageReceived(const quint64 id, const QByteArray& data);
+  void primaryInstanceStreamChunkReceived(const QByteArray& chunk, bool last);
+  void secondaryInstanceStreamChunkReceived(const quint64 id, const QByteArray& chunk, bool last);
+  void primaryInstanceRequestReceived(const unsigned int requestId, const QByteArray& data);
+  void secondaryInstanceRequestReceived(const quint64 id, const unsigned int requestId, const QByteArray& data);
+  /// Emitted for each message published to a subscribed topic. The id is the publisher's: 0 for the primary instance.
+  void topicMessageReceived(const QString& topic, const quint64 publisherId, const QByteArray& data);
   void modeChanged();
   void appExitModeChanged();
   void appExitRequested();
+  /// Emitted on a secondary instance in Mode::SingleInstance, right before appExitRequested().
+  void argumentsForwarded(ForwardResult result);
 
 private:
+  using MessageHandler = std::function<void(const quint64 senderId, const QByteArray& data)>;
+
+  void sendTypedMessageToPrimary(quint32 tag, const QByteArray& data);
+  void sendTypedMessageToSecondary(const quint64 id, quint32 tag, const QByteArray& data);
+  void sendTypedMessageToAllSecondaries(quint32 tag, const QByteArray& data, const QSet<quint64>& exceptIds);
+  void setMessageHandler(quint32 tag, MessageHandler handler);
+
   struct Impl;
   std::unique_ptr<Impl> _impl;
 };
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace oclero::messages {
+/**
+ * @brief Identifies a message type in the frames, so that receivers dispatch it without parsing it.
+ * Defaults to the type's static messageTag member; specialize it for types that can't have one.
+ * Tags must be unique within the application.
+ *
+ * @code
+ * struct OpenFile {
+ *   QString path;
+ *   int line{ 0 };
+ *
+ *   static constexpr quint32 messageTag = 1;
+ *   // After the members, so that they are declared.
+ *   static constexpr auto fields = std::make_tuple(&OpenFile::path, &OpenFile::line);
+ * };
+ * @endcode
+ */
+template<typename T>
+struct MessageTag {
+  static constexpr quint32 value = T::messageTag;
+};
+
+/**
+ * @brief Types that list their members in a static fields tuple of pointers to members are reflected:
+ * their members are encoded one after the other. Other structs can't be encoded.
+ */
+template<typename T, typename = void>
+struct IsReflected : std::false_type {};
+
+template<typename T>
+struct IsReflected<T, std::void_t<decltype(T::fields)>> : std::true_type {};
+
+/**
+ * @brief Enums are encoded as their underlying type, and checked when decoded, so that a receiver never gets a value
+ * that isn't one of the enumerators. Specialize it for each enum sent in messages:
+ *
+ * @code
+ * template<>
+ * struct EnumValidator<Color> {
+ *   static constexpr bool isValid(Color color) { return color >= Color::Red && color <= Color::Blue; }
+ * };
+ * @endcode
+ */
+template<typename T>
+struct EnumValidator {};
+
+template<typename T, typename = void>
+struct IsValidatedEnum : std::false_type {};
+
+template<typename T>
+struct IsValidatedEnum<T, std::void_t<decltype(EnumValidator<T>::isValid(std::declval<T>()))>>
+  : std::is_enum<T> {};
+
+namespace detail {
+template<typename T>
+struct IsList : std::false_type {};
+
+template<typename T>
+struct IsList<QList<T>> : std::true_type {};
+
+template<typename T>
+constexpr bool isEncodable();
+
+template<typename Tuple, std::size_t... Indexes>
+constexpr bool areFieldsEncodable(std::index_sequence<Indexes...>);
+
+// Only used in decltype().
+template<typename Class, typename Member>
+Member memberType(Member Class::*);
+
+template<typename T>
+constexpr bool isEncodable() {
+  if constexpr (std::is_same_v<T, QByteArray> || std::is_same_v<T, QString>) {
+    return true;
+  } else if constexpr (IsList<T>::value) {
+    return isEncodable<typename T::value_type>();
+  } else if constexpr (IsReflected<T>::value) {
+    using Fields = std::decay_t<decltype(T::fields)>;
+    return areFieldsEncodable<Fields>(std::make_index_sequence<std::tuple_size_v<Fields>>{});
+  } else {
+    // Only values whose every representation is valid, or checked, are copied as is.
+    return std::is_arithmetic_v<T> || IsValidatedEnum<T>::value;
+  }
+}
+
+template<typename Tuple, std::size_t... Indexes>
+constexpr bool areFieldsEncodable(std::index_sequence<Indexes...>) {
+  return (isEncodable<decltype(memberType(std::get<Indexes>(Tuple{})))>() && ...);
+}
+
+// Sizes and lengths are encoded as 32-bit integers.
+using Length = quint32;
+
+template<typename T>
+qsizetype encodedSize(const T& value) {
+  if constexpr (std::is_same_v<T, QByteArray>) {
+    return static_cast<qsizetype>(sizeof(Length)) + value.size();
+  } else if constexpr (std::is_same_v<T, QString>) {
+    return static_cast<qsizetype>(sizeof(Length)) + value.size() * static_cast<qsizetype>(sizeof(char16_t));
+  } else if constexpr (IsList<T>::value) {
+    auto size = static_cast<qsizetype>(sizeof(Length));
+    for (const auto& item : value) {
+      size += encodedSize(item);
+    }
+    return size;
+  } else if constexpr (IsReflected<T>::value) {
+    return std::apply(
+      [&value](auto... fields) {
+        return (qsizetype{ 0 } + ... + encodedSize(value.*fields));
+      },
+      T::fields);
+  } else {
+    return static_cast<qsizetype>(sizeof(T));
+  }
+}
+
+inline void write(char*& dst, const void* src, qsizetype size) {
+  if (size > 0) {
+    std::memcpy(dst, src, static_cast<size_t>(size));
+    dst += size;
+  }
+}
+
+inline bool read(const char*& src, const char* end, void* dst, qsizetype size) {
+  if (end - src < size) {
+    return false;
+  }
+  if (size > 0) {
+    std::memcpy(dst, src, static_cast<size_t>(size));
+    src += size;
+  }
+  return true;
+}
+
+template<typename T>
+void encodeTo(char*& dst, const T& value) {
+  if constexpr (std::is_same_v<T, QByteArray>) {
+    const auto length = static_cast<Length>(value.size());
+    write(dst, &length, sizeof(length));
+    write(dst, value.constData(), value.size());
+  } else if constexpr (std::is_same_v<T, QString>) {
+    const auto length = static_cast<Length>(value.size());
+    write(dst, &length, sizeof(length));
+    write(dst, value.constData(), value.size() * static_cast<qsizetype>(sizeof(char16_t)));
+  } else if constexpr (IsList<T>::value) {
+    const auto length = static_cast<Length>(value.size());
+    write(dst, &length, sizeof(length));
+    for (const auto& item : value) {
+      encodeTo(dst, item);
+    }
+  } else if constexpr (IsReflected<T>::value) {
+    std::apply(
+      [&dst, &value](auto... fields) {
+        (encodeTo(dst, value.*fields), ...);
+      },
+      T::fields);
+  } else {
+    write(dst, &value, sizeof(T));
+  }
+}
+
+template<typename T>
+bool decodeFrom(const char*& src, const char* end, T& value) {
+  if constexpr (std::is_same_v<T, QByteArray> || std::is_same_v<T, QString> || IsList<T>::value) {
+    auto length = Length{ 0u };
+    if (!read(src, end, &length, sizeof(length))) {
+      return false;
+    }
+    if constexpr (std::is_same_v<T, QByteArray>) {
+      if (end - src < static_cast<qsizetype>(length)) {
+        return false;
+      }
+      value = QByteArray(src, static_cast<qsizetype>(length));
+      src += length;
+      return true;
+    } else if constexpr (std::is_same_v<T, QString>) {
+      const auto size = static_cast<qsizetype>(length) * static_cast<qsizetype>(sizeof(char16_t));
+      if (end - src < size) {
+        return false;
+      }
+      value.resize(static_cast<qsizetype>(length));
+      return read(src, end, value.data(), size);
+    } else {
+      // Each item takes at least one byte, except empty reflected types: don't trust the length for the reservation.
+      value.clear();
+      value.reserve(std::min<qsizetype>(static_cast<qsizetype>(length), end - src));
+      for (auto i = Length{ 0u }; i < length; ++i) {
+        typename T::value_type item{};
+        if (!decodeFrom(src, end, item)) {
+          return false;
+        }
+        value.append(std::move(item));
+      }
+      return true;
+    }
+  } else if constexpr (IsReflected<T>::value) {
+    return std::apply(
+      [&src, end, &value](auto... fields) {
+        return (decodeFrom(src, end, value.*fields) && ...);
+      },
+      T::fields);
+  } else if constexpr (std::is_same_v<T, bool>) {
+    // Other byte values than 0 and 1 aren't valid booleans.
+    auto byte = quint8{ 0u };
+    if (!read(src, end, &byte, sizeof(byte)) || byte > 1u) {
+      return false;
+    }
+    value = byte != 0u;
+    return true;
+  } else if constexpr (std::is_enum_v<T>) {
+    auto underlying = std::underlying_type_t<T>{};
+    if (!read(src, end, &underlying, sizeof(underlying)) || !EnumValidator<T>::isValid(static_cast<T>(underlying))) {
+      return false;
+    }
+    value = static_cast<T>(underlying);
+    return true;
+  } else {
+    return read(src, end, &value, sizeof(T));
+  }
+}
+} // namespace detail
+
+/// Tells whether the type can be sent with the typed message API.
+template<typename T>
+constexpr bool isEncodable = detail::isEncodable<T>();
+
+/**
+ * @brief Encodes the message in a compact binary form, in a single allocation. Arithmetic values and enums are copied
+ * as is: both ends must run on the same architecture (size and byte order).
+ */
+template<typename T>
+QByteArray encode(const T& message) {
+  static_assert(isEncodable<T>,
+    "The message type must list its members in T::fields, and enums must specialize messages::EnumValidator.");
+  QByteArray data(detail::encodedSize(message), Qt::Uninitialized);
+  auto* dst = data.data();
+  detail::encodeTo(dst, message);
+  return data;
+}
+
+/// Decodes a message encoded by encode(). Returns false if the data is truncated or has trailing bytes.
+template<typename T>
+bool decode(const QByteArray& data, T& message) {
+  static_assert(isEncodable<T>,
+    "The message type must list its members in T::fields, and enums must specialize messages::EnumValidator.");
+  const auto* src = data.constData();
+  const auto* const end = src + data.size();
+  return detail::decodeFrom(src, end, message) && src == end;
+}
+} // namespace oclero::messages
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+#if !defined(QTAPPINSTANCEMANAGER_TRACING)
+#  define QTAPPINSTANCEMANAGER_TRACING 0
+#endif
+
+namespace oclero::tracing {
+/// Whether the library was built with the QTAPPINSTANCEMANAGER_TRACING option. Otherwise, the hooks compile to nothing.
+constexpr bool Enabled = QTAPPINSTANCEMANAGER_TRACING != 0;
+
+/// Steps of a message's lifecycle.
+enum class Event : quint8 {
+  /// The message was compressed if needed, encoded in a frame, and queued for writing.
+  Enqueue,
+  /// Queued frames were written to the socket, i.e. to the kernel. The sequence is the last one written.
+  Write,
+  /// The frame was decoded from the socket's buffer, and decompressed if needed.
+  Read,
+  /// The signals of the frame were emitted, i.e. its slots were run (or queued, when connected across threads).
+  Dispatch,
+};
+
+struct Record {
+  Event event{ Event::Enqueue };
+  /**
+   * @brief Sequence number of the frame on its connection, from 1, written in its header by the sender: the same frame
+   * has the same number on both ends, even if frames were dropped meanwhile. 0 for frames without one, i.e. encoded
+   * once for several recipients (broadcasts and published messages), or exchanged with a former version.
+   * For writes, the number of the last frame written.
+   */
+  quint64 sequence{ 0u };
+  /// Id of the other end of the connection: 0 for the primary instance.
+  quint64 connectionId{ 0u };
+  /**
+   * @brief Identifies the frame on both ends of a connection between the primary instance and a secondary one,
+   * so that its sending and receiving can be linked across processes: a hash of the secondary instance's id, the
+   * direction and the sequence number. 0 for connections between secondary instances, and for frames without sequence
+   * number.
+   */
+  quint64 flowId{ 0u };
+  /// Start of the event, on a monotonic clock shared by all the processes of the machine, in nanoseconds.
+  qint64 timestamp{ 0 };
+  qint64 duration{ 0 };
+  /// Size of the frame(s), as written or received.
+  qint64 size{ 0 };
+  /// Protocol's frame type, or 0 for writes.
+  quint8 frameType{ 0u };
+};
+
+/// Current time on the clock used by the records, in nanoseconds.
+qint64 now();
+
+/**
+ * @brief Receives the events recorded by an instance, from the thread that runs its connections (see
+ * QtAppInstanceManager::setIoThreadEnabled()). Keep record() short: it runs on the messages' path.
+ */
+class Sink {
+public:
+  virtual ~Sink() = default;
+  virtual void record(const Record& item) = 0;
+};
+
+/**
+ * @brief Keeps the records in memory, up to a maximum count, and exports them in the Chrome trace event format,
+ * that chrome://tracing and Perfetto open. Files written by several processes may be opened together: the
+ * timestamps use the same clock, and flow arrows link each frame's sending to its receiving.
+ * Thread-safe: records may be exported while being recorded.
+ */
+class ChromeTraceSink : public Sink {
+public:
+  explicit ChromeTraceSink(qsizetype maxRecordCount = 1024 * 1024);
+
+  void record(const Record& item) override;
+
+  QList<Record> records() const;
+  /// Records dropped because the maximum count was reached.
+  quint64 droppedRecordCount() const;
+  void clear();
+
+  QByteArray toJson() const;
+  bool writeToFile(const QString& filePath) const;
+
+private:
+  struct ThreadRecord {
+    Record record;
+    quint64 threadId{ 0u };
+  };
+
+  const qsizetype _maxRecordCount{ 0 };
+  mutable QMutex _mutex;
+  QList<ThreadRecord> _records;
+  quint64 _droppedRecordCount{ 0u };
+};
+} // namespace oclero::tracing
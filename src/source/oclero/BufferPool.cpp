@@ -0,0 +1,44 @@
+#include "BufferPool.hpp"
+
+#include <utility>
+
+namespace oclero {
+BufferPool::BufferPool(qsizetype maxBufferCount, qsizetype maxBufferSize)
+  : _maxBufferCount(maxBufferCount)
+  , _maxBufferSize(maxBufferSize) {
+  _buffers.reserve(maxBufferCount);
+}
+
+QByteArray BufferPool::acquire(qsizetype size) {
+  if (size == 0) {
+    return {};
+  }
+
+  // Few buffers are pooled: a linear search is cheaper than keeping them sorted.
+  for (auto i = _buffers.size() - 1; i >= 0; --i) {
+    if (_buffers[i].capacity() >= size) {
+      auto buffer = std::move(_buffers[i]);
+      _buffers.removeAt(i);
+      // The buffer isn't shared and large enough: resizing it doesn't allocate.
+      buffer.resize(size);
+      ++_statistics.reuses;
+      return buffer;
+    }
+  }
+
+  ++_statistics.allocations;
+  return QByteArray(size, Qt::Uninitialized);
+}
+
+void BufferPool::release(QByteArray&& buffer) {
+  if (buffer.isNull() || !buffer.isDetached() || buffer.capacity() > _maxBufferSize
+      || _buffers.size() >= _maxBufferCount) {
+    return;
+  }
+  _buffers.append(std::move(buffer));
+}
+
+BufferPool::Statistics BufferPool::statistics() const {
+  return _statistics;
+}
+} // namespace oclero
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+
+namespace oclero {
+/**
+ * @brief Recycles the buffers used to encode and decode frames, so that steady traffic doesn't allocate.
+ * A buffer returns to the pool only if nobody else holds a copy of it: a receiver that keeps a message
+ * simply takes the buffer out of the pool, and the next frame allocates a new one.
+ */
+class BufferPool {
+public:
+  struct Statistics {
+    /// Buffers that had to be allocated because no pooled buffer was large enough.
+    quint64 allocations{ 0u };
+    /// Buffers taken from the pool.
+    quint64 reuses{ 0u };
+  };
+
+  /// Buffers larger than maxBufferSize, or beyond maxBufferCount, are freed instead of being pooled.
+  /// So the pool retains at most maxBufferCount * maxBufferSize bytes: 4 MiB by default.
+  explicit BufferPool(qsizetype maxBufferCount = 16, qsizetype maxBufferSize = 256 * 1024);
+
+  /// Returns a buffer of the given size. Its content is uninitialized.
+  QByteArray acquire(qsizetype size);
+
+  /// Gives the buffer back to the pool, if it isn't shared.
+  void release(QByteArray&& buffer);
+
+  Statistics statistics() const;
+
+private:
+  qsizetype _maxBufferCount{ 0 };
+  qsizetype _maxBufferSize{ 0 };
+  QList<QByteArray> _buffers;
+  Statistics _statistics;
+};
+} // namespace oclero
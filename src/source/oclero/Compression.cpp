@@ -0,0 +1,202 @@
+#include "Compression.hpp"
+
+#include <QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace oclero::compression {
+namespace {
+constexpr qsizetype SizePrefixSize = sizeof(quint32);
+// Shortest match. Match lengths are encoded minus this value.
+constexpr qsizetype MinMatch = 4;
+// As the format requires, the last bytes are always literals, and the last match starts far enough from the end.
+constexpr qsizetype LastLiterals = 5;
+constexpr qsizetype MatchSearchLimit = 12;
+// Offsets are encoded on 16 bits.
+constexpr qsizetype MaxOffset = 65535;
+// Each compressed byte decompresses to at most this number of bytes. Also enforced for zlib, whose ratio may be
+// higher: such payloads are sent uncompressed.
+constexpr qsizetype MaxRatio = 255;
+constexpr int HashBits = 12;
+
+qsizetype decompressedSize(const QByteArray& compressed) {
+  if (compressed.size() <= SizePrefixSize) {
+    return -1;
+  }
+  const auto size = static_cast<qsizetype>(qFromBigEndian<quint32>(compressed.constData()));
+  // A corrupted prefix must not make the receiver allocate a huge buffer.
+  return size <= (compressed.size() - SizePrefixSize) * MaxRatio ? size : -1;
+}
+
+quint32 read32(const uchar* src) {
+  quint32 value;
+  std::memcpy(&value, src, sizeof(value));
+  return value;
+}
+
+quint32 hash(quint32 sequence) {
+  return (sequence * 2654435761u) >> (32 - HashBits);
+}
+
+uchar* writeLength(uchar* dst, qsizetype length) {
+  while (length >= 255) {
+    *dst++ = 255;
+    length -= 255;
+  }
+  *dst++ = static_cast<uchar>(length);
+  return dst;
+}
+
+// Writes the literals, then the match, unless matchLength is 0 (last sequence).
+uchar* writeSequence(uchar* dst, const uchar* literals, qsizetype literalLength, qsizetype offset,
+  qsizetype matchLength) {
+  auto* const token = dst++;
+  const auto matchCode = matchLength > 0 ? matchLength - MinMatch : 0;
+  *token = static_cast<uchar>((std::min<qsizetype>(literalLength, 15) << 4) | std::min<qsizetype>(matchCode, 15));
+  if (literalLength >= 15) {
+    dst = writeLength(dst, literalLength - 15);
+  }
+  if (literalLength > 0) {
+    std::memcpy(dst, literals, static_cast<size_t>(literalLength));
+    dst += literalLength;
+  }
+  if (matchLength > 0) {
+    *dst++ = static_cast<uchar>(offset & 0xFF);
+    *dst++ = static_cast<uchar>(offset >> 8);
+    if (matchCode >= 15) {
+      dst = writeLength(dst, matchCode - 15);
+    }
+  }
+  return dst;
+}
+
+bool readLength(const uchar*& src, const uchar* const end, qsizetype& length) {
+  auto byte = uchar{ 0 };
+  do {
+    if (src == end) {
+      return false;
+    }
+    byte = *src++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+} // namespace
+
+QByteArray compressLz4(const QByteArray& data) {
+  const auto size = data.size();
+  // Worst case: no match at all, i.e. a token and a length byte per 255 literals.
+  QByteArray compressed(SizePrefixSize + size + size / 255 + 16, Qt::Uninitialized);
+  auto* const dstBegin = reinterpret_cast<uchar*>(compressed.data());
+  qToBigEndian<quint32>(static_cast<quint32>(size), dstBegin);
+  auto* dst = dstBegin + SizePrefixSize;
+
+  const auto* const src = reinterpret_cast<const uchar*>(data.constData());
+  auto anchor = qsizetype{ 0 };
+  if (size > MatchSearchLimit) {
+    // Last position, plus one, of the sequences of 4 bytes with each hash.
+    std::vector<quint32> positions(size_t{ 1 } << HashBits, 0u);
+    const auto matchLimit = size - LastLiterals;
+    const auto searchLimit = size - MatchSearchLimit;
+    auto position = qsizetype{ 0 };
+    while (position < searchLimit) {
+      const auto sequence = read32(src + position);
+      auto& entry = positions[hash(sequence)];
+      const auto candidate = static_cast<qsizetype>(entry) - 1;
+      entry = static_cast<quint32>(position + 1);
+      if (candidate < 0 || position - candidate > MaxOffset || read32(src + candidate) != sequence) {
+        // Skip faster through incompressible data.
+        position += 1 + ((position - anchor) >> 6);
+        continue;
+      }
+
+      auto matchLength = MinMatch;
+      while (position + matchLength < matchLimit && src[candidate + matchLength] == src[position + matchLength]) {
+        ++matchLength;
+      }
+      dst = writeSequence(dst, src + anchor, position - anchor, position - candidate, matchLength);
+      position += matchLength;
+      anchor = position;
+    }
+  }
+  dst = writeSequence(dst, src + anchor, size - anchor, 0, 0);
+
+  compressed.truncate(dst - dstBegin);
+  return compressed;
+}
+
+qsizetype lz4DecompressedSize(const QByteArray& compressed) {
+  return decompressedSize(compressed);
+}
+
+qsizetype zlibDecompressedSize(const QByteArray& compressed) {
+  return decompressedSize(compressed);
+}
+
+bool decompressLz4(const QByteArray& compressed, char* dst, qsizetype dstSize) {
+  if (lz4DecompressedSize(compressed) != dstSize) {
+    return false;
+  }
+
+  const auto* src = reinterpret_cast<const uchar*>(compressed.constData()) + SizePrefixSize;
+  const auto* const srcEnd = reinterpret_cast<const uchar*>(compressed.constData()) + compressed.size();
+  auto* const outBegin = reinterpret_cast<uchar*>(dst);
+  auto* out = outBegin;
+  auto* const outEnd = outBegin + dstSize;
+  for (;;) {
+    if (src == srcEnd) {
+      return false;
+    }
+    const auto token = *src++;
+
+    auto literalLength = static_cast<qsizetype>(token >> 4);
+    if (literalLength == 15 && !readLength(src, srcEnd, literalLength)) {
+      return false;
+    }
+    if (srcEnd - src < literalLength || outEnd - out < literalLength) {
+      return false;
+    }
+    if (literalLength > 0) {
+      std::memcpy(out, src, static_cast<size_t>(literalLength));
+      src += literalLength;
+      out += literalLength;
+    }
+
+    // The last sequence has no match.
+    if (src == srcEnd) {
+      return out == outEnd;
+    }
+
+    if (srcEnd - src < 2) {
+      return false;
+    }
+    const auto offset = static_cast<qsizetype>(src[0] | (src[1] << 8));
+    src += 2;
+    if (offset == 0 || offset > out - outBegin) {
+      return false;
+    }
+
+    auto matchLength = static_cast<qsizetype>(token & 0x0F);
+    if (matchLength == 15 && !readLength(src, srcEnd, matchLength)) {
+      return false;
+    }
+    matchLength += MinMatch;
+    if (outEnd - out < matchLength) {
+      return false;
+    }
+
+    const auto* const match = out - offset;
+    if (offset >= matchLength) {
+      std::memcpy(out, match, static_cast<size_t>(matchLength));
+    } else {
+      // The match overlaps the output: it repeats the last offset bytes.
+      for (auto i = qsizetype{ 0 }; i < matchLength; ++i) {
+        out[i] = match[i];
+      }
+    }
+    out += matchLength;
+  }
+}
+} // namespace oclero::compression
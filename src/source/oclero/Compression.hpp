@@ -0,0 +1,33 @@
+#pragma once
+
+#include <QByteArray>
+
+#include <limits>
+
+namespace oclero::compression {
+/// Whether data of this size fits the 4-byte size prefix written by compressLz4() and qCompress().
+constexpr bool isCompressible(qsizetype size) {
+  return size >= 0 && static_cast<quint64>(size) <= std::numeric_limits<quint32>::max();
+}
+
+/**
+ * @brief Compresses data in the LZ4 block format: fast, without entropy coding. The result is prefixed by the size
+ * of the data (4 bytes, big-endian), like qCompress() does. Data must be smaller than 4 GiB, see isCompressible().
+ */
+QByteArray compressLz4(const QByteArray& data);
+
+/// Returns the size of the data compressed by compressLz4(), or -1 if the prefix is invalid.
+qsizetype lz4DecompressedSize(const QByteArray& compressed);
+
+/**
+ * @brief Returns the size of the data compressed by qCompress(), or -1 if the prefix is invalid or exceeds the ratio
+ * allowed for LZ4, so that qUncompress() is never asked to allocate more than that.
+ */
+qsizetype zlibDecompressedSize(const QByteArray& compressed);
+
+/**
+ * @brief Decompresses data compressed by compressLz4() into dst, which must hold lz4DecompressedSize() bytes.
+ * Returns false if the data is corrupted, without reading or writing out of bounds.
+ */
+bool decompressLz4(const QByteArray& compressed, char* dst, qsizetype dstSize);
+} // namespace oclero::compression
@@ -0,0 +1,70 @@
+#include "FrameDecoder.hpp"
+
+#include <QtEndian>
+
+namespace oclero {
+FrameDecoder::FrameDecoder(protocol::Version version)
+  : _version(version) {}
+
+protocol::Version FrameDecoder::version() const {
+  return _version;
+}
+
+void FrameDecoder::setVersion(protocol::Version version) {
+  _version = version;
+  reset();
+}
+
+void FrameDecoder::reset() {
+  _step = Step::Header;
+  _header = {};
+}
+
+FrameDecoder::Status FrameDecoder::decode(QIODevice& device, Frame& frame, BufferPool* pool) {
+  if (_step == Step::Header) {
+    if (!readHeader(device)) {
+      return Status::NeedMoreData;
+    }
+    _step = Step::Body;
+  }
+
+  if (device.bytesAvailable() < protocol::bodySize(_version, _header.size)) {
+    // Wait for more bytes to be written.
+    return Status::NeedMoreData;
+  }
+
+  if (_version == protocol::Version::Legacy) {
+    // Skip the length written by QDataStream: it is the same as the one in the header.
+    device.skip(protocol::LegacyBodyPrefixSize);
+  }
+
+  // The payload follows the header as is: take it directly from the device's buffer.
+  frame.header = _header;
+  const auto payloadSize = static_cast<qsizetype>(_header.size);
+  if (pool) {
+    frame.payload = pool->acquire(payloadSize);
+    if (payloadSize > 0) {
+      device.read(frame.payload.data(), payloadSize);
+    }
+  } else {
+    frame.payload = device.read(payloadSize);
+  }
+  reset();
+  return Status::FrameReady;
+}
+
+bool FrameDecoder::readHeader(QIODevice& device) {
+  const auto headerSize = protocol::headerSize(_version);
+  if (device.bytesAvailable() < headerSize) {
+    return false;
+  }
+
+  device.read(_headerBuffer, headerSize);
+  if (_version == protocol::Version::Legacy) {
+    _header = protocol::FrameHeader{ protocol::FrameType::Message, 0u, 0u, qFromBigEndian<quint64>(_headerBuffer) };
+  } else {
+    _header = protocol::readFrameHeader(_headerBuffer);
+  }
+  return true;
+}
+} // namespace oclero
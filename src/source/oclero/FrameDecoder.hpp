@@ -0,0 +1,53 @@
+#pragma once
+
+#include "BufferPool.hpp"
+#include "LocalEndpointProtocol.hpp"
+
+#include <QByteArray>
+#include <QIODevice>
+
+namespace oclero {
+/**
+ * @brief Incremental decoder of the frames received on a connection.
+ * Reads directly from the device's buffered bytes: a header is only consumed once it is whole,
+ * and a payload once all its bytes are available, so partial frames never lose progress.
+ */
+class FrameDecoder {
+public:
+  enum class Status {
+    /// The device does not contain a whole frame yet.
+    NeedMoreData,
+    /// A frame has been decoded.
+    FrameReady,
+  };
+
+  struct Frame {
+    protocol::FrameHeader header{};
+    QByteArray payload{};
+  };
+
+  explicit FrameDecoder(protocol::Version version = protocol::Version::Legacy);
+
+  protocol::Version version() const;
+  void setVersion(protocol::Version version);
+
+  /// Forgets any partially decoded frame.
+  void reset();
+
+  /// Decodes at most one frame from the device. If a pool is given, the payload is read into one of its buffers.
+  Status decode(QIODevice& device, Frame& frame, BufferPool* pool = nullptr);
+
+private:
+  enum class Step {
+    Header,
+    Body,
+  };
+
+  bool readHeader(QIODevice& device);
+
+  protocol::Version _version{ protocol::Version::Legacy };
+  Step _step{ Step::Header };
+  protocol::FrameHeader _header{};
+  char _headerBuffer[protocol::FrameHeaderSize]{};
+};
+} // namespace oclero
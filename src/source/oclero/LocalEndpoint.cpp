@@ -1,16 +1,40 @@
 #include "LocalEndpoint.hpp"
+#include "LocalEndpointProtocol.hpp"
+#include "BufferPool.hpp"
+#include "Compression.hpp"
+#include "FrameDecoder.hpp"
+#include "Metrics.hpp"
 
 #include <QLoggingCategory>
 #include <QLocalSocket>
 #include <QLocalServer>
+#include <QAbstractSocket>
+#include <QProcess>
 #include <QSharedMemory>
 #include <QString>
 #include <QTimer>
-#include <QDataStream>
 #include <QCoreApplication>
 #include <QCryptographicHash>
 #include <QRegularExpression>
-
+#include <QHash>
+#include <QSet>
+#include <QPointer>
+#include <QIODevice>
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QPromise>
+#include <QRandomGenerator>
+#include <QThread>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <unordered_map>
 #include <vector>
 
 Q_LOGGING_CATEGORY(LOGCAT_LOCALENDPOINT, "oclero.localEndpoint")
@@ -22,8 +46,34 @@ Q_LOGGING_CATEGORY(LOGCAT_LOCALENDPOINT, "oclero.localEndpoint")
 namespace oclero {
 enum class Step {
   Handshake,
-  Header,
-  Body,
+  Frames,
+};
+
+struct OutgoingStream {
+  QPointer<QIODevice> device{};
+  quint32 id{ 0u };
+  // Sequential devices only end when their read channel is finished, or when they are closed.
+  bool inputFinished{ false };
+  // Read from the device but not sent yet, e.g. its buffer when it was closed.
+  QByteArray pending{};
+  // For legacy endpoints, which receive the whole content as a single message.
+  QByteArray legacyContent{};
+  std::vector<QMetaObject::Connection> connections{};
+};
+
+struct PendingRequest {
+  QPromise<QByteArray> promise;
+  QDeadlineTimer deadline;
+  // Measures the round trip, for the latency histogram.
+  QElapsedTimer elapsed;
+};
+
+// A frame sent before the handshake, waiting for the protocol version to be known.
+struct PendingFrame {
+  QByteArray data;
+  protocol::FrameType type{ protocol::FrameType::Message };
+  quint8 flags{ 0u };
+  quint32 tag{ 0u };
 };
 
 struct SocketConnectionInfo {
@@ -31,23 +81,195 @@ struct SocketConnectionInfo {
   LocalEndpoint::Id id{ 0u };
   Step step{ Step::Handshake };
   quint64 pid{ 0u };
-  quint64 bodySize{ 0u };
+  protocol::Version version{ protocol::Version::Legacy };
+  FrameDecoder decoder{};
+  // Set when the frame budget was exhausted and the remaining frames will be read later.
+  bool readScheduled{ false };
+  // Frames waiting to be written, according to the flush policy.
+  QByteArrayList outgoing{};
+  qint64 outgoingSize{ 0 };
+  // Streams waiting to be sent, one after the other.
+  std::deque<OutgoingStream> streams{};
+  quint32 nextStreamId{ 0u };
+  bool pumpingStreams{ false };
+  // Shared memory transfers sent to this endpoint and not released yet.
+  QList<quint32> bulkTransfers{};
+  // Requests sent to this endpoint and waiting for their response, by id.
+  std::unordered_map<quint32, PendingRequest> requests{};
+  quint32 nextRequestId{ 0u };
+  // Last succession rank sent to this client (server side only).
+  std::optional<quint32> successionRank{};
+  // Topics this client is subscribed to (server side only).
+  QSet<QByteArray> topics{};
+  // Name on which this client listens for its peers, once it confirmed it, and the secret from which the tokens of
+  // its peers are derived (server side only). Only given the first time another client looks this client up.
+  QByteArray peerName{};
+  QByteArray peerSecret{};
+  // Clients that looked this client up, waiting for it to listen (server side only).
+  std::vector<LocalEndpoint::Id> peerLookups{};
+  // Optional features advertised by the other endpoint in its handshake.
+  quint16 capabilities{ 0u };
+  // Traffic of this connection. Only read in the endpoint's thread, unlike the endpoint's totals.
+  quint64 messagesReceived{ 0u };
+  quint64 messagesSent{ 0u };
+  quint64 controlFramesReceived{ 0u };
+  quint64 controlFramesSent{ 0u };
+  quint64 bytesReceived{ 0u };
+  quint64 bytesSent{ 0u };
+  // Sequence numbers of the last messages sent and received, written in their header so that both ends agree.
+  // Control frames, e.g. heartbeats, take none.
+  quint64 sentSequence{ 0u };
+  quint64 receivedSequence{ 0u };
+  // Milliseconds without any frame after which the other endpoint is considered dead, as advertised by its
+  // heartbeats. 0 until its first heartbeat, i.e. not checked.
+  qint64 heartbeatTimeout{ 0 };
+  // Restarted at each frame received. Started when the connection is opened.
+  QElapsedTimer lastReceived{};
+};
+
+struct BulkSegment {
+  std::unique_ptr<QSharedMemory> sharedMemory;
+  // Number of endpoints that have not released the segment yet.
+  int references{ 0 };
 };
 
 struct LocalEndpoint::Impl {
+  // Maximum time, in milliseconds, for a closed socket to write its pending data before being aborted.
+  static constexpr auto SocketCloseTimeout = 1000;
+  // Maximum time, in milliseconds, between two attempts to get a role while a shared memory is being released.
+  static constexpr auto RoleRetryMaxDelay = 16;
+
   LocalEndpoint& owner;
-  const QString socketName{ Impl::getSocketName() };
+  // Name shared by all the instances of the application, and used as is by shard 0.
+  const QString baseName{ Impl::getSocketName() };
+  // Up to this number of servers coexist, each one with its own name and shared memory.
+  int shardCount{ 1 };
+  // Shard of the server, or of the server the client connects to. -1 until the role is decided.
+  int shard{ -1 };
+  // Shard whose shared memory could neither be created nor attached by the last attempt to get a role, if any.
+  int releasingShard{ -1 };
+  QString socketName{ baseName };
+  // Guards the shard's name, and holds the number of clients of its server.
   QSharedMemory sharedMemory{ socketName };
   Role role{ Role::Unknown };
 
   std::unique_ptr<QLocalServer> server{};
-  std::vector<SocketConnectionInfo> serverClients;
+  // Connected clients, indexed by id and by socket.
+  std::unordered_map<Id, SocketConnectionInfo> serverClients;
+  QHash<const QLocalSocket*, Id> serverClientIds;
+  // Ids are allocated incrementally and never reused during the server's lifetime. 0 is the server's id.
+  Id nextClientId{ 1u };
+  // Subscribed clients, by topic, so that a published message only costs its subscribers.
+  QHash<QByteArray, QSet<Id>> topicSubscribers;
+
+  // Topics this endpoint is subscribed to, whatever its role.
+  QSet<QByteArray> subscriptions;
 
   SocketConnectionInfo clientSocketInfo;
   std::unique_ptr<QLocalSocket> client{};
+  // Frames sent before the protocol version is known (i.e. before the handshake).
+  QList<PendingFrame> clientPendingFrames;
+  // Set when a flush was requested while frames were waiting for the handshake: they are written right after it.
+  bool clientPendingFlush{ false };
+
+  // Direct connections with the other clients, opened on demand. Ids are given by the server, so they are all
+  // closed when the server changes.
+  std::unique_ptr<QLocalServer> peerServer{};
+  // Given by the server with the name on which to listen. Peers must connect with a token derived from it.
+  QByteArray peerSecret;
+  std::unordered_map<const QLocalSocket*, SocketConnectionInfo> peers;
+  // Connection used to send messages to each peer.
+  QHash<Id, const QLocalSocket*> peerSockets;
+  // Messages waiting for the peer's name or for the connection, by peer id.
+  std::unordered_map<Id, QList<QByteArray>> peerPendingMessages;
+
+  // Buffers of the frames being encoded or decoded, recycled once written or handled.
+  BufferPool bufferPool;
+  // Small frames are coalesced here before being written.
+  QByteArray writeBatch;
+
+  FlushPolicy flushPolicy{ FlushPolicy::Immediate };
+  qint64 flushThresholdSize{ 64 * 1024 };
+  int flushThresholdDelay{ 5 };
+  QTimer flushTimer{ &owner };
+  bool flushScheduled{ false };
+
+  qint64 streamChunkSize{ 64 * 1024 };
+
+  // Messages at least this large go through shared memory. 0 means disabled.
+  qint64 bulkTransferThreshold{ 0 };
+  std::unordered_map<quint32, BulkSegment> bulkSegments;
+  quint32 nextBulkTransferId{ 0u };
+
+  // Maximum number of frames handled per event loop iteration and connection. 0 means no limit.
+  int maxFramesPerRead{ 0 };
+
+  // Payloads at least this large are compressed, if the receiver supports the codec.
+  Compression compression{ Compression::None };
+  qint64 compressionThreshold{ 4 * 1024 };
+
+  // Fires when the earliest request deadline expires.
+  QTimer requestTimer{ &owner };
+
+  // Sockets closed by closeSocket(), until they are deleted. Aborted when the endpoint is destroyed.
+  std::vector<QPointer<QLocalSocket>> closingSockets;
+
+  QTimer restartTimer{ &owner };
+  ReelectionPolicy reelectionPolicy;
+  // Consecutive attempts to get a role, for the backoff. Reset once connected or server.
+  int restartAttempts{ 0 };
+  // Rank given by the server, used to replace it if it is lost.
+  std::optional<quint32> successionRank;
+
+  HeartbeatPolicy heartbeatPolicy;
+  // Sends the heartbeats and checks the other endpoints' ones. Only runs when heartbeats are enabled.
+  QTimer heartbeatTimer{ &owner };
+  // Identifies the server's term in the shard's shared memory, so that it notices if it was replaced.
+  quint64 leaseToken{ 0u };
+
+  QElapsedTimer startupTimer;
+  StartupTimings startupTimings;
+
+  // Always on, and readable from any thread.
+  TrafficCounters traffic;
+  LatencyHistogram latency;
+  Counter reconnects;
+  Counter reelectionTime;
+  Counter bulkTransfersSent;
+  Counter bulkTransfersReceived;
+  std::atomic<qint64> handshakeDuration{ -1 };
+  // Started when the role is lost, until it is decided again.
+  QElapsedTimer reelectionTimer;
+  bool hadRole{ false };
+  // Started when the client connects to the server, until the handshake is done.
+  QElapsedTimer handshakeTimer;
+
+  // Receives the lifecycle events of the frames. Only used when built with QTAPPINSTANCEMANAGER_TRACING.
+  std::shared_ptr<tracing::Sink> traceSink;
 
   Impl(LocalEndpoint& o)
-    : owner(o) {}
+    : owner(o) {
+    startupTimer.start();
+
+    restartTimer.setSingleShot(true);
+    QObject::connect(&restartTimer, &QTimer::timeout, &owner, [this]() {
+      init();
+    });
+
+    flushTimer.setSingleShot(true);
+    QObject::connect(&flushTimer, &QTimer::timeout, &owner, [this]() {
+      flushAll();
+    });
+
+    requestTimer.setSingleShot(true);
+    QObject::connect(&requestTimer, &QTimer::timeout, &owner, [this]() {
+      expireRequests();
+    });
+
+    QObject::connect(&heartbeatTimer, &QTimer::timeout, &owner, [this]() {
+      onHeartbeatTimeout();
+    });
+  }
 
   ~Impl() {
 #if LOGCAT_LOCALENDPOINT
@@ -58,12 +280,30 @@ struct LocalEndpoint::Impl {
     }
 #endif
 
+    // Don't lose queued messages.
+    flushAll();
+
     clearServer();
     clearClient();
+    abortClosingSockets();
+  }
+
+  // The event loop may not run anymore to finish closing them: write what can be without blocking, then drop the
+  // rest, so that destroying the endpoint never waits for slow readers.
+  void abortClosingSockets() {
+    for (const auto& socket : std::as_const(closingSockets)) {
+      if (socket) {
+        socket->flush();
+        socket->abort();
+        delete socket.data();
+      }
+    }
+    closingSockets.clear();
   }
 
   void clear() {
     role = Role::Unknown;
+    shard = -1;
 
     clearServer();
     clearClient();
@@ -73,72 +313,586 @@ struct LocalEndpoint::Impl {
   }
 
   void restart() {
+    if (!reelectionTimer.isValid()) {
+      reelectionTimer.start();
+    }
     sharedMemory.detach();
-    QTimer::singleShot(0, [this]() {
-      init();
-    });
+    restartTimer.start(getRestartDelay());
+  }
+
+  int getRestartDelay() {
+    const auto attempt = restartAttempts++;
+    const auto rank = std::exchange(successionRank, std::nullopt);
+    if (attempt == 0 && rank) {
+      // The server was lost. Its successor (the client with the lowest PID) tries to replace it right away.
+      // The other clients give it time to, and spread out so they don't all reconnect at once.
+      return *rank == 0 ? 0 : addJitter(reelectionPolicy.rankDelay);
+    }
+
+    // Exponential backoff, so failed attempts don't keep all the CPUs busy.
+    auto delay = qint64{ reelectionPolicy.initialDelay };
+    for (auto i = 0; i < attempt && delay < reelectionPolicy.maxDelay; ++i) {
+      delay *= 2;
+    }
+    return addJitter(static_cast<int>(std::min<qint64>(delay, reelectionPolicy.maxDelay)));
+  }
+
+  int addJitter(int delay) const {
+    // Only add time, so the delay never goes below the policy's minimum.
+    const auto jitter = delay * reelectionPolicy.jitter * QRandomGenerator::global()->generateDouble();
+    return delay + static_cast<int>(jitter);
   }
 
   void init() {
-    // We use a shared memory as a mutex, so we have only one server instance at a time.
-    static constexpr auto SHARED_MEMORY_SIZE = 1;
+    if (!tryInit()) {
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "Restarting...";
+#endif
+      restart();
+    }
+  }
 
+  // Returns false if the role can't be decided yet, e.g. because the former server's shared memory
+  // is still being destroyed.
+  bool tryInit() {
     clear();
+    releasingShard = -1;
+
+    // We use a shared memory per shard as a mutex, so we have only one server instance at a time per shard.
+    // The first shards without server are taken first. Otherwise, we connect to the least loaded one.
+    auto leastLoadedShard = -1;
+    auto lowestLoad = std::numeric_limits<int>::max();
+    auto equallyLoadedShards = 0;
+    for (auto index = 0; index < shardCount; ++index) {
+      // Detaches from the previous shard's shared memory, if any.
+      sharedMemory.setKey(getShardName(index));
+      if (sharedMemory.create(ShardMemorySize)) {
+        initShardState();
+        startServer(index, 0u);
+        return true;
+      } else if (sharedMemory.attach()) {
+        if (const auto generation = tryTakeOverShard()) {
+          // The shard's server stopped renewing its lease, e.g. because it hangs: replace it.
+          startServer(index, *generation);
+          return true;
+        }
+        // Without sharding, no need to compare loads.
+        const auto load = shardCount > 1 ? readLoad(sharedMemory) : 0;
+        if (load < lowestLoad) {
+          lowestLoad = load;
+          leastLoadedShard = index;
+          equallyLoadedShards = 1;
+        } else if (load == lowestLoad && QRandomGenerator::global()->bounded(++equallyLoadedShards) == 0) {
+          // Pick one at random, so that clients starting at the same time spread out.
+          leastLoadedShard = index;
+        }
+      } else if (releasingShard < 0) {
+        releasingShard = index;
+      }
+    }
+
+    if (leastLoadedShard < 0) {
+      return false;
+    }
+    if (!sharedMemory.isAttached() || sharedMemory.key() != getShardName(leastLoadedShard)) {
+      sharedMemory.setKey(getShardName(leastLoadedShard));
+      if (!sharedMemory.attach()) {
+        releasingShard = leastLoadedShard;
+        return false;
+      }
+    }
 
-    if (sharedMemory.create(SHARED_MEMORY_SIZE, QSharedMemory::ReadOnly)) {
+    setShard(leastLoadedShard, readShardState(sharedMemory).generation);
 #if LOGCAT_LOCALENDPOINT
-      qCDebug(LOGCAT_LOCALENDPOINT) << "Starting in server mode...";
+    qCDebug(LOGCAT_LOCALENDPOINT) << "Starting in client mode, shard" << leastLoadedShard;
 #endif
-      role = Role::Server;
-      initServer();
-      emit owner.roleChanged();
-    } else if (sharedMemory.attach()) {
+    role = Role::Client;
+    onRoleResolved();
+    initClient();
+    emit owner.roleChanged();
+    return true;
+  }
+
+  void startServer(int index, quint32 generation) {
+    setShard(index, generation);
 #if LOGCAT_LOCALENDPOINT
-      qCDebug(LOGCAT_LOCALENDPOINT) << "Starting in client mode...";
+    qCDebug(LOGCAT_LOCALENDPOINT) << "Starting in server mode, shard" << index << "generation" << generation;
 #endif
-      role = Role::Client;
-      initClient();
-      emit owner.roleChanged();
+    role = Role::Server;
+    restartAttempts = 0;
+    onRoleResolved();
+    initServer();
+    emit owner.roleChanged();
+  }
+
+#pragma region Shards
+
+  // Content of each shard's shared memory, written under its lock. Former versions only wrote the load.
+  struct ShardState {
+    // Number of clients of the shard's server.
+    quint32 load{ 0u };
+    // Incremented each time the server is replaced without having left.
+    quint32 generation{ 0u };
+    // Identifies the server's term.
+    quint64 leaseToken{ 0u };
+    // Last time the server proved it was responsive, on the steady clock, in nanoseconds, and the time after which
+    // another endpoint may replace it. 0 means never, i.e. heartbeats are disabled.
+    qint64 leaseRenewal{ 0 };
+    qint64 leaseTimeout{ 0 };
+  };
+  static constexpr qsizetype ShardMemorySize = sizeof(ShardState);
+
+  QString getShardName(int index) const {
+    // Shard 0 keeps the name used without sharding, so that both can communicate.
+    return index == 0 ? baseName : QStringLiteral("%1-%2").arg(baseName).arg(index);
+  }
+
+  void setShard(int index, quint32 generation) {
+    shard = index;
+    socketName = getServerName(index, generation);
+  }
+
+  QString getServerName(int index, quint32 generation) const {
+    // A replaced server still listens, and would remove the socket file of the same name (on Unix) when it closes.
+    return generation == 0u ? getShardName(index) : QStringLiteral("%1-g%2").arg(getShardName(index)).arg(generation);
+  }
+
+  // Name the shard's server listens on, as published in its shared memory, or its base name if it can't be read.
+  QString getServerName(int index) const {
+    QSharedMemory memory(getShardName(index));
+    auto generation = quint32{ 0u };
+    if (memory.attach(QSharedMemory::ReadOnly)) {
+      generation = readShardState(memory).generation;
+      memory.detach();
+    }
+    return getServerName(index, generation);
+  }
+
+  void setShardCount(int count) {
+    if (count == shardCount) {
+      return;
+    }
+    shardCount = count;
+
+    // Endpoints of removed shards must leave. The other ones keep their connections: new shards are filled by the
+    // endpoints that start, or lose their server, from now on. Without a role yet, the next attempt uses the new count.
+    if (role != Role::Unknown && shard >= shardCount) {
+      restartTimer.stop();
+      restartAttempts = 0;
+      init();
+    }
+  }
+
+  static ShardState readShardState(QSharedMemory& memory) {
+    // Servers of former versions publish less, or nothing: the missing fields stay 0.
+    auto state = ShardState{};
+    memory.lock();
+    std::memcpy(&state, memory.constData(), static_cast<size_t>(std::min(memory.size(), ShardMemorySize)));
+    memory.unlock();
+    return state;
+  }
+
+  static int readLoad(QSharedMemory& memory) {
+    const auto load = readShardState(memory).load;
+    return static_cast<int>(std::min<quint32>(load, std::numeric_limits<int>::max()));
+  }
+
+  // Called by the server each time its number of clients changes.
+  void publishLoad() {
+    updateShardState([this](ShardState& state) {
+      state.load = static_cast<quint32>(serverClients.size());
+    });
+  }
+
+  // Called with the shard's memory locked, when it was just created, or when its server is replaced.
+  void startLease(ShardState& state) {
+    // Never 0, so that it can't match the servers of former versions.
+    leaseToken = QRandomGenerator::global()->generate64() | 1u;
+    state.load = 0u;
+    state.leaseToken = leaseToken;
+    state.leaseRenewal = getSteadyTime();
+    state.leaseTimeout = getHeartbeatTimeout() * 1000 * 1000;
+  }
+
+  void initShardState() {
+    auto state = ShardState{};
+    sharedMemory.lock();
+    startLease(state);
+    std::memcpy(sharedMemory.data(), &state, sizeof(state));
+    sharedMemory.unlock();
+  }
+
+  // Replaces the shard's server if its lease expired, and returns the new generation. Done under the lock, so
+  // that only one endpoint replaces it.
+  std::optional<quint32> tryTakeOverShard() {
+    if (sharedMemory.size() < ShardMemorySize) {
+      return std::nullopt;
+    }
+    auto state = ShardState{};
+    sharedMemory.lock();
+    std::memcpy(&state, sharedMemory.constData(), sizeof(state));
+    const auto expired = state.leaseTimeout > 0 && getSteadyTime() - state.leaseRenewal > state.leaseTimeout;
+    if (expired) {
+      ++state.generation;
+      startLease(state);
+      std::memcpy(sharedMemory.data(), &state, sizeof(state));
+    }
+    sharedMemory.unlock();
+    return expired ? std::optional<quint32>{ state.generation } : std::nullopt;
+  }
+
+  // Updates the shard's state, unless this server was replaced. Returns false in that case.
+  template<typename Function>
+  bool updateShardState(const Function& function) {
+    if (!sharedMemory.isAttached() || sharedMemory.size() < ShardMemorySize) {
+      return true;
+    }
+    auto state = ShardState{};
+    sharedMemory.lock();
+    std::memcpy(&state, sharedMemory.constData(), sizeof(state));
+    const auto owned = state.leaseToken == leaseToken;
+    if (owned) {
+      function(state);
+      std::memcpy(sharedMemory.data(), &state, sizeof(state));
+    }
+    sharedMemory.unlock();
+    return owned;
+  }
+
+  bool renewLease() {
+    return updateShardState([this](ShardState& state) {
+      state.leaseRenewal = getSteadyTime();
+      state.leaseTimeout = getHeartbeatTimeout() * 1000 * 1000;
+    });
+  }
+
+  // Lets another endpoint replace this server right away, if heartbeats are enabled, rather than when the lease
+  // expires: its clients may keep the shared memory alive after it left.
+  void releaseLease() {
+    updateShardState([](ShardState& state) {
+      if (state.leaseTimeout > 0) {
+        state.leaseRenewal = getSteadyTime() - state.leaseTimeout - 1;
+      }
+    });
+  }
+
+  static qint64 getSteadyTime() {
+    // Monotonic and system-wide, so that the lease can be checked by other processes.
+    const auto time = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+  }
+
+  // Number of clients of each shard, as published by their server, or -1 if there is no server.
+  QList<int> getShardLoads() const {
+    QList<int> loads;
+    loads.reserve(shardCount);
+    for (auto index = 0; index < shardCount; ++index) {
+      if (role == Role::Server && index == shard) {
+        loads.append(static_cast<int>(serverClients.size()));
+        continue;
+      }
+      QSharedMemory memory(getShardName(index));
+      if (memory.attach(QSharedMemory::ReadOnly)) {
+        loads.append(readLoad(memory));
+        memory.detach();
+      } else {
+        loads.append(-1);
+      }
+    }
+    return loads;
+  }
+
+#pragma endregion
+
+#pragma region Heartbeats
+
+  // Milliseconds without any frame after which this endpoint may be considered dead. 0 if heartbeats are disabled.
+  // At least two intervals, so that a heartbeat that is merely late is not taken for a missed one.
+  qint64 getHeartbeatTimeout() const {
+    return qint64{ heartbeatPolicy.interval } * heartbeatPolicy.missedThreshold;
+  }
+
+  void setHeartbeatPolicy(const HeartbeatPolicy& policy) {
+    heartbeatPolicy.interval = std::max(0, policy.interval);
+    heartbeatPolicy.missedThreshold = std::max(2, policy.missedThreshold);
+    if (heartbeatPolicy.interval > 0) {
+      heartbeatTimer.start(heartbeatPolicy.interval);
     } else {
+      heartbeatTimer.stop();
+    }
+
+    if (role == Role::Server) {
+      renewLease();
+    }
+  }
+
+  void onHeartbeatTimeout() {
+    if (role == Role::Server) {
+      // Renewed before sending the heartbeats: once a client misses them, the lease has expired too.
+      if (!renewLease()) {
+        stepDown();
+        return;
+      }
+
+      // Sending and aborting may remove clients.
+      std::vector<Id> ids;
+      ids.reserve(serverClients.size());
+      for (const auto& [id, socketInfo] : serverClients) {
+        Q_UNUSED(socketInfo)
+        ids.push_back(id);
+      }
+      for (const auto id : ids) {
+        auto* const socketInfo = findClient(id);
+        if (!socketInfo) {
+          continue;
+        }
+        if (isUnresponsive(*socketInfo)) {
 #if LOGCAT_LOCALENDPOINT
-      qCDebug(LOGCAT_LOCALENDPOINT) << "Restarting...";
+          qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Client" << id << "is unresponsive, disconnecting it";
 #endif
-      restart();
+          auto* const socket = socketInfo->socket;
+          removeClient(socket);
+          socket->abort();
+          socket->deleteLater();
+        } else {
+          sendHeartbeat(*socketInfo);
+        }
+      }
+    } else if (role == Role::Client && client) {
+      if (isUnresponsive(clientSocketInfo)) {
+        onServerUnresponsive();
+      } else {
+        sendHeartbeat(clientSocketInfo);
+      }
+    }
+  }
+
+  void sendHeartbeat(SocketConnectionInfo& socketInfo) {
+    // Legacy endpoints can't skip unknown frames.
+    const auto& socket = socketInfo.socket;
+    if (heartbeatPolicy.interval > 0 && socketInfo.step == Step::Frames
+        && socketInfo.version != protocol::Version::Legacy && socket
+        && socket->state() == QLocalSocket::LocalSocketState::ConnectedState) {
+      const auto timeout =
+        static_cast<quint32>(std::min<qint64>(getHeartbeatTimeout(), std::numeric_limits<quint32>::max()));
+      enqueue(socketInfo, {}, protocol::FrameType::Heartbeat, 0u, timeout);
+    }
+  }
+
+  // Whether nothing was received from the other endpoint for longer than its heartbeats allow. During the
+  // handshake, i.e. before any heartbeat, this endpoint's own timeout applies.
+  bool isUnresponsive(const SocketConnectionInfo& socketInfo) const {
+    const auto timeout = socketInfo.step == Step::Handshake ? getHeartbeatTimeout() : socketInfo.heartbeatTimeout;
+    return timeout > 0 && socketInfo.lastReceived.isValid() && socketInfo.lastReceived.hasExpired(timeout);
+  }
+
+  void onServerUnresponsive() {
+#if LOGCAT_LOCALENDPOINT
+    qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Server is unresponsive, replacing it";
+#endif
+    // Its lease has expired too, so the successor takes the shard over.
+    clearClient();
+    restart();
+  }
+
+  // Called by a server that was replaced, e.g. because it was stopped for too long. It becomes a client of its
+  // replacement.
+  void stepDown() {
+#if LOGCAT_LOCALENDPOINT
+    qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Replaced by another server, stepping down";
+#endif
+    clear();
+    restart();
+  }
+
+#pragma endregion
+
+  void onRoleResolved() {
+    if (reelectionTimer.isValid()) {
+      reelectionTime.add(static_cast<quint64>(reelectionTimer.nsecsElapsed()));
+      reelectionTimer.invalidate();
+    }
+    if (std::exchange(hadRole, true)) {
+      reconnects.add();
+    }
+
+    if (startupTimings.roleResolved < 0) {
+      startupTimings.roleResolved = startupTimer.nsecsElapsed();
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "Role resolved in" << startupTimings.roleResolved / 1000 << "us";
+#endif
+    }
+  }
+
+  // Tries to decide the role synchronously, instead of waiting for the restart timer.
+  bool waitForRole(const QDeadlineTimer& deadline) {
+    auto retryDelay = 1;
+    while (role == Role::Unknown) {
+      restartTimer.stop();
+      if (tryInit()) {
+        break;
+      }
+      if (deadline.hasExpired() || !isSharedMemoryBeingReleased()) {
+        restart();
+        return false;
+      }
+      if (!waitForServerExit(std::max(0, releasingShard), deadline)) {
+        // No server to wait for: the shared memory is about to be released.
+        const auto remainingTime = deadline.remainingTime();
+        QThread::msleep(static_cast<unsigned long>(
+          remainingTime < 0 ? retryDelay : std::min<qint64>(retryDelay, remainingTime)));
+        retryDelay = std::min(retryDelay * 2, RoleRetryMaxDelay);
+      }
+    }
+    return true;
+  }
+
+  // The shared memory can neither be created nor attached while its owner destroys it. Other errors won't go away.
+  bool isSharedMemoryBeingReleased() const {
+    const auto error = sharedMemory.error();
+    return error == QSharedMemory::NoError || error == QSharedMemory::AlreadyExists || error == QSharedMemory::NotFound;
+  }
+
+  // The shared memory is released when its server leaves: wait for the server of the shard to close its socket,
+  // instead of polling. Returns false if the socket is already closed, in which case the shared memory is about to
+  // be released.
+  bool waitForServerExit(int index, const QDeadlineTimer& deadline) const {
+    QLocalSocket probe;
+    probe.connectToServer(getServerName(index));
+    if (!probe.waitForConnected(getRemainingTime(deadline))) {
+      return false;
+    }
+    probe.waitForDisconnected(getRemainingTime(deadline));
+    return true;
+  }
+
+  // Writes all queued frames, and blocks until the sockets have written them.
+  bool waitForBytesWritten(const QDeadlineTimer& deadline) {
+    // Frames sent before the handshake can only be written after it.
+    if (client && !clientPendingFrames.isEmpty() && !waitForHandshake(deadline)) {
+      return false;
+    }
+    flushAll();
+
+    // Writing may remove connections.
+    QList<QPointer<QLocalSocket>> sockets;
+    if (client) {
+      sockets.append(client.get());
+    }
+    for (const auto& [id, socketInfo] : serverClients) {
+      Q_UNUSED(id)
+      sockets.append(socketInfo.socket);
+    }
+    for (const auto& [socket, socketInfo] : peers) {
+      Q_UNUSED(socket)
+      sockets.append(socketInfo.socket);
+    }
+
+    for (const auto& socket : std::as_const(sockets)) {
+      while (socket && socket->state() == QLocalSocket::ConnectedState && socket->bytesToWrite() > 0) {
+        if (!socket->waitForBytesWritten(getRemainingTime(deadline))) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  bool waitForHandshake(const QDeadlineTimer& deadline) {
+    // The handshake is sent as soon as the socket is connected, then answered by the server.
+    if (client->state() != QLocalSocket::ConnectedState && !client->waitForConnected(getRemainingTime(deadline))) {
+      return false;
+    }
+    while (client && clientSocketInfo.step == Step::Handshake) {
+      if (!client->waitForReadyRead(getRemainingTime(deadline))) {
+        return false;
+      }
+    }
+    return client != nullptr;
+  }
+
+  static int getRemainingTime(const QDeadlineTimer& deadline) {
+    // -1 means forever, for QLocalSocket::waitFor*() too.
+    return static_cast<int>(std::min<qint64>(deadline.remainingTime(), std::numeric_limits<int>::max()));
+  }
+
+  // Sends a message to the server without running the event loop: connects, waits for the handshake,
+  // then for the server to acknowledge the message.
+  ForwardResult forwardToServer(const QByteArray& data, const QDeadlineTimer& deadline) {
+    const auto getFailure = [&deadline]() {
+      return deadline.hasExpired() ? ForwardResult::TimedOut : ForwardResult::Failed;
+    };
+
+    if (!waitForRole(deadline) || role != Role::Client || !client) {
+      return getFailure();
+    }
+    if (!waitForHandshake(deadline)) {
+      return getFailure();
+    }
+
+    // Wait for the server to acknowledge the message.
+    const auto future = sendAcknowledgedMessage(clientSocketInfo, data, getRemainingTime(deadline));
+    flushAll();
+    while (!future.isFinished()) {
+      // Frames left over by the read budget don't trigger readyRead again.
+      if (client && client->bytesAvailable() > 0) {
+        const auto available = client->bytesAvailable();
+        readServerFrames();
+        if (!client || client->bytesAvailable() != available) {
+          continue;
+        }
+      }
+      if (!client || !client->waitForReadyRead(getRemainingTime(deadline))) {
+        return getFailure();
+      }
+    }
+    if (future.isCanceled() || !waitForBytesWritten(deadline)) {
+      return getFailure();
     }
+
+    startupTimings.forwarded = startupTimer.nsecsElapsed();
+#if LOGCAT_LOCALENDPOINT
+    qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Message forwarded in" << startupTimings.forwarded / 1000 << "us";
+#endif
+    return ForwardResult::Delivered;
   }
 
 #pragma region Server
 
   void clearServer() {
+    if (server) {
+      releaseLease();
+    }
+    std::vector<PendingRequest> requests;
+
     // Reset server.
-    for (auto& item : serverClients) {
+    for (auto& [id, item] : serverClients) {
+      Q_UNUSED(id)
       if (item.socket) {
-        // Disconnect from signals.
-        item.socket->disconnect();
-
-        // Disconnect server.
-        item.socket->disconnectFromServer();
-        item.socket->close();
-
-        // Reset pointer.
-        item.socket->deleteLater();
+        flushConnection(item);
+        closeSocket(item.socket);
         item.socket = nullptr;
       }
+      clearStreams(item);
+      releaseBulkTransfers(item);
+      takeRequests(item, requests);
     }
     serverClients.clear();
+    serverClientIds.clear();
+    topicSubscribers.clear();
     server.reset();
+
+    cancelRequests(requests);
   }
 
-  std::vector<SocketConnectionInfo>::iterator findClient(const QLocalSocket* const socket) {
-    return std::find_if(serverClients.begin(), serverClients.end(), [socket](const SocketConnectionInfo& item) {
-      return item.socket == socket;
-    });
+  SocketConnectionInfo* findClient(const QLocalSocket* const socket) {
+    const auto it = serverClientIds.constFind(socket);
+    return it != serverClientIds.constEnd() ? findClient(it.value()) : nullptr;
   }
 
-  std::vector<SocketConnectionInfo>::iterator findClient(decltype(SocketConnectionInfo::id) const clientId) {
-    return std::find_if(serverClients.begin(), serverClients.end(), [clientId](const auto& item) {
-      return item.id == clientId;
-    });
+  SocketConnectionInfo* findClient(decltype(SocketConnectionInfo::id) const clientId) {
+    const auto it = serverClients.find(clientId);
+    return it != serverClients.end() ? &it->second : nullptr;
   }
 
   void initServer() {
@@ -146,12 +900,16 @@ struct LocalEndpoint::Impl {
     {
       // By explicitly attaching it and then deleting it we make sure that
       // the memory is deleted even after the process has crashed on Unix.
-      auto m = std::make_unique<QSharedMemory>(socketName);
+      auto m = std::make_unique<QSharedMemory>(getShardName(shard));
       m->attach();
     }
 #endif
+    if (socketName != getShardName(shard)) {
+      // The lease gives us this name: a former server of the same generation may have left its socket file.
+      QLocalServer::removeServer(socketName);
+    }
 
-    server = std::make_unique<QLocalServer>();
+    server = std::make_unique<QLocalServer>(&owner);
     server->setSocketOptions(QLocalServer::SocketOption::WorldAccessOption);
 
     QObject::connect(server.get(), &QLocalServer::newConnection, &owner, [this]() {
@@ -168,11 +926,13 @@ struct LocalEndpoint::Impl {
     if (!socket)
       return;
 
-    if (findClient(socket) != serverClients.end())
+    if (findClient(socket))
       return;
 
-    const auto id = socket->socketDescriptor();
-    serverClients.emplace_back(SocketConnectionInfo{ socket, static_cast<decltype(SocketConnectionInfo::id)>(id) });
+    const auto id = nextClientId++;
+    auto& socketInfo = serverClients.emplace(id, SocketConnectionInfo{ socket, id }).first->second;
+    socketInfo.lastReceived.start();
+    serverClientIds.insert(socket, id);
 
     QObject::connect(socket, &QLocalSocket::destroyed, &owner, [this, socket]() {
 #if LOGCAT_LOCALENDPOINT
@@ -219,11 +979,16 @@ struct LocalEndpoint::Impl {
       onClientMessageReceived(socket);
     });
 
+    QObject::connect(socket, &QLocalSocket::bytesWritten, &owner, [this, socket]() {
+      pumpStreams(socket);
+    });
+
     // Maybe already some data?
     if (socket->bytesAvailable() > 0) {
       onClientMessageReceived(socket);
     }
 
+    publishLoad();
     emit owner.clientCountChanged();
   }
 
@@ -231,12 +996,24 @@ struct LocalEndpoint::Impl {
     if (!socket)
       return;
 
-    const auto it = std::remove_if(serverClients.begin(), serverClients.end(), [socket](const auto& item) {
-      return item.socket == socket;
-    });
-    if (it != serverClients.end()) {
+    const auto it = serverClientIds.find(socket);
+    if (it != serverClientIds.end()) {
       socket->disconnect();
-      serverClients.erase(it, serverClients.end());
+      std::vector<PendingRequest> requests;
+      if (auto* const socketInfo = findClient(it.value())) {
+        clearStreams(*socketInfo);
+        releaseBulkTransfers(*socketInfo);
+        takeRequests(*socketInfo, requests);
+        removeSubscriber(*socketInfo);
+        // The clients that looked it up can't connect to it anymore.
+        socketInfo->peerName.clear();
+        answerPeerLookups(*socketInfo);
+      }
+      serverClients.erase(it.value());
+      serverClientIds.erase(it);
+      cancelRequests(requests);
+      updateSuccessionRanks();
+      publishLoad();
       emit owner.clientCountChanged();
     }
   }
@@ -245,170 +1022,491 @@ struct LocalEndpoint::Impl {
     if (!socket)
       return;
 
-    const auto it = findClient(socket);
-    if (it != serverClients.end()) {
-      auto& socketInfo = *it;
-      switch (socketInfo.step) {
-        case Step::Handshake:
-          readClientHandshake(socketInfo);
-          sendHandshakeToClient(socketInfo);
-          // There is some bytes left to read: it should be the header.
-          if (socketInfo.socket->bytesAvailable() >= static_cast<qint64>(sizeof(SocketConnectionInfo::bodySize))) {
-            readClientMessageHeader(socketInfo);
-          }
-          break;
-        case Step::Header:
-          readClientMessageHeader(socketInfo);
-          break;
-        case Step::Body:
-          readClientMessageBody(socketInfo);
-          break;
-        default:
-          break;
+    if (auto* const client = findClient(socket)) {
+      auto& socketInfo = *client;
+      if (socketInfo.step == Step::Handshake) {
+        if (!readClientHandshake(socketInfo)) {
+          // Wait for the whole handshake.
+          return;
+        }
+        sendHandshakeToClient(socketInfo);
+        // So that the client knows right away when to consider the server dead.
+        sendHeartbeat(socketInfo);
+        updateSuccessionRanks();
       }
-    }
-  }
 
-  void readClientHandshake(SocketConnectionInfo& socketInfo) const {
-    socketInfo.pid = {};
-    if (socketInfo.socket->bytesAvailable() < static_cast<qint64>(sizeof(SocketConnectionInfo::pid))) {
-      return;
+      readClientFrames(socket);
     }
+  }
 
-    // Read client PID.
-    auto clientPid = decltype(SocketConnectionInfo::pid){};
-    {
-      QDataStream stream(socketInfo.socket);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> clientPid;
+  bool readClientHandshake(SocketConnectionInfo& socketInfo) const {
+    // Read client PID and the highest protocol version it supports.
+    auto handshake = quint64{};
+    if (!protocol::readHandshakeWord(*socketInfo.socket, handshake)) {
+      return false;
     }
 
-    socketInfo.pid = clientPid;
+    auto clientVersion = protocol::Version::Legacy;
+    protocol::parseClientHandshake(handshake, socketInfo.pid, clientVersion, socketInfo.capabilities);
+    socketInfo.version = protocol::negotiate(clientVersion);
+    socketInfo.decoder.setVersion(socketInfo.version);
 
     // Move state machine to next step.
-    socketInfo.step = Step::Header;
+    socketInfo.step = Step::Frames;
+    return true;
   }
 
-  void readClientMessageHeader(SocketConnectionInfo& socketInfo) const {
-    socketInfo.bodySize = {};
-
-    if (socketInfo.socket->bytesAvailable() < static_cast<qint64>(sizeof(SocketConnectionInfo::bodySize))) {
-      return;
-    }
-
-    // Read body size.
-    auto bodySize = decltype(SocketConnectionInfo::bodySize){};
-    {
-      QDataStream stream(socketInfo.socket);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> bodySize;
-    }
-
-    socketInfo.bodySize = bodySize;
+  void readClientFrames(const QLocalSocket* const socket) {
+    auto frameCount = 0;
+    auto* socketInfo = findClient(socket);
+    while (socketInfo && socketInfo->step == Step::Frames) {
+      if (maxFramesPerRead > 0 && frameCount == maxFramesPerRead) {
+        // Let the event loop breathe, and read the remaining frames in the next iteration.
+        if (socketInfo->socket->bytesAvailable() > 0 && !socketInfo->readScheduled) {
+          socketInfo->readScheduled = true;
+          QMetaObject::invokeMethod(
+            &owner,
+            [this, socket]() {
+              if (auto* const client = findClient(socket)) {
+                client->readScheduled = false;
+                readClientFrames(socket);
+              }
+            },
+            Qt::QueuedConnection);
+        }
+        return;
+      }
 
-    // Move state machine to next step.
-    socketInfo.step = Step::Body;
+      if (!readClientFrame(*socketInfo)) {
+        // Wait for more bytes to be written.
+        return;
+      }
+      ++frameCount;
 
-    // There is some bytes left to read: it should be the body.
-    if (socketInfo.socket->bytesAvailable() >= static_cast<qint64>(bodySize)) {
-      readClientMessageBody(socketInfo);
+      // Slots connected to the signals may have disconnected the client.
+      socketInfo = findClient(socket);
     }
   }
 
-  void readClientMessageBody(SocketConnectionInfo& socketInfo) const {
-    if (socketInfo.socket->bytesAvailable() < static_cast<qint64>(socketInfo.bodySize)
-        || socketInfo.step != Step::Body) {
-      // Wait for more bytes to be written.
-      return;
+  // Decodes the next frame of the connection, then passes it to the dispatcher. Returns false if it is incomplete.
+  template<typename Dispatch>
+  bool readFrame(SocketConnectionInfo& socketInfo, Dispatch&& dispatch) {
+#if QTAPPINSTANCEMANAGER_TRACING
+    const auto readStart = traceSink ? tracing::now() : qint64{ 0 };
+#endif
+    FrameDecoder::Frame frame;
+    if (socketInfo.decoder.decode(*socketInfo.socket, frame, &bufferPool) != FrameDecoder::Status::FrameReady) {
+      return false;
     }
-
-    // Read whole body.
-    QByteArray body;
-    {
-      QDataStream stream(socketInfo.socket);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> body;
+    countReceivedFrame(socketInfo, frame);
+    // Even for skipped frames, so that the next sequence numbers are extended from this one.
+    auto sequence = quint64{ 0u };
+    if (frame.header.sequence != 0u) {
+      socketInfo.receivedSequence = protocol::extendFrameSequence(socketInfo.receivedSequence, frame.header.sequence);
+      sequence = socketInfo.receivedSequence;
+    }
+    if (!decompressFrame(frame)) {
+      // Corrupted: skip it.
+      bufferPool.release(std::move(frame.payload));
+      return true;
+    }
+#if QTAPPINSTANCEMANAGER_TRACING
+    auto traceRecord = tracing::Record{};
+    const auto isTraced = traceSink != nullptr;
+    if (isTraced) {
+      const auto frameType = static_cast<quint8>(frame.header.type);
+      traceRecord = getTraceRecord(socketInfo, true, sequence, getReceivedFrameSize(socketInfo, frame), frameType);
+      trace(traceRecord, tracing::Event::Read, readStart);
     }
+    const auto dispatchStart = isTraced ? tracing::now() : qint64{ 0 };
+#else
+    Q_UNUSED(sequence)
+#endif
 
-    // Move state machine to next step (go back to Header step).
-    socketInfo.step = Step::Header;
+    dispatch(frame);
 
-#if LOGCAT_LOCALENDPOINT
-    qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Received from client:" << socketInfo.bodySize << "bytes";
+#if QTAPPINSTANCEMANAGER_TRACING
+    // Slots may have removed the connection: only the record is used.
+    if (isTraced && traceSink) {
+      trace(traceRecord, tracing::Event::Dispatch, dispatchStart);
+    }
 #endif
-    emit owner.clientMessageReceived(socketInfo.id, body);
+    // Reused for the next frame, unless a receiver kept a copy of it.
+    bufferPool.release(std::move(frame.payload));
+    return true;
   }
 
-  void sendHandshakeToClient(const SocketConnectionInfo& socketInfo) {
-    const auto& socket = socketInfo.socket;
-    if (socket && socket->isValid()) {
+  bool readClientFrame(SocketConnectionInfo& socketInfo) {
+    return readFrame(socketInfo, [this, &socketInfo](FrameDecoder::Frame& frame) {
 #if LOGCAT_LOCALENDPOINT
-      qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Sending handshake to client" << socket->socketDescriptor();
+      qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Received from client:" << frame.header.size << "bytes";
 #endif
-      socket->write(getServerHandshake(socketInfo));
-      socket->flush();
-    }
-  }
-
-  QByteArray getServerHandshake(const SocketConnectionInfo& socketInfo) const {
-    QByteArray handshake;
-    {
-      QDataStream stream(&handshake, QIODevice::WriteOnly);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      // Send its id to the client.
-      const auto clientId = socketInfo.socket->socketDescriptor();
-      stream << static_cast<quint64>(clientId);
-    }
-
-    return handshake;
+      switch (frame.header.type) {
+        case protocol::FrameType::Message: {
+          const auto clientId = socketInfo.id;
+          emit owner.clientMessageReceived(clientId, frame.payload);
+          if ((frame.header.flags & protocol::FrameFlag::AckRequested) != 0) {
+            // Slots may have disconnected the client.
+            if (auto* const client = findClient(clientId)) {
+              enqueue(*client, {}, protocol::FrameType::Ack, 0u, frame.header.tag);
+            }
+          }
+          break;
+        }
+        case protocol::FrameType::Chunk:
+          emit owner.clientStreamChunkReceived(
+            socketInfo.id, frame.payload, (frame.header.flags & protocol::FrameFlag::LastChunk) != 0);
+          break;
+        case protocol::FrameType::BulkDescriptor:
+          if (const auto data = readBulkTransfer(socketInfo, frame.header.tag, frame.payload)) {
+            emit owner.clientMessageReceived(socketInfo.id, *data);
+          }
+          break;
+        case protocol::FrameType::BulkRelease:
+          releaseBulkTransfer(socketInfo, frame.header.tag);
+          break;
+        case protocol::FrameType::TypedMessage:
+          emit owner.clientTypedMessageReceived(socketInfo.id, frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Subscribe:
+          addSubscriber(socketInfo, frame.payload);
+          break;
+        case protocol::FrameType::Unsubscribe:
+          removeSubscriber(socketInfo, frame.payload);
+          break;
+        case protocol::FrameType::Publish:
+          relayTopicMessage(socketInfo.id, frame.payload, frame.header.tag);
+          break;
+        case protocol::FrameType::PeerName:
+          onPeerNameReceived(socketInfo, frame.payload);
+          break;
+        case protocol::FrameType::PeerLookup:
+          answerPeerLookup(socketInfo, frame.payload);
+          break;
+        case protocol::FrameType::Heartbeat:
+          socketInfo.heartbeatTimeout = frame.header.tag;
+          break;
+        case protocol::FrameType::Request:
+          emit owner.clientRequestReceived(socketInfo.id, frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Response:
+          resolveRequest(socketInfo, frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Ack:
+          resolveRequest(socketInfo, frame.header.tag, {});
+          break;
+        default:
+          // Unknown frame type, sent by a newer endpoint: skip it.
+          break;
+      }
+    });
   }
 
-  void sendMessageToClient(const SocketConnectionInfo& socketInfo, const QByteArray& data) const {
+  void sendHandshakeToClient(const SocketConnectionInfo& socketInfo) {
     const auto& socket = socketInfo.socket;
-    if (socketInfo.step != Step::Handshake && socket
-        && socket->state() == QLocalSocket::LocalSocketState::ConnectedState) {
-      socket->write(Impl::getHeader(data));
-      socket->write(Impl::getBody(data));
+    if (socket && socket->isValid()) {
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "[Server] Sending handshake to client" << socketInfo.id;
+#endif
+      socket->write(getServerHandshake(socketInfo));
       socket->flush();
     }
   }
 
+  // Asks the client to listen for its peers, with a new secret that only the server and the client know.
+  void sendPeerNameToClient(SocketConnectionInfo& socketInfo) {
+    std::array<quint32, protocol::PeerSecretSize / sizeof(quint32)> secret;
+    QRandomGenerator::system()->fillRange(secret.data(), static_cast<qsizetype>(secret.size()));
+    socketInfo.peerSecret = QByteArray(reinterpret_cast<const char*>(secret.data()), protocol::PeerSecretSize);
+    // The server's PID makes it unique, even while the clients of a former server still listen.
+    const auto name =
+      QStringLiteral("%1-%2-%3").arg(socketName).arg(QCoreApplication::applicationPid()).arg(socketInfo.id);
+    enqueue(socketInfo, protocol::encodePeerName(socketInfo.peerSecret, name.toUtf8()), protocol::FrameType::PeerName);
+  }
+
+  void onPeerNameReceived(SocketConnectionInfo& socketInfo, const QByteArray& name) {
+    socketInfo.peerName = QByteArray(name.constData(), name.size());
+    if (socketInfo.peerName.isEmpty()) {
+      // It can't listen: it is given a new secret at the next lookup.
+      socketInfo.peerSecret.clear();
+    }
+    answerPeerLookups(socketInfo);
+  }
+
+  void answerPeerLookup(SocketConnectionInfo& socketInfo, const QByteArray& payload) {
+    auto peerId = Id{};
+    auto token = QByteArray{};
+    auto name = QByteArray{};
+    if (!protocol::decodePeerLookup(payload, peerId, token, name)) {
+      return;
+    }
+
+    auto* const peer = findClient(peerId);
+    // Legacy clients can't connect to each other.
+    if (!peer || peerId == socketInfo.id || peer->version == protocol::Version::Legacy || !canSendToClient(*peer)) {
+      enqueue(socketInfo, protocol::encodePeerLookup(peerId), protocol::FrameType::PeerLookup);
+    } else if (!peer->peerName.isEmpty()) {
+      const auto peerToken = protocol::makePeerToken(peer->peerSecret, socketInfo.id);
+      enqueue(
+        socketInfo, protocol::encodePeerLookup(peerId, peerToken, peer->peerName), protocol::FrameType::PeerLookup);
+    } else {
+      // Clients only listen once looked up, and the answer waits until they do.
+      peer->peerLookups.push_back(socketInfo.id);
+      if (peer->peerSecret.isEmpty()) {
+        sendPeerNameToClient(*peer);
+      }
+    }
+  }
+
+  // Answers the clients that looked up this one, once it listens, can't, or is gone.
+  void answerPeerLookups(SocketConnectionInfo& peer) {
+    const auto peerId = peer.id;
+    const auto name = peer.peerName;
+    const auto secret = peer.peerSecret;
+    const auto requesterIds = std::exchange(peer.peerLookups, {});
+    for (const auto requesterId : requesterIds) {
+      if (auto* const requester = findClient(requesterId); requester && canSendToClient(*requester)) {
+        const auto payload = name.isEmpty()
+                               ? protocol::encodePeerLookup(peerId)
+                               : protocol::encodePeerLookup(peerId, protocol::makePeerToken(secret, requesterId), name);
+        enqueue(*requester, payload, protocol::FrameType::PeerLookup);
+      }
+    }
+  }
+
+  // Sends each client its rank in increasing PID order, if it changed, so that the client with the lowest
+  // PID replaces the server if it is lost. Ties, i.e. clients in the same process, are broken by id.
+  // Only the successor (the client with the lowest PID) has rank 0, and replaces the server right away: the other
+  // clients have rank 1, and wait. So only the former successor, the new one and new clients are sent their rank.
+  static bool canBeSuccessor(const SocketConnectionInfo& socketInfo) {
+    // Legacy clients can't receive their rank.
+    return socketInfo.step == Step::Frames && socketInfo.version != protocol::Version::Legacy;
+  }
+
+  void updateSuccessionRanks() {
+    std::optional<std::pair<quint64, Id>> successor;
+    for (const auto& [id, socketInfo] : serverClients) {
+      const auto candidate = std::make_pair(socketInfo.pid, id);
+      if (canBeSuccessor(socketInfo) && (!successor || candidate < *successor)) {
+        successor = candidate;
+      }
+    }
+
+    std::vector<std::pair<Id, quint32>> changedRanks;
+    for (auto& [id, socketInfo] : serverClients) {
+      const auto rank = successor && successor->second == id ? 0u : 1u;
+      if (canBeSuccessor(socketInfo) && socketInfo.successionRank != rank) {
+        socketInfo.successionRank = rank;
+        changedRanks.emplace_back(id, rank);
+      }
+    }
+
+    // Sending may remove clients.
+    for (const auto& [id, rank] : changedRanks) {
+      if (auto* const socketInfo = findClient(id); socketInfo && canSendToClient(*socketInfo)) {
+        enqueue(*socketInfo, {}, protocol::FrameType::SuccessionRank, 0u, rank);
+      }
+    }
+  }
+
+  QByteArray getServerHandshake(const SocketConnectionInfo& socketInfo) const {
+    // Send its id to the client. Newer clients expect the negotiated protocol version first.
+    if (socketInfo.version == protocol::Version::Legacy) {
+      return protocol::encodeHandshakeWords({ socketInfo.id });
+    }
+    return protocol::encodeHandshakeWords(
+      { protocol::makeServerHandshake(socketInfo.version, protocol::SupportedCapabilities), socketInfo.id });
+  }
+
+  static bool canSendToClient(const SocketConnectionInfo& socketInfo) {
+    const auto& socket = socketInfo.socket;
+    return socketInfo.step != Step::Handshake && socket
+           && socket->state() == QLocalSocket::LocalSocketState::ConnectedState;
+  }
+
+  void sendMessageToClient(SocketConnectionInfo& socketInfo, const QByteArray& data) {
+    if (canSendToClient(socketInfo)) {
+      sendMessage(socketInfo, data);
+    }
+  }
+
+  void addSubscriber(SocketConnectionInfo& socketInfo, const QByteArray& topic) {
+    if (!socketInfo.topics.contains(topic)) {
+      // Deep copy: the frame's buffer goes back to the pool.
+      const auto topicCopy = QByteArray(topic.constData(), topic.size());
+      socketInfo.topics.insert(topicCopy);
+      topicSubscribers[topicCopy].insert(socketInfo.id);
+    }
+  }
+
+  void removeSubscriber(SocketConnectionInfo& socketInfo, const QByteArray& topic) {
+    if (socketInfo.topics.remove(topic)) {
+      removeTopicSubscriber(topic, socketInfo.id);
+    }
+  }
+
+  void removeSubscriber(SocketConnectionInfo& socketInfo) {
+    for (const auto& topic : std::as_const(socketInfo.topics)) {
+      removeTopicSubscriber(topic, socketInfo.id);
+    }
+    socketInfo.topics.clear();
+  }
+
+  void removeTopicSubscriber(const QByteArray& topic, Id clientId) {
+    const auto it = topicSubscribers.find(topic);
+    if (it != topicSubscribers.end()) {
+      it->remove(clientId);
+      if (it->isEmpty()) {
+        topicSubscribers.erase(it);
+      }
+    }
+  }
+
+  // Relays a message published by a client to the other subscribers, including this endpoint.
+  void relayTopicMessage(Id publisherId, QByteArray& payload, quint32 topicSize) {
+    protocol::setTopicMessagePublisher(payload, publisherId);
+    protocol::TopicMessage message;
+    if (!protocol::decodeTopicMessage(payload, topicSize, message)) {
+      return;
+    }
+
+    // Doesn't allocate: only used for lookups.
+    const auto topic = QByteArray::fromRawData(message.topic.data(), message.topic.size());
+    sendTopicMessageToClients(publisherId, topic, payload, topicSize);
+    if (subscriptions.contains(topic)) {
+      emit owner.topicMessageReceived(message.topic.toByteArray(), publisherId, message.data.toByteArray());
+    }
+  }
+
+  // Sends an encoded FrameType::Publish payload to the topic's subscribers, but its publisher.
+  // The frame is encoded only once, then shared by all recipients.
+  void sendTopicMessageToClients(
+    Id publisherId, const QByteArray& topic, const QByteArray& payload, quint32 topicSize) {
+    const auto it = topicSubscribers.constFind(topic);
+    if (it == topicSubscribers.constEnd()) {
+      return;
+    }
+
+    // Shared copy: sending may remove clients, hence the subscribers.
+    const auto subscriberIds = it.value();
+    // Compressed or not.
+    QByteArrayList frames[2];
+    qint64 frameSizes[2]{ 0, 0 };
+    for (const auto id : subscriberIds) {
+      auto* const socketInfo = findClient(id);
+      if (id == publisherId || !socketInfo || !canSendToClient(*socketInfo)) {
+        continue;
+      }
+      const auto compress = shouldCompress(*socketInfo, payload.size());
+      auto& frame = frames[compress ? 1 : 0];
+      auto& frameSize = frameSizes[compress ? 1 : 0];
+      if (frame.isEmpty()) {
+        // Subscribers are never legacy endpoints.
+        frameSize =
+          appendSharedFrame(frame, socketInfo->version, payload, compress, protocol::FrameType::Publish, topicSize);
+      }
+      enqueueEncoded(*socketInfo, frame, frameSize, protocol::FrameType::Publish);
+    }
+  }
+
+  void sendMessageToAllClients(const QByteArray& data, const QSet<Id>& exceptIds) {
+    // The frame is encoded only once per protocol version and compression, then shared by all recipients.
+    struct EncodedFrame {
+      QByteArrayList buffers;
+      qint64 size{ 0 };
+    };
+    std::optional<EncodedFrame> frames[3];
+
+    // Large messages are written once in shared memory, released when all recipients have read it.
+    auto useBulkTransfer = isBulkTransferEnabled(data);
+    auto bulkTransferId = quint32{ 0u };
+
+    for (auto& [id, socketInfo] : serverClients) {
+      if (exceptIds.contains(id) || !canSendToClient(socketInfo)) {
+        continue;
+      }
+
+      const auto isLegacy = socketInfo.version == protocol::Version::Legacy;
+      const auto compress = !isLegacy && !useBulkTransfer && shouldCompress(socketInfo, data.size());
+      auto& frame = frames[isLegacy ? 0 : (compress ? 2 : 1)];
+      if (!frame) {
+        frame.emplace();
+        if (!isLegacy && useBulkTransfer) {
+          const auto transferId = createBulkTransfer(data);
+          if (transferId) {
+            bulkTransferId = *transferId;
+            frame->size = protocol::appendFrame(frame->buffers, socketInfo.version,
+              getBulkDescriptor(bulkTransferId, data), protocol::FrameType::BulkDescriptor, 0u, bulkTransferId);
+          } else {
+            useBulkTransfer = false;
+          }
+        }
+        if (frame->buffers.isEmpty()) {
+          frame->size = appendSharedFrame(frame->buffers, socketInfo.version, data, compress);
+        }
+      }
+
+      if (!isLegacy && useBulkTransfer) {
+        bulkSegments[bulkTransferId].references++;
+        socketInfo.bulkTransfers.append(bulkTransferId);
+      }
+      enqueueEncoded(socketInfo, frame->buffers, frame->size);
+    }
+  }
+
 #pragma endregion
 
 #pragma region Client
 
   void clearClient() {
+    clearPeers();
     if (client) {
-      // Disconnect from signals.
-      client->disconnect();
-
-      // Disconnect from server.
-      if (client->state() == QLocalSocket::ConnectedState) {
 #if LOGCAT_LOCALENDPOINT
-        qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Disconnecting from server";
-#endif
-        const auto disconnectResult = client->waitForDisconnected(1000);
-        if (client->state() != QLocalSocket::UnconnectedState) {
-#if LOGCAT_LOCALENDPOINT
-          if (client->state() != QLocalSocket::UnconnectedState || !disconnectResult) {
-            qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Error: can't disconnect from server. Code:" << client->error();
-          }
-#else
-          Q_UNUSED(disconnectResult)
+      qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Disconnecting from server";
 #endif
-        }
-      }
-      client->close();
-
-      // Reset pointer.
-      client.reset();
+      flushConnection(clientSocketInfo);
+      closeSocket(client.release());
     }
+    clearStreams(clientSocketInfo);
+    releaseBulkTransfers(clientSocketInfo);
+    std::vector<PendingRequest> requests;
+    takeRequests(clientSocketInfo, requests);
     clientSocketInfo = {};
+    clientPendingFrames.clear();
+    clientPendingFlush = false;
+    cancelRequests(requests);
+  }
+
+  // Closes the socket without blocking: pending data is written, then the socket is disconnected and deleted.
+  // It is aborted if that takes longer than SocketCloseTimeout.
+  void closeSocket(QLocalSocket* const socket) {
+    // Disconnect from signals, and from the server that owns the socket, if any.
+    socket->disconnect();
+    socket->setParent(nullptr);
+
+    if (socket->state() == QLocalSocket::UnconnectedState) {
+      socket->deleteLater();
+      return;
+    }
+
+    // Deleted sockets are pruned, so that the list doesn't grow with each closed connection.
+    closingSockets.erase(std::remove(closingSockets.begin(), closingSockets.end(), nullptr), closingSockets.end());
+    closingSockets.emplace_back(socket);
+
+    QObject::connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+    QTimer::singleShot(SocketCloseTimeout, socket, [socket]() {
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "Error: can't disconnect gracefully, aborting. Code:" << socket->error();
+#endif
+      socket->abort();
+      socket->deleteLater();
+    });
+    socket->disconnectFromServer();
   }
 
   void initClient() {
     clientSocketInfo = {};
-    client = std::make_unique<QLocalSocket>();
+    client = std::make_unique<QLocalSocket>(&owner);
     clientSocketInfo.socket = client.get();
     clientSocketInfo.pid = QCoreApplication::applicationPid();
 
@@ -436,6 +1534,10 @@ struct LocalEndpoint::Impl {
       restart();
     });
 
+    QObject::connect(client.get(), &QLocalSocket::bytesWritten, &owner, [this]() {
+      pumpStreams(client.get());
+    });
+
     QObject::connect(client.get(), &QLocalSocket::readyRead, &owner, [this]() {
 #if LOGCAT_LOCALENDPOINT
       qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Server message received";
@@ -443,43 +1545,73 @@ struct LocalEndpoint::Impl {
       onMessageReceivedFromServer();
     });
 
+    handshakeTimer.start();
+    clientSocketInfo.lastReceived.start();
     client->connectToServer(socketName);
   }
 
   void onMessageReceivedFromServer() {
-    switch (clientSocketInfo.step) {
-      case Step::Handshake:
-        readServerHandshake();
-        // There is some bytes left to read: it should be the header.
-        if (clientSocketInfo.socket->bytesAvailable() >= static_cast<qint64>(sizeof(SocketConnectionInfo::bodySize))) {
-          readServerMessageHeader();
+    if (clientSocketInfo.step == Step::Handshake && !readServerHandshake()) {
+      // Wait for the whole handshake.
+      return;
+    }
+
+    readServerFrames();
+  }
+
+  void readServerFrames() {
+    auto frameCount = 0;
+    // Slots connected to the signals may have disconnected the client, hence the check at each iteration.
+    while (client && clientSocketInfo.step == Step::Frames) {
+      if (maxFramesPerRead > 0 && frameCount == maxFramesPerRead) {
+        // Let the event loop breathe, and read the remaining frames in the next iteration.
+        if (client->bytesAvailable() > 0 && !clientSocketInfo.readScheduled) {
+          clientSocketInfo.readScheduled = true;
+          QMetaObject::invokeMethod(
+            &owner,
+            [this, socket = client.get()]() {
+              if (client.get() == socket && clientSocketInfo.readScheduled) {
+                clientSocketInfo.readScheduled = false;
+                readServerFrames();
+              }
+            },
+            Qt::QueuedConnection);
         }
-        break;
-      case Step::Header:
-        readServerMessageHeader();
-        break;
-      case Step::Body:
-        readServerMessageBody();
-        break;
-      default:
-        break;
-    };
+        return;
+      }
+
+      if (!readServerFrame()) {
+        // Wait for more bytes to be written.
+        return;
+      }
+      ++frameCount;
+    }
   }
 
-  void readServerHandshake() {
-    clientSocketInfo.id = 0u;
-    if (clientSocketInfo.socket->bytesAvailable() < static_cast<qint64>(sizeof(SocketConnectionInfo::id))) {
-      return;
+  bool readServerHandshake() {
+    // Legacy servers only send our id. Newer ones send the negotiated protocol version first.
+    auto firstWord = quint64{};
+    if (!protocol::peekHandshakeWord(*client, firstWord)) {
+      return false;
+    }
+    const auto serverVersion = protocol::parseServerHandshake(firstWord);
+    const auto handshakeSize = serverVersion == protocol::Version::Legacy ? protocol::HandshakeWordSize
+                                                                           : 2 * protocol::HandshakeWordSize;
+    if (client->bytesAvailable() < handshakeSize) {
+      return false;
+    }
+    if (serverVersion != protocol::Version::Legacy) {
+      client->skip(protocol::HandshakeWordSize);
     }
 
     // Read the id that the server gave us.
     auto idGivenByServer = quint64{};
-    {
-      QDataStream stream(client.get());
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> idGivenByServer;
-    }
+    protocol::readHandshakeWord(*client, idGivenByServer);
 
+    clientSocketInfo.version = serverVersion;
+    clientSocketInfo.capabilities =
+      serverVersion != protocol::Version::Legacy ? protocol::parseServerCapabilities(firstWord) : quint16{ 0u };
+    clientSocketInfo.decoder.setVersion(serverVersion);
     clientSocketInfo.id = idGivenByServer;
     emit owner.serverIdChanged();
 
@@ -488,54 +1620,109 @@ struct LocalEndpoint::Impl {
 #endif
 
     // Move state machine to next step.
-    clientSocketInfo.step = Step::Header;
-  }
-
-  void readServerMessageHeader() {
-    clientSocketInfo.bodySize = {};
-
-    if (client->bytesAvailable() < static_cast<qint64>(sizeof(SocketConnectionInfo::bodySize))) {
-      return;
+    clientSocketInfo.step = Step::Frames;
+    restartAttempts = 0;
+    handshakeDuration.store(handshakeTimer.nsecsElapsed(), std::memory_order_relaxed);
+    if (startupTimings.handshakeDone < 0) {
+      startupTimings.handshakeDone = startupTimer.nsecsElapsed();
     }
 
-    // Read body size.
-    auto bodySize = decltype(SocketConnectionInfo::bodySize){};
-    {
-      QDataStream stream(client.get());
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> bodySize;
-    }
+    sendHeartbeat(clientSocketInfo);
 
-    clientSocketInfo.step = Step::Body;
-    clientSocketInfo.bodySize = bodySize;
+    // Subscribe again, in case the server changed.
+    if (clientSocketInfo.version != protocol::Version::Legacy) {
+      for (const auto& topic : std::as_const(subscriptions)) {
+        enqueue(clientSocketInfo, topic, protocol::FrameType::Subscribe);
+      }
+    }
 
-    // There is some bytes left to read: it should be the body.
-    if (client->bytesAvailable() >= static_cast<qint64>(bodySize)) {
-      readServerMessageBody();
+    // Look up the peers to which messages were sent before the handshake.
+    for (const auto& [peerId, messages] : peerPendingMessages) {
+      Q_UNUSED(messages)
+      lookUpPeer(peerId);
     }
-  }
 
-  void readServerMessageBody() {
-    if (client->bytesAvailable() < static_cast<qint64>(clientSocketInfo.bodySize)
-        || clientSocketInfo.step != Step::Body) {
-      // Wait for more bytes to be written.
-      return;
+    // Send frames that were waiting for the handshake.
+    if (!clientPendingFrames.isEmpty()) {
+      const auto pendingFrames = std::exchange(clientPendingFrames, {});
+      for (const auto& frame : pendingFrames) {
+        if (frame.type == protocol::FrameType::Request || (frame.flags & protocol::FrameFlag::AckRequested) != 0) {
+          sendPendingRequest(clientSocketInfo, frame);
+        } else if (frame.type == protocol::FrameType::TypedMessage) {
+          sendTypedMessage(clientSocketInfo, frame.tag, frame.data);
+        } else if (frame.type == protocol::FrameType::Publish) {
+          sendTopicMessage(clientSocketInfo, frame.data, frame.tag);
+        } else {
+          sendMessage(clientSocketInfo, frame.data);
+        }
+      }
     }
 
-    // Read whole body.
-    QByteArray body;
-    {
-      QDataStream stream(client.get());
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream >> body;
+    if (std::exchange(clientPendingFlush, false)) {
+      flushConnection(clientSocketInfo);
     }
 
-    clientSocketInfo.step = Step::Header;
+    // Start streams that were waiting for the handshake.
+    pumpStreams(client.get());
+    return true;
+  }
 
+  bool readServerFrame() {
+    return readFrame(clientSocketInfo, [this](FrameDecoder::Frame& frame) {
 #if LOGCAT_LOCALENDPOINT
-    qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Received from server:" << clientSocketInfo.bodySize << "bytes";
+      qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Received from server:" << frame.header.size << "bytes";
 #endif
-    emit owner.serverMessageReceived(body);
+      switch (frame.header.type) {
+        case protocol::FrameType::Message:
+          emit owner.serverMessageReceived(frame.payload);
+          if ((frame.header.flags & protocol::FrameFlag::AckRequested) != 0 && client) {
+            enqueue(clientSocketInfo, {}, protocol::FrameType::Ack, 0u, frame.header.tag);
+          }
+          break;
+        case protocol::FrameType::Chunk:
+          emit owner.serverStreamChunkReceived(
+            frame.payload, (frame.header.flags & protocol::FrameFlag::LastChunk) != 0);
+          break;
+        case protocol::FrameType::BulkDescriptor:
+          if (const auto data = readBulkTransfer(clientSocketInfo, frame.header.tag, frame.payload)) {
+            emit owner.serverMessageReceived(*data);
+          }
+          break;
+        case protocol::FrameType::BulkRelease:
+          releaseBulkTransfer(clientSocketInfo, frame.header.tag);
+          break;
+        case protocol::FrameType::TypedMessage:
+          emit owner.serverTypedMessageReceived(frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Publish:
+          onTopicMessageReceivedFromServer(frame.payload, frame.header.tag);
+          break;
+        case protocol::FrameType::PeerName:
+          listenForPeers(frame.payload);
+          break;
+        case protocol::FrameType::PeerLookup:
+          onPeerLookedUp(frame.payload);
+          break;
+        case protocol::FrameType::Request:
+          emit owner.serverRequestReceived(frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Response:
+          resolveRequest(clientSocketInfo, frame.header.tag, frame.payload);
+          break;
+        case protocol::FrameType::Ack:
+          resolveRequest(clientSocketInfo, frame.header.tag, {});
+          break;
+        case protocol::FrameType::SuccessionRank:
+          successionRank = frame.header.tag;
+          break;
+        case protocol::FrameType::Heartbeat:
+          clientSocketInfo.heartbeatTimeout = frame.header.tag;
+          break;
+        default:
+          // Unknown frame type, sent by a newer endpoint: skip it.
+          break;
+      }
+    });
   }
 
   void sendHandshakeToServer() const {
@@ -549,128 +1736,1376 @@ struct LocalEndpoint::Impl {
   }
 
   QByteArray getClientHandshake() const {
-    QByteArray handshake;
-    {
-      QDataStream stream(&handshake, QIODevice::WriteOnly);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      // Send id to server.
-      const auto clientId = QCoreApplication::applicationPid();
-      stream << static_cast<quint64>(clientId);
-    }
-
-    return handshake;
+    // Send our PID to server, and the highest protocol version we support.
+    const auto clientPid = QCoreApplication::applicationPid();
+    return protocol::encodeHandshakeWords(
+      { protocol::makeClientHandshake(
+        static_cast<quint64>(clientPid), protocol::Version::Current, protocol::SupportedCapabilities) });
   }
 
-  void sendMessageToServer(const QByteArray& data) const {
-    if (client && client->isValid()) {
-      client->write(Impl::getHeader(data));
-      client->write(Impl::getBody(data));
-      client->flush();
+  void sendMessageToServer(const QByteArray& data) {
+    if (client && clientSocketInfo.step == Step::Handshake) {
+      // The frame format depends on the protocol version, which is not negotiated yet.
+      clientPendingFrames.append(PendingFrame{ data });
+    } else if (client && client->isValid()) {
+      sendMessage(clientSocketInfo, data);
     }
   }
 
-#pragma endregion
-
-#pragma region Static
-
-  static QByteArray getHeader(const QByteArray& body) {
-    QByteArray header;
-    {
-      QDataStream stream(&header, QIODevice::WriteOnly);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream << static_cast<quint64>(body.length());
+  void sendTypedMessageToServer(MessageTag tag, const QByteArray& data) {
+    if (client && clientSocketInfo.step == Step::Handshake) {
+      clientPendingFrames.append(PendingFrame{ data, protocol::FrameType::TypedMessage, 0u, tag });
+    } else if (client && client->isValid()) {
+      sendTypedMessage(clientSocketInfo, tag, data);
     }
-
-    return header;
   }
 
-  static QByteArray getBody(const QByteArray& data) {
-    QByteArray body;
-    {
-      QDataStream stream(&body, QIODevice::WriteOnly);
-      stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
-      stream << data;
+  void onTopicMessageReceivedFromServer(const QByteArray& payload, quint32 topicSize) {
+    protocol::TopicMessage message;
+    if (!protocol::decodeTopicMessage(payload, topicSize, message)) {
+      return;
+    }
+    // Messages may still arrive right after unsubscribing.
+    if (subscriptions.contains(QByteArray::fromRawData(message.topic.data(), message.topic.size()))) {
+      emit owner.topicMessageReceived(message.topic.toByteArray(), message.publisherId, message.data.toByteArray());
     }
-
-    return body;
   }
 
-  static QString getSocketName() {
-    QCryptographicHash appData(QCryptographicHash::Sha256);
-    QRegularExpression const filterRegExp{ QStringLiteral("[^a-zA-Z0-9]") };
-    const auto organizationName = QCoreApplication::organizationName().remove(filterRegExp).toUtf8();
-    const auto applicationName = QCoreApplication::applicationName().remove(filterRegExp).toUtf8();
-    const auto applicationVersion = QCoreApplication::applicationVersion().toUtf8();
-    appData.addData(organizationName);
-    appData.addData(applicationName);
-    appData.addData(applicationVersion);
+  void sendSubscriptionToServer(protocol::FrameType type, const QByteArray& topic) {
+    // Before the handshake, all subscriptions are sent once it is done.
+    if (client && client->isValid() && clientSocketInfo.step == Step::Frames
+        && clientSocketInfo.version != protocol::Version::Legacy) {
+      enqueue(clientSocketInfo, topic, type);
+    }
+  }
 
-    // Replace the backslash in RFC 2045 Base64 [a-zA-Z0-9+/=] to comply with server naming requirements.
-    return appData.result().toBase64().replace('/', '_');
+  void publishToServer(const QByteArray& topic, const QByteArray& data) {
+    const auto payload = protocol::encodeTopicMessage(0u, topic, data);
+    const auto topicSize = static_cast<quint32>(topic.size());
+    if (client && clientSocketInfo.step == Step::Handshake) {
+      clientPendingFrames.append(PendingFrame{ payload, protocol::FrameType::Publish, 0u, topicSize });
+    } else if (client && client->isValid()) {
+      sendTopicMessage(clientSocketInfo, payload, topicSize);
+    }
   }
 
 #pragma endregion
-};
 
-LocalEndpoint::LocalEndpoint(QObject* parent)
-  : QObject(parent)
-  , _impl(new Impl(*this)) {
-  _impl->init();
-}
+#pragma region Peers
 
-LocalEndpoint::~LocalEndpoint() = default;
+  // Called the first time another client looks this one up: until then, nothing listens for peers.
+  void listenForPeers(const QByteArray& payload) {
+    auto name = QByteArray{};
+    if (!protocol::decodePeerName(payload, peerSecret, name)) {
+      return;
+    }
 
-int LocalEndpoint::secondaryInstanceCount() const {
-  return static_cast<int>(_impl->serverClients.size());
-}
+    if (!peerServer) {
+      peerServer = std::make_unique<QLocalServer>(&owner);
+      QObject::connect(peerServer.get(), &QLocalServer::newConnection, &owner, [this]() {
+        // Its id is only known once its handshake is read.
+        addPeer(peerServer->nextPendingConnection(), 0u);
+      });
 
-LocalEndpoint::Id LocalEndpoint::id() const {
-  switch (role()) {
-    case Role::Server:
-      return {};
-    case Role::Client:
-      return _impl->clientSocketInfo.id;
-    default:
-      return {};
+      // Only a crashed process may have left it.
+      const auto serverName = QString::fromUtf8(name);
+      QLocalServer::removeServer(serverName);
+      if (!peerServer->listen(serverName)) {
+        peerServer.reset();
+        peerSecret.clear();
+        name.clear();
+      }
+    }
+
+    // Peers may connect from now on, unless it is empty.
+    enqueue(clientSocketInfo, name, protocol::FrameType::PeerName);
   }
-}
 
-LocalEndpoint::Id LocalEndpoint::serverId() const {
-  return 0;
-}
+  void clearPeers() {
+    // Closing may emit signals that would remove them while iterating.
+    auto closedPeers = std::exchange(peers, {});
+    peerSockets.clear();
+    peerPendingMessages.clear();
+    for (auto& [socket, socketInfo] : closedPeers) {
+      Q_UNUSED(socket)
+      flushConnection(socketInfo);
+      releaseBulkTransfers(socketInfo);
+      closeSocket(socketInfo.socket);
+    }
+    peerServer.reset();
+    peerSecret.clear();
+  }
 
-LocalEndpoint::Role LocalEndpoint::role() const {
-  return _impl->role;
-}
+  SocketConnectionInfo* findPeer(const QLocalSocket* const socket) {
+    const auto it = peers.find(socket);
+    return it != peers.end() ? &it->second : nullptr;
+  }
 
-void LocalEndpoint::sendToServer(const QByteArray& data) {
-  if (role() == Role::Client) {
-    _impl->sendMessageToServer(data);
+  SocketConnectionInfo* findPeer(Id peerId) {
+    const auto it = peerSockets.constFind(peerId);
+    return it != peerSockets.constEnd() ? findPeer(it.value()) : nullptr;
   }
-}
 
-void LocalEndpoint::sendToAllClients(const QByteArray& data, const QVector<LocalEndpoint::Id>& exceptIds) {
-  if (role() == Role::Server) {
-    for (const auto& client : _impl->serverClients) {
-      if (!exceptIds.contains(client.id)) {
-        _impl->sendMessageToClient(client, data);
-      }
+  void addPeer(QLocalSocket* const socket, Id peerId) {
+    if (!socket || findPeer(socket)) {
+      return;
     }
-    //for (auto it = _impl->serverClients.begin(); it != _impl->serverClients.end(); it++) {
-    //  if (!exceptIds.contains(it->id)) {
-    //    _impl->sendMessageToClient(*it, data);
-    //  }
-    //}
-  }
-}
 
-void LocalEndpoint::sendToClient(LocalEndpoint::Id clientId, const QByteArray& data) {
-  if (role() == Role::Server && clientId != serverId()) {
-    const auto it = _impl->findClient(clientId);
-    if (it != _impl->serverClients.end()) {
-      _impl->sendMessageToClient(*it, data);
+    peers.emplace(socket, SocketConnectionInfo{ socket, peerId });
+    if (peerId != 0u) {
+      peerSockets.insert(peerId, socket);
     }
-  }
+
+    QObject::connect(socket, &QLocalSocket::disconnected, &owner, [this, socket]() {
+      removePeer(socket);
+    });
+    QObject::connect(socket, &QLocalSocket::errorOccurred, &owner, [this, socket]() {
+      removePeer(socket);
+    });
+    QObject::connect(socket, &QLocalSocket::readyRead, &owner, [this, socket]() {
+      readPeerFrames(socket);
+    });
+
+    if (socket->bytesAvailable() > 0) {
+      readPeerFrames(socket);
+    }
+  }
+
+  void removePeer(QLocalSocket* const socket) {
+    const auto it = peers.find(socket);
+    if (it == peers.end()) {
+      return;
+    }
+
+    const auto peerId = it->second.id;
+    releaseBulkTransfers(it->second);
+    peers.erase(it);
+    if (peerSockets.value(peerId) == socket) {
+      peerSockets.remove(peerId);
+      // Messages waiting for this connection can't be delivered anymore.
+      peerPendingMessages.erase(peerId);
+    }
+    closeSocket(socket);
+  }
+
+  void connectToPeer(Id peerId, const QByteArray& name, const QByteArray& token) {
+    auto* const socket = new QLocalSocket(&owner);
+    QObject::connect(socket, &QLocalSocket::connected, &owner, [this, socket, token]() {
+      const auto handshake = protocol::makePeerHandshake(protocol::Version::Current, protocol::SupportedCapabilities);
+      socket->write(protocol::encodeHandshakeWords({ handshake, clientSocketInfo.id }) + token);
+      socket->flush();
+    });
+    addPeer(socket, peerId);
+    socket->connectToServer(QString::fromUtf8(name));
+  }
+
+  void readPeerFrames(QLocalSocket* const socket) {
+    auto* socketInfo = findPeer(socket);
+    if (socketInfo && socketInfo->step == Step::Handshake && !readPeerHandshake(*socketInfo)) {
+      // Wait for the whole handshake.
+      return;
+    }
+
+    // Slots connected to the signals may have removed the peer, hence the check at each iteration.
+    while ((socketInfo = findPeer(socket)) && readPeerFrame(*socketInfo)) {
+    }
+  }
+
+  bool readPeerHandshake(SocketConnectionInfo& socketInfo) {
+    auto* const socket = socketInfo.socket;
+    auto word = quint64{};
+    if (socketInfo.id == 0u) {
+      // Accepted connection: the peer tells who it is, with the token the server gave it for this id, and the
+      // highest protocol version it supports.
+      if (socket->bytesAvailable() < protocol::PeerHandshakeSize) {
+        return false;
+      }
+      auto peerId = quint64{};
+      protocol::readHandshakeWord(*socket, word);
+      protocol::readHandshakeWord(*socket, peerId);
+      const auto token = socket->read(protocol::PeerTokenSize);
+      if (peerSecret.isEmpty() || peerId == 0u || token != protocol::makePeerToken(peerSecret, peerId)) {
+#if LOGCAT_LOCALENDPOINT
+        qCDebug(LOGCAT_LOCALENDPOINT) << "[Client] Rejected a peer connection without a valid token";
+#endif
+        removePeer(socket);
+        return false;
+      }
+
+      auto peerVersion = protocol::Version::Legacy;
+      protocol::parsePeerHandshake(word, peerVersion, socketInfo.capabilities);
+      socketInfo.id = peerId;
+      socketInfo.version = protocol::negotiate(peerVersion);
+      socketInfo.socket->write(protocol::encodeHandshakeWords(
+        { protocol::makeServerHandshake(socketInfo.version, protocol::SupportedCapabilities) }));
+      socketInfo.socket->flush();
+      // Answer on the same connection, unless one was already opened to the peer.
+      if (!peerSockets.contains(socketInfo.id)) {
+        peerSockets.insert(socketInfo.id, socketInfo.socket);
+      }
+    } else {
+      if (!protocol::readHandshakeWord(*socket, word)) {
+        return false;
+      }
+      socketInfo.version = protocol::parseServerHandshake(word);
+      socketInfo.capabilities = protocol::parseServerCapabilities(word);
+    }
+    socketInfo.decoder.setVersion(socketInfo.version);
+    socketInfo.step = Step::Frames;
+
+    sendPendingPeerMessages(socketInfo.id);
+    return true;
+  }
+
+  bool readPeerFrame(SocketConnectionInfo& socketInfo) {
+    return readFrame(socketInfo, [this, &socketInfo](FrameDecoder::Frame& frame) {
+      switch (frame.header.type) {
+        case protocol::FrameType::Message:
+          emit owner.clientMessageReceived(socketInfo.id, frame.payload);
+          break;
+        case protocol::FrameType::BulkDescriptor:
+          if (const auto data = readBulkTransfer(socketInfo, frame.header.tag, frame.payload)) {
+            emit owner.clientMessageReceived(socketInfo.id, *data);
+          }
+          break;
+        case protocol::FrameType::BulkRelease:
+          releaseBulkTransfer(socketInfo, frame.header.tag);
+          break;
+        default:
+          // Only messages go through peer connections.
+          break;
+      }
+    });
+  }
+
+  // Sends a message through the connection to the peer, once opened.
+  void sendMessageToPeer(Id peerId, const QByteArray& data) {
+    if (peerId == clientSocketInfo.id) {
+      return;
+    }
+
+    if (auto* const peer = findPeer(peerId); peer && peer->step == Step::Frames) {
+      sendMessage(*peer, data);
+      return;
+    }
+
+    auto& pendingMessages = peerPendingMessages[peerId];
+    pendingMessages.append(data);
+    // Ask the server where the peer listens, unless it is already known.
+    if (pendingMessages.size() == 1 && !peerSockets.contains(peerId)) {
+      lookUpPeer(peerId);
+    }
+  }
+
+  void sendPendingPeerMessages(Id peerId) {
+    const auto it = peerPendingMessages.find(peerId);
+    if (it != peerPendingMessages.end()) {
+      const auto messages = std::move(it->second);
+      peerPendingMessages.erase(it);
+      for (const auto& data : messages) {
+        sendMessageToPeer(peerId, data);
+      }
+    }
+  }
+
+  void lookUpPeer(Id peerId) {
+    if (client && clientSocketInfo.step == Step::Handshake) {
+      // Looked up once the handshake is done.
+      return;
+    }
+    if (client && client->isValid() && clientSocketInfo.version != protocol::Version::Legacy) {
+      enqueue(clientSocketInfo, protocol::encodePeerLookup(peerId), protocol::FrameType::PeerLookup);
+    } else {
+      peerPendingMessages.erase(peerId);
+    }
+  }
+
+  void onPeerLookedUp(const QByteArray& payload) {
+    auto peerId = Id{};
+    auto token = QByteArray{};
+    auto name = QByteArray{};
+    if (!protocol::decodePeerLookup(payload, peerId, token, name)) {
+      return;
+    }
+
+    if (name.isEmpty()) {
+      // Unknown peer, or it can't accept connections.
+      peerPendingMessages.erase(peerId);
+    } else if (!peerSockets.contains(peerId) && peerPendingMessages.count(peerId) > 0) {
+      connectToPeer(peerId, name, token);
+    }
+  }
+
+#pragma endregion
+
+#pragma region Send queue
+
+  void sendMessage(SocketConnectionInfo& socketInfo, const QByteArray& data) {
+    if (socketInfo.version != protocol::Version::Legacy && isBulkTransferEnabled(data)) {
+      if (const auto transferId = createBulkTransfer(data)) {
+        bulkSegments[*transferId].references++;
+        socketInfo.bulkTransfers.append(*transferId);
+        enqueue(socketInfo, getBulkDescriptor(*transferId, data), protocol::FrameType::BulkDescriptor, 0u, *transferId);
+        return;
+      }
+    }
+
+    enqueue(socketInfo, data);
+  }
+
+  void sendTypedMessage(SocketConnectionInfo& socketInfo, MessageTag tag, const QByteArray& data) {
+    // Legacy endpoints would take the payload for an untyped message.
+    if (socketInfo.version != protocol::Version::Legacy) {
+      enqueue(socketInfo, data, protocol::FrameType::TypedMessage, 0u, tag);
+    }
+  }
+
+  void sendTopicMessage(SocketConnectionInfo& socketInfo, const QByteArray& payload, quint32 topicSize) {
+    if (socketInfo.version != protocol::Version::Legacy) {
+      enqueue(socketInfo, payload, protocol::FrameType::Publish, 0u, topicSize);
+    }
+  }
+
+  void enqueue(SocketConnectionInfo& socketInfo, const QByteArray& data,
+    protocol::FrameType type = protocol::FrameType::Message, quint8 flags = 0u, quint32 tag = 0u) {
+#if QTAPPINSTANCEMANAGER_TRACING
+    const auto enqueueStart = traceSink ? tracing::now() : qint64{ 0 };
+#endif
+    QByteArray compressed;
+    const auto compressedFlag =
+      shouldCompress(socketInfo, data.size()) ? compressPayload(data, compressed) : quint8{ 0u };
+    const auto& payload = compressedFlag != 0u ? compressed : data;
+    flags = static_cast<quint8>(flags | compressedFlag);
+
+    // Legacy endpoints have no room for a sequence number in their header, and control frames take none, so that
+    // heartbeats don't shift the messages' ones.
+    const auto isLegacy = socketInfo.version == protocol::Version::Legacy;
+    auto sequence = quint64{ 0u };
+    if (!isLegacy && !protocol::isControlFrame(type)) {
+      socketInfo.sentSequence = protocol::nextFrameSequence(socketInfo.sentSequence);
+      sequence = socketInfo.sentSequence;
+    }
+    const auto headerSequence = static_cast<quint16>(sequence & 0xFFFFu);
+    auto frameSize = qint64{ 0 };
+    if (!isLegacy && payload.size() <= protocol::ContiguousFrameMaxSize) {
+      // Small frame: encode it in a pooled buffer, given back once written.
+      auto frame = bufferPool.acquire(protocol::FrameHeaderSize + payload.size());
+      protocol::encodeFrameInto(frame.data(), payload, type, flags, tag, headerSequence);
+      frameSize = frame.size();
+      socketInfo.outgoing.append(std::move(frame));
+    } else {
+      frameSize =
+        protocol::appendFrame(socketInfo.outgoing, socketInfo.version, payload, type, flags, tag, headerSequence);
+    }
+    socketInfo.outgoingSize += frameSize;
+    countSentFrame(socketInfo, frameSize, type);
+#if QTAPPINSTANCEMANAGER_TRACING
+    if (traceSink) {
+      auto record = getTraceRecord(socketInfo, false, sequence, frameSize, static_cast<quint8>(type));
+      trace(record, tracing::Event::Enqueue, enqueueStart);
+    }
+#endif
+    onEnqueued(socketInfo);
+  }
+
+  // Appends a frame meant to be shared by several recipients, compressed if requested and worth it.
+  qint64 appendSharedFrame(QByteArrayList& buffers, protocol::Version version, const QByteArray& data, bool compress,
+    protocol::FrameType type = protocol::FrameType::Message, quint32 tag = 0u) const {
+    QByteArray compressed;
+    const auto compressedFlag = compress ? compressPayload(data, compressed) : quint8{ 0u };
+    return protocol::appendFrame(buffers, version, compressedFlag != 0u ? compressed : data, type, compressedFlag, tag);
+  }
+
+  // Tells whether a payload of this size should be compressed before being sent to the endpoint. Payloads of 4 GiB
+  // or more are sent as is: the size prefix of both codecs would be truncated.
+  bool shouldCompress(const SocketConnectionInfo& socketInfo, qsizetype size) const {
+    if (compression == Compression::None || size < compressionThreshold
+        || socketInfo.version == protocol::Version::Legacy || !oclero::compression::isCompressible(size)) {
+      return false;
+    }
+    const auto capability =
+      compression == Compression::Zlib ? protocol::ZlibDecompression : protocol::Lz4Decompression;
+    return (socketInfo.capabilities & capability) != 0;
+  }
+
+  // Returns the frame flag telling how the payload was compressed, or 0 if compressing it wasn't worth it.
+  quint8 compressPayload(const QByteArray& data, QByteArray& compressed) const {
+    if (!oclero::compression::isCompressible(data.size())) {
+      return 0u;
+    }
+    auto flag = quint8{ 0u };
+    if (compression == Compression::Zlib) {
+      compressed = qCompress(data);
+      flag = protocol::FrameFlag::ZlibCompressed;
+    } else {
+      compressed = oclero::compression::compressLz4(data);
+      flag = protocol::FrameFlag::Lz4Compressed;
+    }
+    // Receivers reject zlib payloads compressed beyond the ratio allowed for LZ4: they are sent as is.
+    const auto isAccepted = flag == protocol::FrameFlag::Lz4Compressed
+                            || oclero::compression::zlibDecompressedSize(compressed) == data.size();
+    return compressed.size() < data.size() && isAccepted ? flag : quint8{ 0u };
+  }
+
+  // Replaces a compressed payload by the decompressed one. Returns false if it is corrupted.
+  bool decompressFrame(FrameDecoder::Frame& frame) {
+    const auto compressedFlags =
+      frame.header.flags & (protocol::FrameFlag::ZlibCompressed | protocol::FrameFlag::Lz4Compressed);
+    if (compressedFlags == 0) {
+      return true;
+    }
+
+    QByteArray data;
+    if ((compressedFlags & protocol::FrameFlag::ZlibCompressed) != 0) {
+      // The size prefix is checked first, so that a corrupted one can't make qUncompress() allocate a huge buffer.
+      // Compressed payloads are never empty.
+      const auto size = oclero::compression::zlibDecompressedSize(frame.payload);
+      if (size <= 0) {
+        return false;
+      }
+      data = qUncompress(frame.payload);
+      if (data.size() != size) {
+        return false;
+      }
+    } else {
+      const auto size = oclero::compression::lz4DecompressedSize(frame.payload);
+      if (size < 0) {
+        return false;
+      }
+      data = bufferPool.acquire(size);
+      if (!oclero::compression::decompressLz4(frame.payload, data.data(), size)) {
+        bufferPool.release(std::move(data));
+        return false;
+      }
+    }
+
+    bufferPool.release(std::move(frame.payload));
+    frame.payload = std::move(data);
+    frame.header.flags = static_cast<quint8>(frame.header.flags & ~compressedFlags);
+    return true;
+  }
+
+  // Enqueues an already encoded frame. Its buffers are shared, not copied.
+  void enqueueEncoded(SocketConnectionInfo& socketInfo, const QByteArrayList& frame, qint64 frameSize,
+    protocol::FrameType type = protocol::FrameType::Message) {
+    socketInfo.outgoing.append(frame);
+    socketInfo.outgoingSize += frameSize;
+    countSentFrame(socketInfo, frameSize, type);
+#if QTAPPINSTANCEMANAGER_TRACING
+    if (traceSink) {
+      // Encoded once for all the recipients, beforehand: without sequence number.
+      auto record = getTraceRecord(socketInfo, false, 0u, frameSize, static_cast<quint8>(type));
+      trace(record, tracing::Event::Enqueue, tracing::now());
+    }
+#endif
+    onEnqueued(socketInfo);
+  }
+
+  // When queued: the bytes not written yet are the connection's bytesToWrite.
+  void countSentFrame(SocketConnectionInfo& socketInfo, qint64 frameSize, protocol::FrameType type) {
+    if (protocol::isControlFrame(type)) {
+      ++socketInfo.controlFramesSent;
+      traffic.controlFramesSent.add();
+    } else {
+      ++socketInfo.messagesSent;
+      traffic.messagesSent.add();
+    }
+    socketInfo.bytesSent += static_cast<quint64>(frameSize);
+    traffic.bytesSent.add(static_cast<quint64>(frameSize));
+  }
+
+  // As received, i.e. before decompression.
+  static qint64 getReceivedFrameSize(const SocketConnectionInfo& socketInfo, const FrameDecoder::Frame& frame) {
+    const auto headerSize = socketInfo.version == protocol::Version::Legacy
+                              ? protocol::LegacyHeaderSize + protocol::LegacyBodyPrefixSize
+                              : protocol::FrameHeaderSize;
+    return headerSize + static_cast<qint64>(frame.header.size);
+  }
+
+  void countReceivedFrame(SocketConnectionInfo& socketInfo, const FrameDecoder::Frame& frame) {
+    const auto frameSize = static_cast<quint64>(getReceivedFrameSize(socketInfo, frame));
+    if (protocol::isControlFrame(frame.header.type)) {
+      ++socketInfo.controlFramesReceived;
+      traffic.controlFramesReceived.add();
+    } else {
+      ++socketInfo.messagesReceived;
+      traffic.messagesReceived.add();
+    }
+    socketInfo.bytesReceived += frameSize;
+    // Any frame proves the other endpoint is responsive, not only heartbeats.
+    socketInfo.lastReceived.restart();
+    traffic.bytesReceived.add(frameSize);
+  }
+
+#if QTAPPINSTANCEMANAGER_TRACING
+  // Describes a frame sent or received on the connection, whose sequence number is 0 if it has none.
+  tracing::Record getTraceRecord(const SocketConnectionInfo& socketInfo, bool received, quint64 sequence, qint64 size,
+    quint8 frameType) const {
+    tracing::Record record;
+    record.sequence = sequence;
+    record.size = size;
+    record.frameType = frameType;
+
+    // The server and its clients can identify the frames they exchange by their sequence number, written in their
+    // header, and by the client's id. Peer connections aren't identified by the server.
+    const auto isServerSide = role == Role::Server;
+    const auto isClientSide = &socketInfo == &clientSocketInfo;
+    record.connectionId = isClientSide ? Id{ 0u } : socketInfo.id;
+    if ((isServerSide || isClientSide) && sequence != 0u) {
+      const auto toClient = isServerSide != received;
+      record.flowId = getFlowId(socketInfo.id, toClient, sequence);
+    }
+    return record;
+  }
+
+  // Mixes all the bits of the client's id, the direction and the sequence number, whatever their size (SplitMix64's
+  // finalizer). Never 0, which means none.
+  static quint64 getFlowId(Id clientId, bool toClient, quint64 sequence) {
+    const auto mix = [](quint64 value) {
+      value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9u;
+      value = (value ^ (value >> 27)) * 0x94D049BB133111EBu;
+      return value ^ (value >> 31);
+    };
+    const auto flowId = mix(mix(mix(clientId) ^ sequence) ^ (toClient ? 1u : 2u));
+    return flowId != 0u ? flowId : 1u;
+  }
+
+  void trace(tracing::Record& record, tracing::Event event, qint64 start) const {
+    record.event = event;
+    record.timestamp = start;
+    record.duration = tracing::now() - start;
+    traceSink->record(record);
+  }
+#endif
+
+  // Per connection: with the server on a client, and with the peers.
+  QList<ConnectionStatistics> getConnectionStatistics() const {
+    QList<ConnectionStatistics> result;
+    const auto append = [&result](const SocketConnectionInfo& socketInfo, Id id) {
+      const auto socketBytesToWrite =
+        socketInfo.socket && socketInfo.socket->isValid() ? socketInfo.socket->bytesToWrite() : qint64{ 0 };
+      result.append(ConnectionStatistics{ id, socketInfo.messagesReceived, socketInfo.messagesSent,
+        socketInfo.controlFramesReceived, socketInfo.controlFramesSent, socketInfo.bytesReceived, socketInfo.bytesSent,
+        socketInfo.outgoingSize + socketBytesToWrite });
+    };
+    if (client) {
+      append(clientSocketInfo, 0u);
+    }
+    for (const auto& [id, socketInfo] : serverClients) {
+      append(socketInfo, id);
+    }
+    for (const auto& [socket, socketInfo] : peers) {
+      Q_UNUSED(socket)
+      append(socketInfo, socketInfo.id);
+    }
+    return result;
+  }
+
+  void onEnqueued(SocketConnectionInfo& socketInfo) {
+    switch (flushPolicy) {
+      case FlushPolicy::Immediate:
+        flushConnection(socketInfo);
+        break;
+      case FlushPolicy::EndOfIteration:
+        if (!flushScheduled) {
+          flushScheduled = true;
+          QMetaObject::invokeMethod(
+            &owner,
+            [this]() {
+              flushAll();
+            },
+            Qt::QueuedConnection);
+        }
+        break;
+      case FlushPolicy::Threshold:
+        if (socketInfo.outgoingSize >= flushThresholdSize) {
+          flushConnection(socketInfo);
+        } else if (!flushTimer.isActive()) {
+          flushTimer.start(flushThresholdDelay);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  void flushConnection(SocketConnectionInfo& socketInfo) {
+    if (socketInfo.outgoing.isEmpty()) {
+      return;
+    }
+
+    // Flushing may enqueue more frames (e.g. the next chunks of a stream), so take the current ones first.
+    QByteArrayList buffers;
+    buffers.swap(socketInfo.outgoing);
+#if QTAPPINSTANCEMANAGER_TRACING
+    const auto writeStart = traceSink ? tracing::now() : qint64{ 0 };
+    const auto writtenSize = socketInfo.outgoingSize;
+#endif
+    socketInfo.outgoingSize = 0;
+    auto* const socket = socketInfo.socket && socketInfo.socket->isValid() ? socketInfo.socket : nullptr;
+    if (socket) {
+      auto batch = std::exchange(writeBatch, {});
+      protocol::writeBuffers(*socket, buffers, batch);
+      writeBatch = std::move(batch);
+#if QTAPPINSTANCEMANAGER_TRACING
+      if (traceSink) {
+        // The sequence number is the last one written.
+        auto record = getTraceRecord(socketInfo, false, socketInfo.sentSequence, writtenSize, 0u);
+        trace(record, tracing::Event::Write, writeStart);
+      }
+#endif
+    }
+
+    // The socket has copied the buffers: recycle them, and the list's capacity too.
+    for (auto& buffer : buffers) {
+      bufferPool.release(std::move(buffer));
+    }
+    buffers.clear();
+    socketInfo.outgoing.swap(buffers);
+
+    // Signals emitted while flushing may remove the connection: don't use it afterwards.
+    if (socket) {
+      socket->flush();
+    }
+  }
+
+  void flushAll() {
+    flushScheduled = false;
+    flushTimer.stop();
+
+    for (auto& [id, socketInfo] : serverClients) {
+      Q_UNUSED(id)
+      flushConnection(socketInfo);
+    }
+    for (auto& [socket, socketInfo] : peers) {
+      Q_UNUSED(socket)
+      flushConnection(socketInfo);
+    }
+    flushConnection(clientSocketInfo);
+    if (client && clientSocketInfo.step == Step::Handshake && !clientPendingFrames.isEmpty()) {
+      // They can't be written yet.
+      clientPendingFlush = true;
+    }
+  }
+
+#pragma endregion
+
+#pragma region Streams
+
+  SocketConnectionInfo* findConnection(const QLocalSocket* const socket) {
+    if (client && socket == client.get()) {
+      return &clientSocketInfo;
+    }
+    return findClient(socket);
+  }
+
+  void addStream(SocketConnectionInfo& socketInfo, QIODevice* const device) {
+    // The device is read in this thread: it must live in it.
+    if (!device || device->thread() != owner.thread()) {
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "Error: the streamed device doesn't live in the endpoint's thread.";
+#endif
+      return;
+    }
+
+    OutgoingStream stream{ device, socketInfo.nextStreamId++ };
+    if (device->isSequential()) {
+      // An empty buffer doesn't mean the end: resume when the device has more data to read, and end the stream
+      // when it has no more to give.
+      auto* const socket = socketInfo.socket;
+      const auto streamId = stream.id;
+      stream.inputFinished = isInputFinished(*device);
+      stream.connections.push_back(QObject::connect(device, &QIODevice::readyRead, &owner, [this, socket]() {
+        pumpStreams(socket);
+      }));
+      stream.connections.push_back(
+        QObject::connect(device, &QIODevice::readChannelFinished, &owner, [this, socket, streamId]() {
+          if (auto* const finishedStream = findStream(socket, streamId)) {
+            finishedStream->inputFinished = true;
+            pumpStreams(socket);
+          }
+        }));
+      stream.connections.push_back(
+        QObject::connect(device, &QIODevice::aboutToClose, &owner, [this, socket, streamId, device]() {
+          // The buffered data would be lost once closed.
+          if (auto* const closedStream = findStream(socket, streamId)) {
+            closedStream->pending += device->readAll();
+            closedStream->inputFinished = true;
+            pumpStreams(socket);
+          }
+        }));
+    }
+    socketInfo.streams.emplace_back(std::move(stream));
+    pumpStreams(socketInfo.socket);
+  }
+
+  // Whether a sequential device already reached its end, before the stream was added.
+  static bool isInputFinished(const QIODevice& device) {
+    if (const auto* const process = qobject_cast<const QProcess*>(&device)) {
+      return process->state() == QProcess::NotRunning;
+    } else if (const auto* const socket = qobject_cast<const QLocalSocket*>(&device)) {
+      return socket->state() == QLocalSocket::UnconnectedState;
+    } else if (const auto* const networkSocket = qobject_cast<const QAbstractSocket*>(&device)) {
+      return networkSocket->state() == QAbstractSocket::UnconnectedState;
+    }
+    return false;
+  }
+
+  OutgoingStream* findStream(const QLocalSocket* const socket, quint32 streamId) {
+    if (auto* const socketInfo = findConnection(socket)) {
+      for (auto& stream : socketInfo->streams) {
+        if (stream.id == streamId) {
+          return &stream;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  static void disconnectStream(OutgoingStream& stream) {
+    for (const auto& connection : stream.connections) {
+      QObject::disconnect(connection);
+    }
+    stream.connections.clear();
+  }
+
+  static void clearStreams(SocketConnectionInfo& socketInfo) {
+    for (auto& stream : socketInfo.streams) {
+      disconnectStream(stream);
+    }
+    socketInfo.streams.clear();
+  }
+
+  // Next chunk of the stream: the pending data first, then the device's.
+  QByteArray readStreamChunk(OutgoingStream& stream) const {
+    if (!stream.pending.isEmpty()) {
+      auto chunk = stream.pending.left(streamChunkSize);
+      stream.pending.remove(0, chunk.size());
+      return chunk;
+    }
+    auto* const device = stream.device.data();
+    return device && device->isReadable() ? device->read(streamChunkSize) : QByteArray{};
+  }
+
+  static bool isStreamAtEnd(const OutgoingStream& stream) {
+    if (!stream.pending.isEmpty()) {
+      return false;
+    }
+    const auto* const device = stream.device.data();
+    if (!device || !device->isReadable()) {
+      // The device was destroyed or closed.
+      return true;
+    }
+    // Sequential devices may have nothing buffered yet, without being at their end.
+    return device->isSequential() ? stream.inputFinished && device->bytesAvailable() == 0 : device->atEnd();
+  }
+
+  // Sends chunks of the pending streams while the socket's write buffer is below the high watermark.
+  // Called again when the socket has written bytes, so at most a few chunks are buffered at once.
+  void pumpStreams(QLocalSocket* const socket) {
+    auto* socketInfo = findConnection(socket);
+    if (!socketInfo || socketInfo->pumpingStreams) {
+      return;
+    }
+
+    socketInfo->pumpingStreams = true;
+    const auto highWatermark = 2 * streamChunkSize;
+    while (socketInfo && !socketInfo->streams.empty()) {
+      if (socketInfo->step == Step::Handshake || !socket->isValid() || socket->bytesToWrite() >= highWatermark) {
+        // Wait for the handshake, or for the socket to write what it has in its buffer.
+        break;
+      }
+
+      auto& stream = socketInfo->streams.front();
+      const auto streamId = stream.id;
+      const auto chunk = readStreamChunk(stream);
+      const auto finished = isStreamAtEnd(stream);
+      if (chunk.isEmpty() && !finished) {
+        // Wait for more data to be available.
+        break;
+      }
+
+      if (socketInfo->version == protocol::Version::Legacy) {
+        // Legacy endpoints don't support streams: send the whole content as a single message, once complete.
+        stream.legacyContent += chunk;
+        if (finished) {
+          enqueue(*socketInfo, std::exchange(stream.legacyContent, {}));
+        }
+      } else {
+        const auto flags = static_cast<quint8>(finished ? protocol::FrameFlag::LastChunk : 0u);
+        enqueue(*socketInfo, chunk, protocol::FrameType::Chunk, flags, streamId);
+      }
+
+      flushConnection(*socketInfo);
+
+      // Writing may have caused the socket to be disconnected and the connection to be removed.
+      socketInfo = findConnection(socket);
+      if (socketInfo && finished && !socketInfo->streams.empty() && socketInfo->streams.front().id == streamId) {
+        disconnectStream(socketInfo->streams.front());
+        socketInfo->streams.pop_front();
+      }
+    }
+
+    if (socketInfo) {
+      socketInfo->pumpingStreams = false;
+    }
+  }
+
+#pragma endregion
+
+#pragma region Bulk transfers
+
+  bool isBulkTransferEnabled(const QByteArray& data) const {
+    return bulkTransferThreshold > 0 && data.size() >= bulkTransferThreshold;
+  }
+
+  QString getBulkTransferKey(quint32 transferId) const {
+    return QStringLiteral("%1-bulk-%2-%3").arg(socketName).arg(QCoreApplication::applicationPid()).arg(transferId);
+  }
+
+  QByteArray getBulkDescriptor(quint32 transferId, const QByteArray& data) const {
+    return protocol::encodeBulkDescriptor(static_cast<quint64>(data.size()), getBulkTransferKey(transferId));
+  }
+
+  // Copies the data to a new shared memory segment. Returns nothing if the segment can't be created,
+  // in which case the data must go through the socket.
+  std::optional<quint32> createBulkTransfer(const QByteArray& data) {
+    const auto transferId = nextBulkTransferId++;
+    auto sharedMemory = std::make_unique<QSharedMemory>(getBulkTransferKey(transferId));
+    if (!sharedMemory->create(data.size())) {
+#if LOGCAT_LOCALENDPOINT
+      qCDebug(LOGCAT_LOCALENDPOINT) << "Can't create shared memory segment:" << sharedMemory->errorString();
+#endif
+      return std::nullopt;
+    }
+
+    sharedMemory->lock();
+    std::memcpy(sharedMemory->data(), data.constData(), static_cast<size_t>(data.size()));
+    sharedMemory->unlock();
+
+    bulkSegments.emplace(transferId, BulkSegment{ std::move(sharedMemory), 0 });
+    bulkTransfersSent.add();
+    return transferId;
+  }
+
+  // Copies the message out of the shared memory segment described by the payload, then tells the sender
+  // that the segment may be released. A view on the segment can't be handed out: the application may keep
+  // the QByteArray after the segment is released.
+  std::optional<QByteArray> readBulkTransfer(
+    SocketConnectionInfo& socketInfo, quint32 transferId, const QByteArray& descriptor) {
+    std::optional<QByteArray> data;
+    auto size = quint64{};
+    auto key = QString{};
+    if (protocol::decodeBulkDescriptor(descriptor, size, key)) {
+      QSharedMemory sharedMemory(key);
+      if (sharedMemory.attach(QSharedMemory::ReadOnly)) {
+        sharedMemory.lock();
+        const auto readableSize = std::min<quint64>(size, static_cast<quint64>(sharedMemory.size()));
+        data.emplace(static_cast<const char*>(sharedMemory.constData()), static_cast<qsizetype>(readableSize));
+        sharedMemory.unlock();
+        sharedMemory.detach();
+        bulkTransfersReceived.add();
+      } else {
+#if LOGCAT_LOCALENDPOINT
+        qCDebug(LOGCAT_LOCALENDPOINT) << "Can't attach to shared memory segment:" << sharedMemory.errorString();
+#endif
+      }
+    }
+
+    enqueue(socketInfo, {}, protocol::FrameType::BulkRelease, 0u, transferId);
+    return data;
+  }
+
+  void releaseBulkTransfer(SocketConnectionInfo& socketInfo, quint32 transferId) {
+    if (socketInfo.bulkTransfers.removeOne(transferId)) {
+      releaseBulkSegment(transferId);
+    }
+  }
+
+  void releaseBulkTransfers(SocketConnectionInfo& socketInfo) {
+    for (const auto transferId : std::as_const(socketInfo.bulkTransfers)) {
+      releaseBulkSegment(transferId);
+    }
+    socketInfo.bulkTransfers.clear();
+  }
+
+  void releaseBulkSegment(quint32 transferId) {
+    const auto it = bulkSegments.find(transferId);
+    if (it != bulkSegments.end() && --it->second.references <= 0) {
+      // Destroys the segment, once every reader has detached from it.
+      bulkSegments.erase(it);
+    }
+  }
+
+#pragma endregion
+
+#pragma region Requests
+
+  // Requests and acknowledged messages share the same mechanism: the Response or Ack frame resolves the request.
+  QFuture<QByteArray> sendRequest(SocketConnectionInfo& socketInfo, const QByteArray& data, int timeout,
+    protocol::FrameType type = protocol::FrameType::Request, quint8 flags = 0u) {
+    const auto requestId = socketInfo.nextRequestId++;
+    auto& request = socketInfo.requests[requestId];
+    request.deadline = QDeadlineTimer(timeout);
+    request.elapsed.start();
+    request.promise.start();
+    auto future = request.promise.future();
+    scheduleRequestTimeout(request.deadline);
+
+    const auto frame = PendingFrame{ data, type, flags, requestId };
+    if (socketInfo.step == Step::Handshake) {
+      // Only happens on the client side: requests to clients are sent after their handshake.
+      clientPendingFrames.append(frame);
+    } else {
+      sendPendingRequest(socketInfo, frame);
+    }
+    return future;
+  }
+
+  void sendPendingRequest(SocketConnectionInfo& socketInfo, const PendingFrame& frame) {
+    if (socketInfo.version == protocol::Version::Legacy) {
+      const auto it = socketInfo.requests.find(frame.tag);
+      if (it == socketInfo.requests.end()) {
+        return;
+      }
+      auto request = std::move(it->second);
+      socketInfo.requests.erase(it);
+
+      if (frame.type == protocol::FrameType::Request) {
+        // Legacy endpoints don't know about requests, and would take them for messages.
+        cancelRequest(request);
+      } else {
+        // Legacy endpoints can't acknowledge messages: consider them delivered once sent.
+        enqueue(socketInfo, frame.data);
+        request.promise.finish();
+      }
+      return;
+    }
+    enqueue(socketInfo, frame.data, frame.type, frame.flags, frame.tag);
+  }
+
+  QFuture<QByteArray> sendAcknowledgedMessage(SocketConnectionInfo& socketInfo, const QByteArray& data, int timeout) {
+    return sendRequest(socketInfo, data, timeout, protocol::FrameType::Message, protocol::FrameFlag::AckRequested);
+  }
+
+  void sendResponse(SocketConnectionInfo& socketInfo, quint32 requestId, const QByteArray& data) {
+    if (socketInfo.step == Step::Frames && socketInfo.version != protocol::Version::Legacy) {
+      enqueue(socketInfo, data, protocol::FrameType::Response, 0u, requestId);
+    }
+  }
+
+  void resolveRequest(SocketConnectionInfo& socketInfo, quint32 requestId, const QByteArray& data) {
+    const auto it = socketInfo.requests.find(requestId);
+    if (it == socketInfo.requests.end()) {
+      // The request has already timed out.
+      return;
+    }
+
+    // Continuations may run right away and send other requests: the map must not be in use anymore.
+    auto request = std::move(it->second);
+    socketInfo.requests.erase(it);
+    latency.record(request.elapsed.nsecsElapsed());
+    request.promise.addResult(data);
+    request.promise.finish();
+  }
+
+  static QFuture<QByteArray> getCanceledRequest() {
+    PendingRequest request;
+    request.promise.start();
+    cancelRequest(request);
+    return request.promise.future();
+  }
+
+  static void cancelRequest(PendingRequest& request) {
+    request.promise.future().cancel();
+    request.promise.finish();
+  }
+
+  static void takeRequests(SocketConnectionInfo& socketInfo, std::vector<PendingRequest>& requests) {
+    for (auto& [requestId, request] : socketInfo.requests) {
+      Q_UNUSED(requestId)
+      requests.emplace_back(std::move(request));
+    }
+    socketInfo.requests.clear();
+  }
+
+  static void cancelRequests(std::vector<PendingRequest>& requests) {
+    for (auto& request : requests) {
+      cancelRequest(request);
+    }
+    requests.clear();
+  }
+
+  void scheduleRequestTimeout(const QDeadlineTimer& deadline) {
+    if (deadline.isForever()) {
+      return;
+    }
+    const auto remainingTime = std::chrono::milliseconds(deadline.remainingTime());
+    if (!requestTimer.isActive() || remainingTime < requestTimer.remainingTimeAsDuration()) {
+      requestTimer.start(remainingTime);
+    }
+  }
+
+  // Cancels the requests whose deadline has expired, then waits for the next deadline.
+  void expireRequests() {
+    std::vector<PendingRequest> expiredRequests;
+    auto nextDeadline = QDeadlineTimer(QDeadlineTimer::Forever);
+    const auto expire = [&expiredRequests, &nextDeadline](SocketConnectionInfo& socketInfo) {
+      for (auto it = socketInfo.requests.begin(); it != socketInfo.requests.end();) {
+        if (it->second.deadline.hasExpired()) {
+          expiredRequests.emplace_back(std::move(it->second));
+          it = socketInfo.requests.erase(it);
+        } else {
+          nextDeadline = std::min(nextDeadline, it->second.deadline);
+          ++it;
+        }
+      }
+    };
+
+    for (auto& [id, socketInfo] : serverClients) {
+      Q_UNUSED(id)
+      expire(socketInfo);
+    }
+    expire(clientSocketInfo);
+
+    scheduleRequestTimeout(nextDeadline);
+    cancelRequests(expiredRequests);
+  }
+
+#pragma endregion
+
+#pragma region Static
+
+  static QString getSocketName() {
+    QCryptographicHash appData(QCryptographicHash::Sha256);
+    QRegularExpression const filterRegExp{ QStringLiteral("[^a-zA-Z0-9]") };
+    const auto organizationName = QCoreApplication::organizationName().remove(filterRegExp).toUtf8();
+    const auto applicationName = QCoreApplication::applicationName().remove(filterRegExp).toUtf8();
+    const auto applicationVersion = QCoreApplication::applicationVersion().toUtf8();
+    appData.addData(organizationName);
+    appData.addData(applicationName);
+    appData.addData(applicationVersion);
+
+    // Replace the backslash in RFC 2045 Base64 [a-zA-Z0-9+/=] to comply with server naming requirements.
+    return appData.result().toBase64().replace('/', '_');
+  }
+
+#pragma endregion
+};
+
+LocalEndpoint::LocalEndpoint(QObject* parent)
+  : LocalEndpoint(StartupSettings{}, parent) {}
+
+LocalEndpoint::LocalEndpoint(const StartupSettings& settings, QObject* parent)
+  : QObject(parent)
+  , _impl(new Impl(*this)) {
+  _impl->shardCount = std::max(1, settings.shardCount);
+  // Before the role is decided, so that a new server's lease expires after its heartbeats' timeout.
+  _impl->setHeartbeatPolicy(settings.heartbeatPolicy);
+  _impl->init();
+}
+
+LocalEndpoint::~LocalEndpoint() = default;
+
+bool LocalEndpoint::waitForRole(int timeout) {
+  return _impl->waitForRole(QDeadlineTimer(timeout));
+}
+
+bool LocalEndpoint::waitForBytesWritten(int timeout) {
+  return _impl->waitForBytesWritten(QDeadlineTimer(timeout));
+}
+
+LocalEndpoint::ForwardResult LocalEndpoint::forwardToServer(const QByteArray& data, int timeout) {
+  return _impl->forwardToServer(data, QDeadlineTimer(timeout));
+}
+
+QFuture<void> LocalEndpoint::sendAcknowledgedToServer(const QByteArray& data, int timeout) {
+  if (role() == Role::Client && _impl->client) {
+    return QFuture<void>(_impl->sendAcknowledgedMessage(_impl->clientSocketInfo, data, timeout));
+  }
+  return QFuture<void>(Impl::getCanceledRequest());
+}
+
+LocalEndpoint::StartupTimings LocalEndpoint::startupTimings() const {
+  return _impl->startupTimings;
+}
+
+LocalEndpoint::BufferStatistics LocalEndpoint::bufferStatistics() const {
+  const auto statistics = _impl->bufferPool.statistics();
+  return { statistics.allocations, statistics.reuses };
+}
+
+void LocalEndpoint::setTraceSink(std::shared_ptr<tracing::Sink> sink) {
+  _impl->traceSink = std::move(sink);
+}
+
+LocalEndpoint::Statistics LocalEndpoint::statistics() const {
+  Statistics statistics;
+  statistics.messagesReceived = _impl->traffic.messagesReceived.value();
+  statistics.messagesSent = _impl->traffic.messagesSent.value();
+  statistics.controlFramesReceived = _impl->traffic.controlFramesReceived.value();
+  statistics.controlFramesSent = _impl->traffic.controlFramesSent.value();
+  statistics.bytesReceived = _impl->traffic.bytesReceived.value();
+  statistics.bytesSent = _impl->traffic.bytesSent.value();
+  statistics.reconnects = _impl->reconnects.value();
+  statistics.bulkTransfersSent = _impl->bulkTransfersSent.value();
+  statistics.bulkTransfersReceived = _impl->bulkTransfersReceived.value();
+  statistics.reelectionTime = static_cast<qint64>(_impl->reelectionTime.value());
+  statistics.handshakeDuration = _impl->handshakeDuration.load(std::memory_order_relaxed);
+  statistics.latencyHistogram = _impl->latency.buckets();
+  return statistics;
+}
+
+QList<LocalEndpoint::ConnectionStatistics> LocalEndpoint::connectionStatistics() const {
+  return _impl->getConnectionStatistics();
+}
+
+int LocalEndpoint::secondaryInstanceCount() const {
+  return static_cast<int>(_impl->serverClients.size());
+}
+
+int LocalEndpoint::shardCount() const {
+  return _impl->shardCount;
+}
+
+void LocalEndpoint::setShardCount(int count) {
+  _impl->setShardCount(std::max(1, count));
+}
+
+int LocalEndpoint::shard() const {
+  return _impl->shard;
+}
+
+QList<int> LocalEndpoint::shardClientCounts() const {
+  return _impl->getShardLoads();
+}
+
+LocalEndpoint::Id LocalEndpoint::id() const {
+  switch (role()) {
+    case Role::Server:
+      return {};
+    case Role::Client:
+      return _impl->clientSocketInfo.id;
+    default:
+      return {};
+  }
+}
+
+LocalEndpoint::Id LocalEndpoint::serverId() const {
+  return 0;
+}
+
+LocalEndpoint::Role LocalEndpoint::role() const {
+  return _impl->role;
+}
+
+void LocalEndpoint::sendToServer(const QByteArray& data) {
+  if (role() == Role::Client) {
+    _impl->sendMessageToServer(data);
+  }
+}
+
+void LocalEndpoint::sendToAllClients(const QByteArray& data, const QSet<LocalEndpoint::Id>& exceptIds) {
+  if (role() == Role::Server) {
+    _impl->sendMessageToAllClients(data, exceptIds);
+  }
+}
+
+QFuture<QByteArray> LocalEndpoint::requestToServer(const QByteArray& data, int timeout) {
+  if (role() == Role::Client && _impl->client) {
+    return _impl->sendRequest(_impl->clientSocketInfo, data, timeout);
+  }
+  return Impl::getCanceledRequest();
+}
+
+QFuture<QByteArray> LocalEndpoint::requestToClient(LocalEndpoint::Id clientId, const QByteArray& data, int timeout) {
+  if (role() == Role::Server && clientId != serverId()) {
+    if (auto* const client = _impl->findClient(clientId); client && Impl::canSendToClient(*client)) {
+      return _impl->sendRequest(*client, data, timeout);
+    }
+  }
+  return Impl::getCanceledRequest();
+}
+
+void LocalEndpoint::replyToServer(RequestId requestId, const QByteArray& data) {
+  if (role() == Role::Client && _impl->client) {
+    _impl->sendResponse(_impl->clientSocketInfo, requestId, data);
+  }
+}
+
+void LocalEndpoint::replyToClient(LocalEndpoint::Id clientId, RequestId requestId, const QByteArray& data) {
+  if (role() == Role::Server && clientId != serverId()) {
+    if (auto* const client = _impl->findClient(clientId); client && Impl::canSendToClient(*client)) {
+      _impl->sendResponse(*client, requestId, data);
+    }
+  }
+}
+
+void LocalEndpoint::sendStreamToServer(QIODevice* device) {
+  if (role() == Role::Client && _impl->client) {
+    _impl->addStream(_impl->clientSocketInfo, device);
+  }
+}
+
+void LocalEndpoint::sendStreamToClient(LocalEndpoint::Id clientId, QIODevice* device) {
+  if (role() == Role::Server && clientId != serverId()) {
+    if (auto* const client = _impl->findClient(clientId)) {
+      _impl->addStream(*client, device);
+    }
+  }
+}
+
+qint64 LocalEndpoint::bulkTransferThreshold() const {
+  return _impl->bulkTransferThreshold;
+}
+
+void LocalEndpoint::setBulkTransferThreshold(qint64 size) {
+  _impl->bulkTransferThreshold = std::max<qint64>(0, size);
+}
+
+int LocalEndpoint::maxFramesPerRead() const {
+  return _impl->maxFramesPerRead;
+}
+
+void LocalEndpoint::setMaxFramesPerRead(int count) {
+  _impl->maxFramesPerRead = std::max(0, count);
+}
+
+qint64 LocalEndpoint::streamChunkSize() const {
+  return _impl->streamChunkSize;
+}
+
+void LocalEndpoint::setStreamChunkSize(qint64 size) {
+  _impl->streamChunkSize = std::max<qint64>(1, size);
+}
+
+void LocalEndpoint::sendToClient(LocalEndpoint::Id clientId, const QByteArray& data) {
+  if (role() == Role::Server && clientId != serverId()) {
+    if (auto* const client = _impl->findClient(clientId)) {
+      _impl->sendMessageToClient(*client, data);
+    }
+  } else if (role() == Role::Client && clientId != serverId()) {
+    _impl->sendMessageToPeer(clientId, data);
+  }
+}
+
+void LocalEndpoint::sendTypedToServer(MessageTag tag, const QByteArray& data) {
+  if (role() == Role::Client) {
+    _impl->sendTypedMessageToServer(tag, data);
+  }
+}
+
+void LocalEndpoint::sendTypedToClient(LocalEndpoint::Id clientId, MessageTag tag, const QByteArray& data) {
+  if (role() == Role::Server && clientId != serverId()) {
+    if (auto* const client = _impl->findClient(clientId); client && Impl::canSendToClient(*client)) {
+      _impl->sendTypedMessage(*client, tag, data);
+    }
+  }
+}
+
+void LocalEndpoint::sendTypedToAllClients(MessageTag tag, const QByteArray& data, const QSet<Id>& exceptIds) {
+  if (role() == Role::Server) {
+    for (auto& [id, client] : _impl->serverClients) {
+      if (!exceptIds.contains(id) && Impl::canSendToClient(client)) {
+        _impl->sendTypedMessage(client, tag, data);
+      }
+    }
+  }
+}
+
+void LocalEndpoint::subscribe(const QByteArray& topic) {
+  if (!_impl->subscriptions.contains(topic)) {
+    _impl->subscriptions.insert(topic);
+    if (role() == Role::Client) {
+      _impl->sendSubscriptionToServer(protocol::FrameType::Subscribe, topic);
+    }
+  }
+}
+
+void LocalEndpoint::unsubscribe(const QByteArray& topic) {
+  if (_impl->subscriptions.remove(topic) && role() == Role::Client) {
+    _impl->sendSubscriptionToServer(protocol::FrameType::Unsubscribe, topic);
+  }
+}
+
+bool LocalEndpoint::isSubscribed(const QByteArray& topic) const {
+  return _impl->subscriptions.contains(topic);
+}
+
+void LocalEndpoint::publish(const QByteArray& topic, const QByteArray& data) {
+  if (role() == Role::Server) {
+    if (!_impl->topicSubscribers.contains(topic)) {
+      return;
+    }
+    const auto payload = protocol::encodeTopicMessage(serverId(), topic, data);
+    _impl->sendTopicMessageToClients(serverId(), topic, payload, static_cast<quint32>(topic.size()));
+  } else if (role() == Role::Client) {
+    _impl->publishToServer(topic, data);
+  }
+}
+
+LocalEndpoint::Compression LocalEndpoint::compression() const {
+  return _impl->compression;
+}
+
+void LocalEndpoint::setCompression(Compression compression) {
+  _impl->compression = compression;
+}
+
+qint64 LocalEndpoint::compressionThreshold() const {
+  return _impl->compressionThreshold;
+}
+
+void LocalEndpoint::setCompressionThreshold(qint64 size) {
+  _impl->compressionThreshold = std::max<qint64>(0, size);
+}
+
+LocalEndpoint::ReelectionPolicy LocalEndpoint::reelectionPolicy() const {
+  return _impl->reelectionPolicy;
+}
+
+void LocalEndpoint::setReelectionPolicy(const ReelectionPolicy& policy) {
+  _impl->reelectionPolicy.initialDelay = std::max(1, policy.initialDelay);
+  _impl->reelectionPolicy.maxDelay = std::max(_impl->reelectionPolicy.initialDelay, policy.maxDelay);
+  _impl->reelectionPolicy.jitter = std::clamp(policy.jitter, 0., 1.);
+  _impl->reelectionPolicy.rankDelay = std::max(0, policy.rankDelay);
+}
+
+LocalEndpoint::HeartbeatPolicy LocalEndpoint::heartbeatPolicy() const {
+  return _impl->heartbeatPolicy;
+}
+
+void LocalEndpoint::setHeartbeatPolicy(const HeartbeatPolicy& policy) {
+  _impl->setHeartbeatPolicy(policy);
+}
+
+LocalEndpoint::FlushPolicy LocalEndpoint::flushPolicy() const {
+  return _impl->flushPolicy;
+}
+
+void LocalEndpoint::setFlushPolicy(FlushPolicy policy) {
+  if (policy != _impl->flushPolicy) {
+    // Messages queued with the former policy must not wait for a flush that may never come.
+    _impl->flushAll();
+    _impl->flushPolicy = policy;
+  }
+}
+
+qint64 LocalEndpoint::flushThresholdSize() const {
+  return _impl->flushThresholdSize;
+}
+
+int LocalEndpoint::flushThresholdDelay() const {
+  return _impl->flushThresholdDelay;
+}
+
+void LocalEndpoint::setFlushThreshold(qint64 size, int delay) {
+  _impl->flushThresholdSize = std::max<qint64>(0, size);
+  _impl->flushThresholdDelay = std::max(0, delay);
+}
+
+void LocalEndpoint::flush() {
+  _impl->flushAll();
 }
 } // namespace oclero
 
@@ -1,15 +1,24 @@
 #pragma once
 
+#include "Metrics.hpp"
+
+#include <oclero/QtAppInstanceTrace.hpp>
+
+#include <array>
 #include <memory>
 
 #include <QObject>
 #include <QByteArray>
-#include <QVector>
+#include <QFuture>
+#include <QIODevice>
+#include <QList>
+#include <QSet>
 
 namespace oclero {
 /**
  * @brief Allows communication using a local socket (locked file).
  * The first LocalEndpoint acts as the server, and the other ones act as clients.
+ * It is not thread-safe, but may be moved to another thread with moveToThread(): its sockets and timers follow it.
  */
 class LocalEndpoint : public QObject {
   Q_OBJECT
@@ -21,6 +30,11 @@ class LocalEndpoint : public QObject {
 
 public:
   using Id = quint64;
+  using RequestId = quint32;
+  using MessageTag = quint32;
+
+  /// Time, in milliseconds, after which a request without response is canceled by default.
+  static constexpr int DefaultRequestTimeout = 5000;
 
   enum class Role {
     Unknown,
@@ -29,19 +43,280 @@ public:
   };
   Q_ENUM(Role)
 
+  /// Defines when queued messages are actually written to the sockets.
+  enum class FlushPolicy {
+    /// Each message is written and flushed as soon as it is sent.
+    Immediate,
+    /// Messages sent during the same event loop iteration are written at once, when the iteration ends.
+    EndOfIteration,
+    /// Messages are written at once when the queued size reaches a threshold, or when a delay expires.
+    Threshold,
+  };
+  Q_ENUM(FlushPolicy)
+
+  /**
+   * @brief Defines how clients retry to get a role when the server is lost or can't be reached.
+   * Delays are in milliseconds.
+   */
+  struct ReelectionPolicy {
+    /// Delay before retrying after a failed attempt. Doubled at each consecutive failure, up to maxDelay.
+    /// As jitter only adds time, this is also the minimum interval between two attempts.
+    int initialDelay{ 10 };
+    int maxDelay{ 1000 };
+    /// Random extra time added to each delay, as a fraction of it, so that clients spread out.
+    double jitter{ 0.5 };
+    /// When the server is lost, the client with the lowest PID tries to replace it right away. The other ones wait
+    /// this delay (plus jitter) before reconnecting, so they don't compete with it.
+    int rankDelay{ 20 };
+  };
+
+  /**
+   * @brief Defines how the endpoint proves it is responsive, and detects unresponsive ones, e.g. a stopped server
+   * whose socket is still open. Both ends of a connection must enable heartbeats for it to be checked. Pass it to
+   * the constructor, in StartupSettings, so that the lease of a new server expires with its heartbeats from the start.
+   */
+  struct HeartbeatPolicy {
+    /// Milliseconds between two heartbeats, sent to the server or to each client. 0 disables heartbeats.
+    int interval{ 0 };
+    /// Number of consecutive heartbeats that may be missed before the sender is considered dead. At least 2.
+    int missedThreshold{ 3 };
+  };
+
+  /// Codec used to compress large payloads.
+  enum class Compression {
+    None,
+    /// qCompress(): smaller output.
+    Zlib,
+    /// LZ4 block format: much faster, for a slightly larger output.
+    Lz4,
+  };
+  Q_ENUM(Compression)
+
+  /// Outcome of forwardToServer().
+  enum class ForwardResult {
+    /// The server has acknowledged the message, after emitting clientMessageReceived().
+    Delivered,
+    TimedOut,
+    /// Not a client, or the connection was lost.
+    Failed,
+  };
+  Q_ENUM(ForwardResult)
+
+  /// Durations since the endpoint's construction, in nanoseconds, or -1 if the step was not reached yet.
+  struct StartupTimings {
+    qint64 roleResolved{ -1 };
+    qint64 handshakeDone{ -1 };
+    qint64 forwarded{ -1 };
+  };
+
+  /// Buffers used to encode and decode frames, since the endpoint's construction.
+  struct BufferStatistics {
+    /// Buffers allocated because none could be reused. Stays constant in steady state.
+    quint64 allocations{ 0u };
+    quint64 reuses{ 0u };
+  };
+
+  /// Settings that must be known before the role is decided, i.e. before the constructor returns.
+  struct StartupSettings {
+    /// See setShardCount().
+    int shardCount{ 1 };
+    /// See HeartbeatPolicy.
+    HeartbeatPolicy heartbeatPolicy;
+  };
+
+  /**
+   * @brief Traffic of a connection since it was opened. Messages carry the application's data, and control frames
+   * are the protocol's own ones (see protocol::isControlFrame()). Bytes include both, with their headers, and are
+   * counted when queued: bytesToWrite of them may not be written yet.
+   */
+  struct ConnectionStatistics {
+    /// The other endpoint's id: 0 for the server.
+    Id id{ 0u };
+    quint64 messagesReceived{ 0u };
+    quint64 messagesSent{ 0u };
+    quint64 controlFramesReceived{ 0u };
+    quint64 controlFramesSent{ 0u };
+    quint64 bytesReceived{ 0u };
+    quint64 bytesSent{ 0u };
+    /// Bytes waiting to be written: queued according to the flush policy, or buffered by the socket.
+    qint64 bytesToWrite{ 0 };
+  };
+
+  /// Totals since the endpoint's construction. Durations are in nanoseconds.
+  struct Statistics {
+    /// Counted like ConnectionStatistics.
+    quint64 messagesReceived{ 0u };
+    quint64 messagesSent{ 0u };
+    quint64 controlFramesReceived{ 0u };
+    quint64 controlFramesSent{ 0u };
+    quint64 bytesReceived{ 0u };
+    quint64 bytesSent{ 0u };
+    /// Times the role was decided again after being lost, and the time spent without role meanwhile.
+    quint64 reconnects{ 0u };
+    qint64 reelectionTime{ 0 };
+    /// Shared memory segments created for large messages, and messages read from one.
+    quint64 bulkTransfersSent{ 0u };
+    quint64 bulkTransfersReceived{ 0u };
+    /// Duration of the last handshake with the server, from the connection request. -1 if none.
+    qint64 handshakeDuration{ -1 };
+    /// Round trips of requests and acknowledged messages. See LatencyHistogram for the buckets.
+    std::array<quint64, LatencyHistogram::BucketCount> latencyHistogram{};
+  };
+
 public:
   explicit LocalEndpoint(QObject* parent = nullptr);
+  explicit LocalEndpoint(const StartupSettings& settings, QObject* parent = nullptr);
   ~LocalEndpoint();
 
 public:
   int secondaryInstanceCount() const;
+
+  /**
+   * @brief Sharding: up to this number of servers coexist, each one listening on its own name, guarded by its own
+   * shared memory in which it publishes its number of clients. New endpoints become the server of the first shard
+   * without one, otherwise a client of the least loaded shard. Endpoints only communicate within their shard, whose
+   * server gives the ids. Shard 0 uses the same name as without sharding. 1 (default) disables sharding.
+   * Pass it to the constructor, in StartupSettings, so that the role is decided with it. Changing it later only
+   * affects the endpoints of removed shards, which decide their role again: the other ones keep their shard.
+   */
+  int shardCount() const;
+  void setShardCount(int count);
+  /// Shard of the server, or of the server the client is connected to. -1 until the role is decided.
+  int shard() const;
+  /// Number of clients of each shard, as published by their server, or -1 for shards without server.
+  QList<int> shardClientCounts() const;
+
   Id id() const;
   Id serverId() const;
   Role role() const;
+
+  /**
+   * @brief Synchronous fast path, that doesn't run the event loop. Both functions fail if the timeout,
+   * in milliseconds, expires. The role is usually decided in the constructor already, unless the former server's
+   * shared memory was still being destroyed.
+   * forwardToServer() connects to the server, waits for the handshake, then for the server to acknowledge the
+   * message. It must not be used when the server runs in the same thread, as it could not answer.
+   */
+  bool waitForRole(int timeout);
+  ForwardResult forwardToServer(const QByteArray& data, int timeout);
+
+  /**
+   * @brief Sends a message that the server acknowledges once it has emitted clientMessageReceived().
+   * The future finishes then, or is canceled if the timeout expires or the connection is lost.
+   * Legacy servers can't acknowledge messages: they are considered delivered once sent.
+   */
+  QFuture<void> sendAcknowledgedToServer(const QByteArray& data, int timeout);
+  StartupTimings startupTimings() const;
+  BufferStatistics bufferStatistics() const;
+
+  /**
+   * @brief Receives the lifecycle events of each frame: enqueued, written, read and dispatched. Nothing is recorded
+   * unless the library is built with QTAPPINSTANCEMANAGER_TRACING: the hooks then compile to nothing.
+   * nullptr (default) disables it.
+   */
+  void setTraceSink(std::shared_ptr<tracing::Sink> sink);
+
+  /// Thread-safe: the counters are relaxed atomics, updated by the endpoint's thread.
+  Statistics statistics() const;
+  /// Connections with the server, the clients and the peers. Only from the endpoint's thread.
+  QList<ConnectionStatistics> connectionStatistics() const;
+
   void sendToServer(const QByteArray& data);
-  void sendToAllClients(const QByteArray& data, const QVector<Id>& exceptIds = {});
+  /// Sends the same message to all clients but the excluded ones. The frame is encoded only once.
+  void sendToAllClients(const QByteArray& data, const QSet<Id>& exceptIds = {});
+  /**
+   * @brief On a client, the message goes through a direct connection to the other client, opened on demand once
+   * the server told where it listens. It is dropped if the other client can't be reached.
+   */
   void sendToClient(Id clientId, const QByteArray& data);
 
+  /// Sends a message with its type's tag, so that the receiver dispatches it without parsing it.
+  /// Legacy endpoints can't receive them.
+  void sendTypedToServer(MessageTag tag, const QByteArray& data);
+  void sendTypedToClient(Id clientId, MessageTag tag, const QByteArray& data);
+  void sendTypedToAllClients(MessageTag tag, const QByteArray& data, const QSet<Id>& exceptIds = {});
+
+  /**
+   * @brief Topics. The server keeps the subscribed clients of each topic, and routes each published message only to
+   * them, relaying the ones published by clients. The server may subscribe too. Publishers don't receive their own
+   * messages. Subscriptions survive role changes, and are sent again to each new server. Legacy endpoints can't use
+   * topics.
+   */
+  void subscribe(const QByteArray& topic);
+  void unsubscribe(const QByteArray& topic);
+  bool isSubscribed(const QByteArray& topic) const;
+  void publish(const QByteArray& topic, const QByteArray& data);
+
+  /**
+   * @brief Sends a request, and returns a future that receives the response. Many requests may be in flight at once.
+   * The future is canceled if no response arrives before the timeout (negative means never), if the connection
+   * is lost, or if the other endpoint is a legacy one. The request is received with the *RequestReceived() signals.
+   */
+  QFuture<QByteArray> requestToServer(const QByteArray& data, int timeout = DefaultRequestTimeout);
+  QFuture<QByteArray> requestToClient(Id clientId, const QByteArray& data, int timeout = DefaultRequestTimeout);
+  /// Sends the response to a request received with the *RequestReceived() signals.
+  void replyToServer(RequestId requestId, const QByteArray& data);
+  void replyToClient(Id clientId, RequestId requestId, const QByteArray& data);
+
+  /**
+   * @brief Sends the content of the device in chunks, read only when the socket has room for them.
+   * The device must stay open until it has been read to its end. Sequential devices (processes, sockets, pipes)
+   * end when their read channel is finished or when they are closed, not when their buffer is empty. It is received
+   * in chunks with the *StreamChunkReceived() signals. Legacy endpoints receive it as a single message instead.
+   */
+  void sendStreamToServer(QIODevice* device);
+  void sendStreamToClient(Id clientId, QIODevice* device);
+  qint64 streamChunkSize() const;
+  void setStreamChunkSize(qint64 size);
+
+  /**
+   * @brief Messages of at least this size are copied to a shared memory segment, and only a small
+   * descriptor goes through the socket. The receiver copies the message out of the segment, which is
+   * then released. 0 (default) disables it.
+   */
+  qint64 bulkTransferThreshold() const;
+  void setBulkTransferThreshold(qint64 size);
+
+  /**
+   * @brief Maximum number of frames read from a connection before returning to the event loop.
+   * Remaining frames are read in the next iteration. 0 (default) reads all available frames at once.
+   */
+  int maxFramesPerRead() const;
+  void setMaxFramesPerRead(int count);
+
+  /**
+   * @brief Payloads of at least the threshold size, in bytes, are compressed with the codec, if the receiver
+   * advertised in its handshake that it can decompress them, and if that makes them smaller. Smaller payloads
+   * are sent raw. Received payloads are decompressed whatever the settings. Compression::None (default) disables it.
+   */
+  Compression compression() const;
+  void setCompression(Compression compression);
+  qint64 compressionThreshold() const;
+  void setCompressionThreshold(qint64 size);
+
+  ReelectionPolicy reelectionPolicy() const;
+  void setReelectionPolicy(const ReelectionPolicy& policy);
+
+  HeartbeatPolicy heartbeatPolicy() const;
+  void setHeartbeatPolicy(const HeartbeatPolicy& policy);
+
+  FlushPolicy flushPolicy() const;
+  void setFlushPolicy(FlushPolicy policy);
+  qint64 flushThresholdSize() const;
+  int flushThresholdDelay() const;
+  /// Only used with FlushPolicy::Threshold. Size is in bytes, delay in milliseconds.
+  void setFlushThreshold(qint64 size, int delay);
+
+  /// Writes all queued messages to the sockets right now. Messages sent before the handshake are written as soon as
+  /// it is done.
+  void flush();
+
+  /**
+   * @brief Writes all queued messages, then blocks until the sockets have written them, or until the timeout
+   * (in milliseconds) expires. Doesn't run the event loop. Meant to be called right before exiting the process.
+   */
+  bool waitForBytesWritten(int timeout);
+
 signals:
   /// Emitted when the endpoint's role has changed.
   void roleChanged();
@@ -58,6 +333,27 @@ signals:
   /// Emitted when a message from the primary endpoint is received (usually called on secondary endpoints).
   void serverMessageReceived(const QByteArray& data);
 
+  /// Emitted when a typed message from a secondary endpoint is received.
+  void clientTypedMessageReceived(const Id clientId, const MessageTag tag, const QByteArray& data);
+
+  /// Emitted when a typed message from the primary endpoint is received.
+  void serverTypedMessageReceived(const MessageTag tag, const QByteArray& data);
+
+  /// Emitted when a message is published to a subscribed topic, by the server (id 0) or by a client.
+  void topicMessageReceived(const QByteArray& topic, const Id publisherId, const QByteArray& data);
+
+  /// Emitted when a request from a secondary endpoint is received. Answer it with replyToClient().
+  void clientRequestReceived(const Id clientId, const RequestId requestId, const QByteArray& data);
+
+  /// Emitted when a request from the primary endpoint is received. Answer it with replyToServer().
+  void serverRequestReceived(const RequestId requestId, const QByteArray& data);
+
+  /// Emitted when a chunk of a stream from a secondary endpoint is received.
+  void clientStreamChunkReceived(const Id clientId, const QByteArray& chunk, bool last);
+
+  /// Emitted when a chunk of a stream from the primary endpoint is received.
+  void serverStreamChunkReceived(const QByteArray& chunk, bool last);
+
   /// Emitted when the number of endpoints has changed.
   void clientCountChanged();
 
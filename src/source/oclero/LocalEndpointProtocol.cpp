@@ -0,0 +1,292 @@
+#include "LocalEndpointProtocol.hpp"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QtEndian>
+
+#include <cstring>
+
+namespace oclero::protocol {
+namespace {
+constexpr auto ClientVersionShift = 32;
+constexpr auto ServerVersionShift = 48;
+constexpr auto ClientCapabilitiesShift = 48;
+constexpr auto PeerCapabilitiesShift = 32;
+constexpr quint64 PidMask = 0xFFFFFFFFu;
+constexpr quint64 VersionMask = 0xFFFFu;
+constexpr quint64 CapabilitiesMask = 0xFFFFu;
+constexpr auto PeerIdSize = static_cast<qsizetype>(sizeof(quint64));
+
+QByteArray encodeLegacyFrame(const QByteArray& payload) {
+  QByteArray frame;
+  {
+    QDataStream stream(&frame, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
+    stream << static_cast<quint64>(payload.size());
+    stream << payload;
+  }
+  return frame;
+}
+} // namespace
+
+quint64 makeClientHandshake(quint64 pid, Version version, quint16 capabilities) {
+  return (pid & PidMask) | (static_cast<quint64>(version) << ClientVersionShift)
+         | (static_cast<quint64>(capabilities) << ClientCapabilitiesShift);
+}
+
+void parseClientHandshake(quint64 word, quint64& pid, Version& version, quint16& capabilities) {
+  pid = word & PidMask;
+  version = static_cast<Version>((word >> ClientVersionShift) & VersionMask);
+  capabilities = static_cast<quint16>((word >> ClientCapabilitiesShift) & CapabilitiesMask);
+}
+
+quint64 makeServerHandshake(Version version, quint16 capabilities) {
+  return (static_cast<quint64>(version) << ServerVersionShift) | capabilities;
+}
+
+Version parseServerHandshake(quint64 word) {
+  return static_cast<Version>((word >> ServerVersionShift) & VersionMask);
+}
+
+quint16 parseServerCapabilities(quint64 word) {
+  return static_cast<quint16>(word & CapabilitiesMask);
+}
+
+quint64 makePeerHandshake(Version version, quint16 capabilities) {
+  return (static_cast<quint64>(capabilities) << PeerCapabilitiesShift)
+         | (static_cast<quint64>(version) << ServerVersionShift);
+}
+
+void parsePeerHandshake(quint64 word, Version& version, quint16& capabilities) {
+  capabilities = static_cast<quint16>((word >> PeerCapabilitiesShift) & CapabilitiesMask);
+  version = static_cast<Version>((word >> ServerVersionShift) & VersionMask);
+}
+
+QByteArray makePeerToken(const QByteArray& secret, quint64 id) {
+  char idData[PeerIdSize];
+  qToBigEndian<quint64>(id, idData);
+  QCryptographicHash hash(QCryptographicHash::Sha256);
+  hash.addData(secret);
+  hash.addData(QByteArrayView(idData, PeerIdSize));
+  return hash.result().left(PeerTokenSize);
+}
+
+QByteArray encodePeerName(const QByteArray& secret, const QByteArray& name) {
+  return secret + name;
+}
+
+bool decodePeerName(const QByteArray& payload, QByteArray& secret, QByteArray& name) {
+  if (payload.size() <= PeerSecretSize) {
+    return false;
+  }
+  secret = payload.left(PeerSecretSize);
+  name = payload.mid(PeerSecretSize);
+  return true;
+}
+
+QByteArray encodePeerLookup(quint64 id, const QByteArray& token, const QByteArray& name) {
+  QByteArray payload(PeerIdSize, Qt::Uninitialized);
+  qToBigEndian<quint64>(id, payload.data());
+  if (!name.isEmpty()) {
+    payload += token;
+    payload += name;
+  }
+  return payload;
+}
+
+bool decodePeerLookup(const QByteArray& payload, quint64& id, QByteArray& token, QByteArray& name) {
+  if (payload.size() < PeerIdSize) {
+    return false;
+  }
+  id = qFromBigEndian<quint64>(payload.constData());
+  if (payload.size() > PeerIdSize + PeerTokenSize) {
+    token = payload.mid(PeerIdSize, PeerTokenSize);
+    name = payload.mid(PeerIdSize + PeerTokenSize);
+  } else {
+    token.clear();
+    name.clear();
+  }
+  return true;
+}
+
+QByteArray encodeBulkDescriptor(quint64 size, const QString& key) {
+  const auto keyData = key.toUtf8();
+  QByteArray payload(static_cast<qsizetype>(sizeof(quint64)) + keyData.size(), Qt::Uninitialized);
+  qToBigEndian<quint64>(size, payload.data());
+  std::memcpy(payload.data() + sizeof(quint64), keyData.constData(), static_cast<size_t>(keyData.size()));
+  return payload;
+}
+
+bool decodeBulkDescriptor(const QByteArray& payload, quint64& size, QString& key) {
+  if (payload.size() <= static_cast<qsizetype>(sizeof(quint64))) {
+    return false;
+  }
+  size = qFromBigEndian<quint64>(payload.constData());
+  constexpr auto sizeFieldSize = static_cast<qsizetype>(sizeof(quint64));
+  key = QString::fromUtf8(payload.constData() + sizeFieldSize, payload.size() - sizeFieldSize);
+  return true;
+}
+
+QByteArray encodeTopicMessage(quint64 publisherId, const QByteArray& topic, const QByteArray& data) {
+  constexpr auto publisherIdSize = static_cast<qsizetype>(sizeof(quint64));
+  QByteArray payload(publisherIdSize + topic.size() + data.size(), Qt::Uninitialized);
+  auto* const dst = payload.data();
+  qToBigEndian<quint64>(publisherId, dst);
+  if (!topic.isEmpty()) {
+    std::memcpy(dst + publisherIdSize, topic.constData(), static_cast<size_t>(topic.size()));
+  }
+  if (!data.isEmpty()) {
+    std::memcpy(dst + publisherIdSize + topic.size(), data.constData(), static_cast<size_t>(data.size()));
+  }
+  return payload;
+}
+
+void setTopicMessagePublisher(QByteArray& payload, quint64 publisherId) {
+  if (payload.size() >= static_cast<qsizetype>(sizeof(quint64))) {
+    qToBigEndian<quint64>(publisherId, payload.data());
+  }
+}
+
+bool decodeTopicMessage(const QByteArray& payload, quint32 topicSize, TopicMessage& message) {
+  constexpr auto publisherIdSize = static_cast<qsizetype>(sizeof(quint64));
+  if (payload.size() - publisherIdSize < static_cast<qsizetype>(topicSize)) {
+    return false;
+  }
+  const auto* const src = payload.constData();
+  message.publisherId = qFromBigEndian<quint64>(src);
+  message.topic = QByteArrayView(src + publisherIdSize, static_cast<qsizetype>(topicSize));
+  const auto dataOffset = publisherIdSize + static_cast<qsizetype>(topicSize);
+  message.data = QByteArrayView(src + dataOffset, payload.size() - dataOffset);
+  return true;
+}
+
+bool readHandshakeWord(QIODevice& device, quint64& word) {
+  if (!peekHandshakeWord(device, word)) {
+    return false;
+  }
+  device.skip(HandshakeWordSize);
+  return true;
+}
+
+bool peekHandshakeWord(QIODevice& device, quint64& word) {
+  char buffer[HandshakeWordSize];
+  if (device.bytesAvailable() < HandshakeWordSize || device.peek(buffer, HandshakeWordSize) != HandshakeWordSize) {
+    return false;
+  }
+  word = qFromBigEndian<quint64>(buffer);
+  return true;
+}
+
+QByteArray encodeHandshakeWords(std::initializer_list<quint64> words) {
+  QByteArray data(static_cast<qsizetype>(words.size()) * HandshakeWordSize, Qt::Uninitialized);
+  auto* dst = data.data();
+  for (const auto word : words) {
+    qToBigEndian<quint64>(word, dst);
+    dst += HandshakeWordSize;
+  }
+  return data;
+}
+
+void writeFrameHeader(const FrameHeader& header, char* dst) {
+  dst[0] = static_cast<char>(header.type);
+  dst[1] = static_cast<char>(header.flags);
+  qToBigEndian<quint16>(header.sequence, dst + 2);
+  qToBigEndian<quint32>(header.tag, dst + 4);
+  qToBigEndian<quint64>(header.size, dst + 8);
+}
+
+FrameHeader readFrameHeader(const char* src) {
+  FrameHeader header;
+  header.type = static_cast<FrameType>(static_cast<quint8>(src[0]));
+  header.flags = static_cast<quint8>(src[1]);
+  header.sequence = qFromBigEndian<quint16>(src + 2);
+  header.tag = qFromBigEndian<quint32>(src + 4);
+  header.size = qFromBigEndian<quint64>(src + 8);
+  return header;
+}
+
+void encodeFrameInto(
+  char* dst, const QByteArray& payload, FrameType type, quint8 flags, quint32 tag, quint16 sequence) {
+  writeFrameHeader(FrameHeader{ type, flags, tag, static_cast<quint64>(payload.size()), sequence }, dst);
+  if (!payload.isEmpty()) {
+    std::memcpy(dst + FrameHeaderSize, payload.constData(), static_cast<size_t>(payload.size()));
+  }
+}
+
+QByteArray encodeFrame(Version version, const QByteArray& payload, FrameType type, quint8 flags, quint32 tag) {
+  if (version == Version::Legacy) {
+    return encodeLegacyFrame(payload);
+  }
+
+  QByteArray frame(FrameHeaderSize + payload.size(), Qt::Uninitialized);
+  encodeFrameInto(frame.data(), payload, type, flags, tag);
+  return frame;
+}
+
+void writeFrame(QIODevice& device, Version version, const QByteArray& payload, FrameType type, quint8 flags,
+  quint32 tag) {
+  if (version == Version::Legacy || payload.size() <= ContiguousFrameMaxSize) {
+    device.write(encodeFrame(version, payload, type, flags, tag));
+    return;
+  }
+
+  // Large payload: don't copy it into a temporary frame, the device buffers it right after the header.
+  char header[FrameHeaderSize];
+  writeFrameHeader(FrameHeader{ type, flags, tag, static_cast<quint64>(payload.size()) }, header);
+  device.write(header, FrameHeaderSize);
+  device.write(payload);
+}
+
+qint64 appendFrame(QByteArrayList& buffers, Version version, const QByteArray& payload, FrameType type, quint8 flags,
+  quint32 tag, quint16 sequence) {
+  if (version == Version::Legacy) {
+    buffers.append(encodeFrame(version, payload, type, flags, tag));
+    return buffers.back().size();
+  }
+  if (payload.size() <= ContiguousFrameMaxSize) {
+    QByteArray frame(FrameHeaderSize + payload.size(), Qt::Uninitialized);
+    encodeFrameInto(frame.data(), payload, type, flags, tag, sequence);
+    buffers.append(frame);
+    return frame.size();
+  }
+
+  QByteArray header(FrameHeaderSize, Qt::Uninitialized);
+  writeFrameHeader(FrameHeader{ type, flags, tag, static_cast<quint64>(payload.size()), sequence }, header.data());
+  buffers.append(header);
+  buffers.append(payload);
+  return FrameHeaderSize + payload.size();
+}
+
+void writeBuffers(QIODevice& device, const QByteArrayList& buffers, QByteArray& batch) {
+  if (buffers.size() == 1) {
+    device.write(buffers.front());
+    return;
+  }
+
+  auto batchSize = qsizetype{ 0 };
+  for (const auto& buffer : buffers) {
+    if (buffer.size() <= ContiguousFrameMaxSize) {
+      batchSize += buffer.size();
+    }
+  }
+
+  // Small buffers are copied together; large ones are written as is, in between.
+  batch.truncate(0);
+  batch.reserve(batchSize);
+  for (const auto& buffer : buffers) {
+    if (buffer.size() <= ContiguousFrameMaxSize) {
+      batch.append(buffer);
+    } else {
+      if (!batch.isEmpty()) {
+        device.write(batch);
+        batch.truncate(0);
+      }
+      device.write(buffer);
+    }
+  }
+  if (!batch.isEmpty()) {
+    device.write(batch);
+    batch.truncate(0);
+  }
+}
+} // namespace oclero::protocol
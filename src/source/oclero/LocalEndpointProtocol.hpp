@@ -0,0 +1,270 @@
+#pragma once
+
+#include <QByteArray>
+#include <QByteArrayList>
+#include <QByteArrayView>
+#include <QIODevice>
+#include <QString>
+#include <QtGlobal>
+
+#include <initializer_list>
+
+namespace oclero::protocol {
+/**
+ * @brief Wire protocol version, negotiated during the handshake.
+ * Both endpoints use the lowest version supported by each other.
+ */
+enum class Version : quint16 {
+  /// Original framing: 8-byte body size, then the body serialized as a QByteArray by QDataStream.
+  Legacy = 0,
+  /// One 16-byte frame header, then the raw payload.
+  Framed = 1,
+
+  Current = Framed,
+};
+
+/// Type of a frame, as written in its header. Unknown types are skipped by the receiver.
+enum class FrameType : quint8 {
+  Message = 0,
+  /// Part of a stream. The tag identifies the stream within the connection.
+  Chunk = 1,
+  /// A message whose payload is in a shared memory segment. The tag identifies the transfer.
+  BulkDescriptor = 2,
+  /// Tells the sender that the shared memory segment of a transfer may be released.
+  BulkRelease = 3,
+  /// A message that expects a response. The tag is the request id, chosen by the sender.
+  Request = 4,
+  /// The response to a request. The tag is the id of the request.
+  Response = 5,
+  /// Sent by the server to each client when its rank changes. The tag is 0 for the client with the lowest PID, which
+  /// replaces the server first, and 1 for the other ones. Former servers sent the rank in increasing PID order.
+  SuccessionRank = 6,
+  /// Acknowledges a message sent with FrameFlag::AckRequested. The tag is the message's tag.
+  Ack = 7,
+  /// A message whose payload is encoded by the typed message API. The tag identifies the type of the message.
+  TypedMessage = 8,
+  /// Sent by a client to receive the messages published to a topic. The payload is the topic.
+  Subscribe = 9,
+  Unsubscribe = 10,
+  /// A message published to a topic, relayed by the server to the topic's subscribers. The tag is the topic's size.
+  Publish = 11,
+  /// Sent by the server the first time another client looks the client up: a secret, then the name on which the
+  /// client must listen for direct connections from the other clients. See encodePeerName().
+  /// The client sends the name back once it listens, or an empty payload if it can't.
+  PeerName = 12,
+  /// Sent by a client to get the name on which another client listens. The payload is the other client's id.
+  /// The server answers with a frame of the same type, whose payload is the id, then the token with which to
+  /// connect and the name, or only the id if the client can't be reached. See encodePeerLookup().
+  PeerLookup = 13,
+  /// Sent periodically by endpoints whose heartbeats are enabled, to prove they are responsive. The tag is the time,
+  /// in milliseconds, after which the receiver may consider the sender dead if it receives nothing from it.
+  Heartbeat = 14,
+};
+
+/**
+ * @brief Returns true for the frames that the protocol exchanges for itself (e.g. acknowledgments, heartbeats or
+ * subscriptions), as opposed to the ones that carry data sent by the application.
+ */
+constexpr bool isControlFrame(FrameType type) {
+  switch (type) {
+    case FrameType::Message:
+    case FrameType::Chunk:
+    case FrameType::BulkDescriptor:
+    case FrameType::Request:
+    case FrameType::Response:
+    case FrameType::TypedMessage:
+    case FrameType::Publish:
+      return false;
+    default:
+      return true;
+  }
+}
+
+/// Bits of FrameHeader::flags.
+enum FrameFlag : quint8 {
+  /// The chunk is the last one of its stream.
+  LastChunk = 0x01,
+  /// The receiver must answer the message with a FrameType::Ack frame, once handled. The tag identifies the message.
+  AckRequested = 0x02,
+  /// The payload was compressed by qCompress().
+  ZlibCompressed = 0x04,
+  /// The payload was compressed by compression::compressLz4().
+  Lz4Compressed = 0x08,
+};
+
+/// Optional features of an endpoint, advertised in the handshake words. Legacy endpoints have none.
+enum Capability : quint16 {
+  /// Decompresses FrameFlag::ZlibCompressed payloads.
+  ZlibDecompression = 0x0001,
+  /// Decompresses FrameFlag::Lz4Compressed payloads.
+  Lz4Decompression = 0x0002,
+};
+
+/// Capabilities of this implementation.
+constexpr quint16 SupportedCapabilities = ZlibDecompression | Lz4Decompression;
+
+/**
+ * @brief Header preceding every frame when using the Version::Framed protocol.
+ * Serialized as 16 big-endian bytes: type (1), flags (1), sequence (2), tag (4), payload size (8).
+ */
+struct FrameHeader {
+  FrameType type{ FrameType::Message };
+  quint8 flags{ 0u };
+  quint32 tag{ 0u };
+  quint64 size{ 0u };
+  /// Low 16 bits of the frame's sequence number on its connection, for tracing. 0 means none (e.g. frames encoded
+  /// once for several recipients, or sent by former endpoints, which wrote 0 there).
+  quint16 sequence{ 0u };
+};
+
+/// Returns the sequence number following the given one. Numbers whose low 16 bits are 0 are skipped, as 0 means none.
+constexpr quint64 nextFrameSequence(quint64 sequence) {
+  ++sequence;
+  return (sequence & 0xFFFFu) == 0u ? sequence + 1u : sequence;
+}
+
+/**
+ * @brief Returns the sequence number of a received frame, from the low 16 bits written in its header, and the sequence
+ * number of the last frame received with one. Frames are received in the order they were sent.
+ */
+constexpr quint64 extendFrameSequence(quint64 last, quint16 sequence) {
+  const auto extended = (last & ~quint64{ 0xFFFFu }) | sequence;
+  return extended <= last ? extended + 0x10000u : extended;
+}
+
+/// Size of the serialized FrameHeader.
+constexpr qint64 FrameHeaderSize = 16;
+
+/// Size of the header that precedes a message with the Version::Legacy protocol.
+constexpr qint64 LegacyHeaderSize = sizeof(quint64);
+
+/// Size of the QByteArray length prefix written by QDataStream in Version::Legacy bodies.
+constexpr qint64 LegacyBodyPrefixSize = sizeof(quint32);
+
+/// Size of a handshake word.
+constexpr qint64 HandshakeWordSize = sizeof(quint64);
+
+/// Size of the secret given by the server to a client that listens for its peers, and of the tokens derived from it.
+constexpr qint64 PeerSecretSize = 16;
+constexpr qint64 PeerTokenSize = 16;
+
+/// Size of the handshake of a peer connection: one handshake word, the connecting client's id, then its token.
+constexpr qint64 PeerHandshakeSize = 2 * HandshakeWordSize + PeerTokenSize;
+
+/// Payloads up to this size are copied with their header into a single buffer before being written.
+constexpr qint64 ContiguousFrameMaxSize = 64 * 1024;
+
+/// Returns the size of the header that precedes each message.
+constexpr qint64 headerSize(Version version) {
+  return version == Version::Legacy ? LegacyHeaderSize : FrameHeaderSize;
+}
+
+/// Returns the number of bytes that follow the header, for a payload of the given size.
+constexpr qint64 bodySize(Version version, quint64 payloadSize) {
+  return static_cast<qint64>(payloadSize) + (version == Version::Legacy ? LegacyBodyPrefixSize : 0);
+}
+
+/// Returns the highest version that both endpoints support.
+constexpr Version negotiate(Version remote) {
+  return remote < Version::Current ? remote : Version::Current;
+}
+
+/// Payload of a FrameType::BulkDescriptor frame: the size of the message, then the segment's key.
+QByteArray encodeBulkDescriptor(quint64 size, const QString& key);
+bool decodeBulkDescriptor(const QByteArray& payload, quint64& size, QString& key);
+
+/**
+ * @brief Payload of a FrameType::Publish frame: the publisher's id (8 bytes), the topic, then the message.
+ * Clients leave the publisher's id to 0: the server sets it before relaying the frame to the subscribers.
+ */
+QByteArray encodeTopicMessage(quint64 publisherId, const QByteArray& topic, const QByteArray& data);
+void setTopicMessagePublisher(QByteArray& payload, quint64 publisherId);
+
+/// Views of a FrameType::Publish payload, valid as long as the payload is neither modified nor destroyed.
+struct TopicMessage {
+  quint64 publisherId{ 0u };
+  QByteArrayView topic{};
+  QByteArrayView data{};
+};
+bool decodeTopicMessage(const QByteArray& payload, quint32 topicSize, TopicMessage& message);
+
+/**
+ * @brief Client handshake word: the client's PID in the low 32 bits, the highest protocol version
+ * it supports in bits 32 to 47, and its capabilities in bits 48 to 63.
+ * Legacy clients send their PID only, so their version reads as Legacy, without capabilities.
+ */
+quint64 makeClientHandshake(quint64 pid, Version version, quint16 capabilities);
+void parseClientHandshake(quint64 word, quint64& pid, Version& version, quint16& capabilities);
+
+/**
+ * @brief Server handshake word. Legacy servers send the client id only. Newer servers send the
+ * negotiated version in bits 48 to 63 and their capabilities in the low 16 bits, followed by a second word
+ * containing the client id. The capabilities are only meaningful if the version is not Legacy.
+ */
+quint64 makeServerHandshake(Version version, quint16 capabilities);
+Version parseServerHandshake(quint64 word);
+quint16 parseServerCapabilities(quint64 word);
+
+/**
+ * @brief Handshake word sent by a client that connects directly to another client: its capabilities in bits 32
+ * to 47, and the highest protocol version it supports in bits 48 to 63. It is followed by a word containing the
+ * client's id, then by the token given by the server for this id (see makePeerToken()), and answered by a server
+ * handshake word.
+ */
+quint64 makePeerHandshake(Version version, quint16 capabilities);
+void parsePeerHandshake(quint64 word, Version& version, quint16& capabilities);
+
+/**
+ * @brief Token with which the client whose id is given connects to the client that received the secret.
+ * Only the server and the listening client know the secret, so the listening client can check that the server
+ * looked it up for this id, and that the id was not made up.
+ */
+QByteArray makePeerToken(const QByteArray& secret, quint64 id);
+
+/// Payload of a FrameType::PeerName frame sent by the server: the secret (PeerSecretSize bytes), then the name.
+QByteArray encodePeerName(const QByteArray& secret, const QByteArray& name);
+bool decodePeerName(const QByteArray& payload, QByteArray& secret, QByteArray& name);
+
+/**
+ * @brief Payload of a FrameType::PeerLookup frame: the looked up client's id (8 bytes), then, in the server's
+ * answer, the token (PeerTokenSize bytes) and the name. Both are empty if the client can't be reached.
+ */
+QByteArray encodePeerLookup(quint64 id, const QByteArray& token = {}, const QByteArray& name = {});
+bool decodePeerLookup(const QByteArray& payload, quint64& id, QByteArray& token, QByteArray& name);
+
+/// Reads or peeks a handshake word. Returns false, without consuming anything, if it is not whole yet.
+bool readHandshakeWord(QIODevice& device, quint64& word);
+bool peekHandshakeWord(QIODevice& device, quint64& word);
+QByteArray encodeHandshakeWords(std::initializer_list<quint64> words);
+
+void writeFrameHeader(const FrameHeader& header, char* dst);
+FrameHeader readFrameHeader(const char* src);
+
+/// Encodes a Version::Framed frame (header and payload) at dst, which must hold FrameHeaderSize + payload.size() bytes.
+void encodeFrameInto(
+  char* dst, const QByteArray& payload, FrameType type, quint8 flags, quint32 tag, quint16 sequence = 0u);
+
+/// Encodes a whole frame (header and payload) in a single buffer.
+QByteArray encodeFrame(Version version, const QByteArray& payload, FrameType type = FrameType::Message,
+  quint8 flags = 0u, quint32 tag = 0u);
+
+/**
+ * @brief Appends a frame to a list of buffers to be written later, and returns the number of bytes appended.
+ * Large payloads are appended after their header as is, so they are shared instead of copied.
+ */
+qint64 appendFrame(QByteArrayList& buffers, Version version, const QByteArray& payload,
+  FrameType type = FrameType::Message, quint8 flags = 0u, quint32 tag = 0u, quint16 sequence = 0u);
+
+/**
+ * @brief Writes buffers to the device, coalescing the small ones so they end up in as few writes as possible.
+ * They are coalesced in batch, whose capacity is kept for the next call.
+ */
+void writeBuffers(QIODevice& device, const QByteArrayList& buffers, QByteArray& batch);
+
+/**
+ * @brief Writes a frame to the device. Small frames are written with a single write() call.
+ * For larger payloads, the header and the payload are written back to back to avoid copying the payload.
+ */
+void writeFrame(QIODevice& device, Version version, const QByteArray& payload, FrameType type = FrameType::Message,
+  quint8 flags = 0u, quint32 tag = 0u);
+} // namespace oclero::protocol
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QtGlobal>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+namespace oclero {
+/**
+ * @brief Counter written by a single thread, and readable from any thread. Relaxed atomics: reads may be slightly
+ * behind, but never torn, and writing costs a plain load and store instead of a locked read-modify-write.
+ */
+class Counter {
+public:
+  /// Only from the writing thread.
+  void add(quint64 value = 1u) {
+    _value.store(_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  /// Only from the writing thread.
+  void set(quint64 value) {
+    _value.store(value, std::memory_order_relaxed);
+  }
+
+  quint64 value() const {
+    return _value.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<quint64> _value{ 0u };
+};
+
+/**
+ * @brief Histogram of durations, with power-of-two buckets: bucket i counts durations from 2^i to 2^(i+1)
+ * microseconds, except the first one, which also counts shorter ones, and the last one, which counts all longer ones.
+ */
+class LatencyHistogram {
+public:
+  static constexpr int BucketCount = 24;
+
+  /// Only from the writing thread.
+  void record(qint64 nanoseconds) {
+    _buckets[static_cast<std::size_t>(bucketIndex(nanoseconds))].add();
+  }
+
+  std::array<quint64, BucketCount> buckets() const {
+    std::array<quint64, BucketCount> result{};
+    for (std::size_t i = 0; i < result.size(); ++i) {
+      result[i] = _buckets[i].value();
+    }
+    return result;
+  }
+
+  static int bucketIndex(qint64 nanoseconds) {
+    auto microseconds = static_cast<quint64>(std::max<qint64>(nanoseconds, 0)) / 1000u;
+    auto index = 0;
+    while (microseconds > 1u && index < BucketCount - 1) {
+      microseconds >>= 1;
+      ++index;
+    }
+    return index;
+  }
+
+private:
+  std::array<Counter, BucketCount> _buckets{};
+};
+
+/// Messages, control frames and bytes received and sent.
+struct TrafficCounters {
+  Counter messagesReceived;
+  Counter messagesSent;
+  Counter controlFramesReceived;
+  Counter controlFramesSent;
+  Counter bytesReceived;
+  Counter bytesSent;
+};
+} // namespace oclero
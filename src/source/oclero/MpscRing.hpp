@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace oclero {
+#if defined(_MSC_VER)
+#pragma warning(push)
+// Structure was padded due to alignment specifier: intended, to keep producers and consumer on separate cache lines.
+#pragma warning(disable : 4324)
+#endif
+
+/**
+ * @brief Bounded multi-producer single-consumer queue, without locks nor allocations once constructed.
+ * Each slot has a sequence number telling whether it is free for the producers or ready for the consumer.
+ * Producers claim slots with a compare-and-swap on the tail; the consumer owns the head.
+ * tryPush() may be called from any thread, tryPop() from a single thread at a time.
+ */
+template<typename T>
+class MpscRing {
+public:
+  /// The capacity is rounded up to a power of two.
+  explicit MpscRing(std::size_t capacity)
+    : _capacity(roundUpToPowerOfTwo(capacity))
+    , _mask(_capacity - 1)
+    , _slots(new Slot[_capacity]) {
+    for (std::size_t i = 0; i < _capacity; ++i) {
+      _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscRing(const MpscRing&) = delete;
+  MpscRing& operator=(const MpscRing&) = delete;
+
+  std::size_t capacity() const {
+    return _capacity;
+  }
+
+  /// Returns false, without moving the value, if the ring is full.
+  bool tryPush(T&& value) {
+    auto position = _tail.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    for (;;) {
+      slot = &_slots[position & _mask];
+      const auto sequence = slot->sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+      if (difference == 0) {
+        // The slot is free: claim it.
+        if (_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        // The slot still holds a value from the previous lap.
+        return false;
+      } else {
+        // Another producer claimed the slot.
+        position = _tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->value = std::move(value);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Returns false if the ring is empty, or if the next value is still being written by its producer.
+   * In the latter case, the producer returns from tryPush() right after, so it may then notify the consumer.
+   */
+  bool tryPop(T& value) {
+    auto& slot = _slots[_head & _mask];
+    if (slot.sequence.load(std::memory_order_acquire) != _head + 1) {
+      return false;
+    }
+
+    value = std::exchange(slot.value, T{});
+    // Free the slot for the next lap.
+    slot.sequence.store(_head + _capacity, std::memory_order_release);
+    ++_head;
+    return true;
+  }
+
+private:
+  struct Slot {
+    std::atomic<std::size_t> sequence{ 0u };
+    T value{};
+  };
+
+  static std::size_t roundUpToPowerOfTwo(std::size_t value) {
+    std::size_t result = 2;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const std::size_t _capacity;
+  const std::size_t _mask;
+  const std::unique_ptr<Slot[]> _slots;
+  alignas(64) std::atomic<std::size_t> _tail{ 0u };
+  alignas(64) std::size_t _head{ 0u };
+};
+
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+} // namespace oclero
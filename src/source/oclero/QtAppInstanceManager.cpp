@@ -1,49 +1,363 @@
 #include <oclero/QtAppInstanceManager.hpp>
 
 #include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThread>
 #include <QTimer>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+
 #include "LocalEndpoint.hpp"
+#include "MpscRing.hpp"
 
 namespace oclero {
+namespace {
+// Number of messages that other threads may queue before the endpoint's thread sends them.
+constexpr std::size_t OutgoingMessagesCapacity = 4096;
+// Attempts to queue a message while the queue is full, before waiting for the endpoint's thread to send it.
+constexpr int FullQueueRetries = 64;
+} // namespace
+
 struct QtAppInstanceManager::Impl {
+  // A message sent from a thread other than the endpoint's one, waiting to be sent by the endpoint's thread.
+  struct OutgoingMessage {
+    enum class Target {
+      Primary,
+      Secondary,
+      AllSecondaries,
+      Subscribers,
+    };
+
+    Target target{ Target::Primary };
+    quint64 id{ 0u };
+    QByteArray data{};
+    QSet<LocalEndpoint::Id> exceptIds{};
+    // Set for typed messages.
+    std::optional<LocalEndpoint::MessageTag> tag{};
+    // Set for messages published to a topic.
+    QByteArray topic{};
+    // Set for calls posted with post(), which go through the same queue as messages to keep their order.
+    std::function<void()> call{};
+  };
+
   QtAppInstanceManager& owner;
   LocalEndpoint endpoint;
-  Mode mode{ Mode::MultipleInstances };
-  AppExitMode appExitMode{ AppExitMode::Auto };
+  // Readable and writable from any thread. Their side effects happen in the manager's thread.
+  std::atomic<Mode> mode{ Mode::MultipleInstances };
+  std::atomic<AppExitMode> appExitMode{ AppExitMode::Auto };
+  std::atomic<int> forwardTimeout{ DefaultForwardTimeout };
+  // Arguments are forwarded only once, even if the role is resolved again meanwhile. Manager's thread only.
+  bool forwarding{ false };
+  // Copy of the endpoint's role, readable from any thread.
+  std::atomic<LocalEndpoint::Role> role{ LocalEndpoint::Role::Unknown };
+  // Runs the endpoint's event loop when enabled.
+  QThread ioThread;
+  // Messages sent from other threads. Only one drain at a time is scheduled in the endpoint's thread.
+  MpscRing<OutgoingMessage> outgoingMessages{ OutgoingMessagesCapacity };
+  std::atomic<bool> drainScheduled{ false };
+  // Callbacks of the typed messages, by tag. Shared, so that a callback may replace itself.
+  std::unordered_map<quint32, std::shared_ptr<MessageHandler>> messageHandlers;
 
-  Impl(QtAppInstanceManager& o)
-    : owner(o) {
+  Impl(QtAppInstanceManager& o, const StartupSettings& settings)
+    : owner(o)
+    , endpoint(LocalEndpoint::StartupSettings{ settings.shardCount,
+        { settings.heartbeatPolicy.interval, settings.heartbeatPolicy.missedThreshold } }) {
+    ioThread.setObjectName(QStringLiteral("QtAppInstanceManager I/O"));
+
+    // Signals are connected to slots in the manager's thread: they are queued when the endpoint runs in the I/O thread.
+    QObject::connect(
+      &endpoint, &LocalEndpoint::roleChanged, &endpoint,
+      [this]() {
+        role = endpoint.role();
+      },
+      Qt::DirectConnection);
+    role = endpoint.role();
     QObject::connect(&endpoint, &LocalEndpoint::serverMessageReceived, &owner, [this](const QByteArray& data) {
       emit owner.primaryInstanceMessageReceived(data);
     });
     QObject::connect(
-      &endpoint, &LocalEndpoint::clientMessageReceived, &owner, [this](const unsigned int id, const QByteArray& data) {
+      &endpoint, &LocalEndpoint::clientMessageReceived, &owner, [this](const quint64 id, const QByteArray& data) {
         emit owner.secondaryInstanceMessageReceived(id, data);
       });
+    QObject::connect(
+      &endpoint, &LocalEndpoint::serverStreamChunkReceived, &owner, [this](const QByteArray& chunk, bool last) {
+        emit owner.primaryInstanceStreamChunkReceived(chunk, last);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::clientStreamChunkReceived, &owner,
+      [this](const quint64 id, const QByteArray& chunk, bool last) {
+        emit owner.secondaryInstanceStreamChunkReceived(id, chunk, last);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::serverTypedMessageReceived, &owner,
+      [this](const quint32 tag, const QByteArray& data) {
+        dispatchMessage(0u, tag, data);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::clientTypedMessageReceived, &owner,
+      [this](const quint64 id, const quint32 tag, const QByteArray& data) {
+        dispatchMessage(id, tag, data);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::topicMessageReceived, &owner,
+      [this](const QByteArray& topic, const quint64 publisherId, const QByteArray& data) {
+        emit owner.topicMessageReceived(QString::fromUtf8(topic), publisherId, data);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::serverRequestReceived, &owner,
+      [this](const unsigned int requestId, const QByteArray& data) {
+        emit owner.primaryInstanceRequestReceived(requestId, data);
+      });
+    QObject::connect(&endpoint, &LocalEndpoint::clientRequestReceived, &owner,
+      [this](const quint64 id, const unsigned int requestId, const QByteArray& data) {
+        emit owner.secondaryInstanceRequestReceived(id, requestId, data);
+      });
     QObject::connect(&endpoint, &LocalEndpoint::roleChanged, &owner, [this]() {
       emit owner.instanceRoleChanged();
       quitIfRequired();
     });
   }
 
+  ~Impl() {
+    // The endpoint must be destroyed in its own thread.
+    setIoThreadEnabled(false);
+    drainOutgoingMessages();
+  }
+
+  // Calls the function in the manager's thread: right away if called from it, otherwise queued.
+  template<typename Function>
+  void postToOwner(Function&& function) {
+    if (owner.thread() == QThread::currentThread()) {
+      function();
+    } else {
+      QMetaObject::invokeMethod(&owner, std::forward<Function>(function), Qt::QueuedConnection);
+    }
+  }
+
+  void setIoThreadEnabled(bool enabled) {
+    // Only the endpoint's current thread can move it: changes are made in the manager's thread, one at a time.
+    if (owner.thread() != QThread::currentThread()) {
+      QMetaObject::invokeMethod(
+        &owner,
+        [this, enabled]() {
+          setIoThreadEnabled(enabled);
+        },
+        Qt::BlockingQueuedConnection);
+      return;
+    }
+    if (enabled == ioThread.isRunning()) {
+      return;
+    }
+
+    if (enabled) {
+      ioThread.start();
+      endpoint.moveToThread(&ioThread);
+    } else {
+      // Only the endpoint's thread can move it.
+      invoke([this, thread = owner.thread()]() {
+        endpoint.moveToThread(thread);
+      });
+      ioThread.quit();
+      ioThread.wait();
+    }
+  }
+
+  // Calls the function in the endpoint's thread, and waits for its result.
+  // Messages queued before by the calling thread are sent first.
+  template<typename Function>
+  auto invoke(Function&& function) {
+    using Result = std::invoke_result_t<Function>;
+    auto task = [this, &function]() -> Result {
+      drainOutgoingMessages();
+      return function();
+    };
+    if (endpoint.thread() == QThread::currentThread()) {
+      return task();
+    }
+    if constexpr (std::is_void_v<Result>) {
+      QMetaObject::invokeMethod(&endpoint, task, Qt::BlockingQueuedConnection);
+    } else {
+      Result result{};
+      QMetaObject::invokeMethod(&endpoint, task, Qt::BlockingQueuedConnection, &result);
+      return result;
+    }
+  }
+
+  // Calls the function in the endpoint's thread, without waiting. Calls made from the same thread keep their order,
+  // including with the messages sent meanwhile.
+  template<typename Function>
+  void post(Function&& function) {
+    OutgoingMessage message;
+    message.call = std::forward<Function>(function);
+    sendMessage(std::move(message));
+  }
+
+  // Sends the message right away in the endpoint's thread. Other threads queue it without locking nor allocating,
+  // and the endpoint's thread sends all the queued messages at once.
+  void sendMessage(OutgoingMessage&& message) {
+    if (endpoint.thread() == QThread::currentThread()) {
+      drainOutgoingMessages();
+      sendMessageNow(message);
+      return;
+    }
+
+    for (auto retries = 0; !outgoingMessages.tryPush(std::move(message)); ++retries) {
+      if (retries == FullQueueRetries) {
+        // Still full, e.g. the endpoint's thread is busy: wait for it to send the queued messages, then this one.
+        QMetaObject::invokeMethod(
+          &endpoint,
+          [this, &message]() {
+            drainOutgoingMessages();
+            sendMessageNow(message);
+          },
+          Qt::BlockingQueuedConnection);
+        return;
+      }
+      // Full: let the endpoint's thread make room.
+      scheduleDrain();
+      QThread::yieldCurrentThread();
+    }
+    scheduleDrain();
+  }
+
+  void scheduleDrain() {
+    if (!drainScheduled.exchange(true, std::memory_order_acq_rel)) {
+      QMetaObject::invokeMethod(
+        &endpoint,
+        [this]() {
+          drainOutgoingMessages();
+        },
+        Qt::QueuedConnection);
+    }
+  }
+
+  // Only called in the endpoint's thread.
+  void drainOutgoingMessages() {
+    // Producers that push after this point schedule another drain.
+    drainScheduled.store(false, std::memory_order_release);
+    OutgoingMessage message;
+    while (outgoingMessages.tryPop(message)) {
+      sendMessageNow(message);
+    }
+  }
+
+  void dispatchMessage(const quint64 senderId, const quint32 tag, const QByteArray& data) {
+    const auto it = messageHandlers.find(tag);
+    if (it != messageHandlers.end()) {
+      const auto handler = it->second;
+      (*handler)(senderId, data);
+    }
+  }
+
+  void sendMessageNow(const OutgoingMessage& message) {
+    if (message.call) {
+      message.call();
+      return;
+    }
+    if (message.tag) {
+      sendTypedMessageNow(message);
+      return;
+    }
+    switch (message.target) {
+      case OutgoingMessage::Target::Primary:
+        endpoint.sendToServer(message.data);
+        break;
+      case OutgoingMessage::Target::Secondary:
+        endpoint.sendToClient(message.id, message.data);
+        break;
+      case OutgoingMessage::Target::AllSecondaries:
+        endpoint.sendToAllClients(message.data, message.exceptIds);
+        break;
+      case OutgoingMessage::Target::Subscribers:
+        endpoint.publish(message.topic, message.data);
+        break;
+    }
+  }
+
+  void sendTypedMessageNow(const OutgoingMessage& message) {
+    switch (message.target) {
+      case OutgoingMessage::Target::Primary:
+        endpoint.sendTypedToServer(*message.tag, message.data);
+        break;
+      case OutgoingMessage::Target::Secondary:
+        endpoint.sendTypedToClient(message.id, *message.tag, message.data);
+        break;
+      case OutgoingMessage::Target::AllSecondaries:
+        endpoint.sendTypedToAllClients(*message.tag, message.data, message.exceptIds);
+        break;
+      case OutgoingMessage::Target::Subscribers:
+        // Typed messages aren't published.
+        break;
+    }
+  }
+
+  // Streamed devices are read in the endpoint's thread. Devices that can't be moved there are ignored by the endpoint.
+  void moveToEndpointThread(QIODevice* const device) const {
+    const auto endpointThread = endpoint.thread();
+    if (device && device->thread() != endpointThread && device->thread() == QThread::currentThread()
+        && !device->parent()) {
+      device->moveToThread(endpointThread);
+    }
+  }
+
+  // Only called in the manager's thread.
   void quitIfRequired() {
     // Force quit when only a single instance is allowed.
-    if (mode == Mode::SingleInstance && endpoint.role() == LocalEndpoint::Role::Client) {
+    if (mode == Mode::SingleInstance && role == LocalEndpoint::Role::Client && !forwarding) {
+      forwarding = true;
       // Send last message before quitting.
       auto args = QCoreApplication::arguments();
       args.removeFirst();
       const auto data = args.join(' ').toUtf8();
-      endpoint.sendToServer(data);
-
-      // Quit.
-      emit owner.appExitRequested();
       if (appExitMode == AppExitMode::Auto) {
+        // The process exits right after: wait for the acknowledgment, without the event loop.
+        const auto timeout = forwardTimeout.load();
+        const auto result = invoke([this, &data, timeout]() {
+          return endpoint.forwardToServer(data, timeout);
+        });
+        emit owner.argumentsForwarded(toForwardResult(result));
+
+        // Quit.
+        emit owner.appExitRequested();
         QCoreApplication::quit();
         std::exit(EXIT_SUCCESS);
+      } else {
+        // The application decides when to quit: wait for the acknowledgment in the event loop.
+        QElapsedTimer timer;
+        timer.start();
+        const auto timeout = forwardTimeout.load();
+        invoke([this, &data, timeout]() {
+          auto future = endpoint.sendAcknowledgedToServer(data, timeout);
+          endpoint.flush();
+          return future;
+        })
+          .then(&owner,
+            [this]() {
+              onArgumentsForwarded(ForwardResult::Delivered);
+            })
+          .onCanceled(&owner, [this, timer, timeout]() {
+            onArgumentsForwarded(timer.hasExpired(timeout) ? ForwardResult::TimedOut : ForwardResult::Failed);
+          });
       }
     }
   }
+
+  void onArgumentsForwarded(ForwardResult result) {
+    emit owner.argumentsForwarded(result);
+    emit owner.appExitRequested();
+  }
+
+  static ForwardResult toForwardResult(LocalEndpoint::ForwardResult result) {
+    switch (result) {
+      case LocalEndpoint::ForwardResult::Delivered:
+        return ForwardResult::Delivered;
+      case LocalEndpoint::ForwardResult::TimedOut:
+        return ForwardResult::TimedOut;
+      case LocalEndpoint::ForwardResult::Failed:
+        break;
+    }
+    return ForwardResult::Failed;
+  }
 };
 
 QtAppInstanceManager::QtAppInstanceManager(QObject* parent)
@@ -53,11 +367,24 @@ QtAppInstanceManager::QtAppInstanceManager(Mode mode, QObject* parent)
   : QtAppInstanceManager(mode, AppExitMode::Auto, parent) {}
 
 QtAppInstanceManager::QtAppInstanceManager(Mode mode, AppExitMode appExitMode, QObject* parent)
+  : QtAppInstanceManager(mode, appExitMode, StartupSettings{}, parent) {}
+
+QtAppInstanceManager::QtAppInstanceManager(
+  Mode mode, AppExitMode appExitMode, const StartupSettings& settings, QObject* parent)
   : QObject(parent)
-  , _impl(new Impl(*this)) {
+  , _impl(new Impl(*this, settings)) {
   _impl->mode = mode;
   _impl->appExitMode = appExitMode;
+  // Deferred, so that the caller can connect to the signals first.
   QTimer::singleShot(0, this, [this]() {
+    if (_impl->mode == Mode::SingleInstance && _impl->appExitMode == AppExitMode::Auto) {
+      // Fast path: a secondary instance forwards its arguments and exits in the first event loop iteration,
+      // without waiting for the restart timer nor for socket events.
+      const auto timeout = _impl->forwardTimeout.load();
+      _impl->invoke([this, timeout]() {
+        return _impl->endpoint.waitForRole(timeout);
+      });
+    }
     _impl->quitIfRequired();
   });
 }
@@ -65,39 +392,285 @@ QtAppInstanceManager::QtAppInstanceManager(Mode mode, AppExitMode appExitMode, Q
 QtAppInstanceManager::~QtAppInstanceManager() = default;
 
 bool QtAppInstanceManager::isPrimaryInstance() const {
-  return _impl->endpoint.role() == LocalEndpoint::Role::Server;
+  return _impl->role == LocalEndpoint::Role::Server;
 }
 
 bool QtAppInstanceManager::isSecondaryInstance() const {
-  return _impl->endpoint.role() == LocalEndpoint::Role::Client;
+  return _impl->role == LocalEndpoint::Role::Client;
+}
+
+quint64 QtAppInstanceManager::instanceId() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.id();
+  });
 }
 
 int QtAppInstanceManager::secondaryInstanceCount() const {
-  return _impl->endpoint.secondaryInstanceCount();
+  return _impl->invoke([this]() {
+    return _impl->endpoint.secondaryInstanceCount();
+  });
+}
+
+int QtAppInstanceManager::shardCount() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.shardCount();
+  });
+}
+
+void QtAppInstanceManager::setShardCount(int count) {
+  _impl->post([this, count]() {
+    _impl->endpoint.setShardCount(count);
+  });
+}
+
+int QtAppInstanceManager::shardIndex() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.shard();
+  });
+}
+
+int QtAppInstanceManager::secondaryInstanceCount(int shard) const {
+  const auto counts = _impl->invoke([this]() {
+    return _impl->endpoint.shardClientCounts();
+  });
+  return std::max(0, counts.value(shard, 0));
+}
+
+int QtAppInstanceManager::totalSecondaryInstanceCount() const {
+  const auto counts = _impl->invoke([this]() {
+    return _impl->endpoint.shardClientCounts();
+  });
+  auto total = 0;
+  for (const auto count : counts) {
+    total += std::max(0, count);
+  }
+  return total;
+}
+
+bool QtAppInstanceManager::ioThreadEnabled() const {
+  return _impl->ioThread.isRunning();
+}
+
+void QtAppInstanceManager::setIoThreadEnabled(bool enabled) {
+  _impl->setIoThreadEnabled(enabled);
+}
+
+QtAppInstanceManager::ForwardResult QtAppInstanceManager::forwardToPrimary(const QByteArray& data, int timeout) {
+  return Impl::toForwardResult(_impl->invoke([this, &data, timeout]() {
+    return _impl->endpoint.forwardToServer(data, timeout);
+  }));
+}
+
+int QtAppInstanceManager::forwardTimeout() const {
+  return _impl->forwardTimeout;
+}
+
+void QtAppInstanceManager::setForwardTimeout(int timeout) {
+  _impl->forwardTimeout = timeout;
+}
+
+bool QtAppInstanceManager::waitForMessagesWritten(int timeout) {
+  return _impl->invoke([this, timeout]() {
+    return _impl->endpoint.waitForBytesWritten(timeout);
+  });
+}
+
+QtAppInstanceManager::StartupTimings QtAppInstanceManager::startupTimings() const {
+  const auto timings = _impl->invoke([this]() {
+    return _impl->endpoint.startupTimings();
+  });
+  return { timings.roleResolved, timings.handshakeDone, timings.forwarded };
+}
+
+QtAppInstanceManager::BufferStatistics QtAppInstanceManager::bufferStatistics() const {
+  const auto statistics = _impl->invoke([this]() {
+    return _impl->endpoint.bufferStatistics();
+  });
+  return { statistics.allocations, statistics.reuses };
+}
+
+void QtAppInstanceManager::setTraceSink(std::shared_ptr<tracing::Sink> sink) {
+  _impl->post([this, sink = std::move(sink)]() mutable {
+    _impl->endpoint.setTraceSink(std::move(sink));
+  });
+}
+
+QtAppInstanceManager::Statistics QtAppInstanceManager::statistics() const {
+  static_assert(Statistics::LatencyBucketCount == LatencyHistogram::BucketCount);
+
+  // Thread-safe: no need to wait for the endpoint's thread.
+  const auto endpointStatistics = _impl->endpoint.statistics();
+  Statistics statistics;
+  statistics.messagesReceived = endpointStatistics.messagesReceived;
+  statistics.messagesSent = endpointStatistics.messagesSent;
+  statistics.controlFramesReceived = endpointStatistics.controlFramesReceived;
+  statistics.controlFramesSent = endpointStatistics.controlFramesSent;
+  statistics.bytesReceived = endpointStatistics.bytesReceived;
+  statistics.bytesSent = endpointStatistics.bytesSent;
+  statistics.reconnects = endpointStatistics.reconnects;
+  statistics.bulkTransfersSent = endpointStatistics.bulkTransfersSent;
+  statistics.bulkTransfersReceived = endpointStatistics.bulkTransfersReceived;
+  statistics.reelectionTime = endpointStatistics.reelectionTime;
+  statistics.handshakeDuration = endpointStatistics.handshakeDuration;
+  statistics.latencyHistogram = endpointStatistics.latencyHistogram;
+
+  // Blocks when called from another thread than the endpoint's one.
+  const auto connections = _impl->invoke([this]() {
+    return _impl->endpoint.connectionStatistics();
+  });
+  statistics.connections.reserve(connections.size());
+  for (const auto& connection : connections) {
+    statistics.connections.append(ConnectionStatistics{ connection.id, connection.messagesReceived,
+      connection.messagesSent, connection.controlFramesReceived, connection.controlFramesSent,
+      connection.bytesReceived, connection.bytesSent, connection.bytesToWrite });
+  }
+  return statistics;
 }
 
 void QtAppInstanceManager::sendMessageToPrimary(const QByteArray& data) {
   if (isSecondaryInstance()) {
-    _impl->endpoint.sendToServer(data);
+    _impl->sendMessage({ Impl::OutgoingMessage::Target::Primary, 0u, data, {} });
+  }
+}
+
+void QtAppInstanceManager::sendMessageToSecondary(const quint64 id, const QByteArray& data) {
+  if (isPrimaryInstance() || isSecondaryInstance()) {
+    _impl->sendMessage({ Impl::OutgoingMessage::Target::Secondary, id, data, {} });
+  }
+}
+
+void QtAppInstanceManager::sendMessageToAllSecondaries(const QByteArray& data, const QSet<quint64>& exceptIds) {
+  if (isPrimaryInstance()) {
+    _impl->sendMessage({ Impl::OutgoingMessage::Target::AllSecondaries, 0u, data, exceptIds });
+  }
+}
+
+void QtAppInstanceManager::publish(const QString& topic, const QByteArray& data) {
+  _impl->sendMessage({ Impl::OutgoingMessage::Target::Subscribers, 0u, data, {}, std::nullopt, topic.toUtf8() });
+}
+
+void QtAppInstanceManager::subscribe(const QString& topic) {
+  _impl->post([this, topic = topic.toUtf8()]() {
+    _impl->endpoint.subscribe(topic);
+  });
+}
+
+void QtAppInstanceManager::unsubscribe(const QString& topic) {
+  _impl->post([this, topic = topic.toUtf8()]() {
+    _impl->endpoint.unsubscribe(topic);
+  });
+}
+
+bool QtAppInstanceManager::isSubscribed(const QString& topic) const {
+  return _impl->invoke([this, topic = topic.toUtf8()]() {
+    return _impl->endpoint.isSubscribed(topic);
+  });
+}
+
+void QtAppInstanceManager::sendTypedMessageToPrimary(quint32 tag, const QByteArray& data) {
+  if (isSecondaryInstance()) {
+    _impl->sendMessage({ Impl::OutgoingMessage::Target::Primary, 0u, data, {}, tag });
+  }
+}
+
+void QtAppInstanceManager::sendTypedMessageToSecondary(const quint64 id, quint32 tag, const QByteArray& data) {
+  if (isPrimaryInstance()) {
+    _impl->sendMessage({ Impl::OutgoingMessage::Target::Secondary, id, data, {}, tag });
+  }
+}
+
+void QtAppInstanceManager::sendTypedMessageToAllSecondaries(
+  quint32 tag, const QByteArray& data, const QSet<quint64>& exceptIds) {
+  if (isPrimaryInstance()) {
+    _impl->sendMessage(
+      { Impl::OutgoingMessage::Target::AllSecondaries, 0u, data, exceptIds, tag });
+  }
+}
+
+void QtAppInstanceManager::setMessageHandler(quint32 tag, MessageHandler handler) {
+  // Callbacks are only used in the manager's thread.
+  if (QThread::currentThread() != thread()) {
+    QMetaObject::invokeMethod(
+      this,
+      [this, tag, handler = std::move(handler)]() mutable {
+        setMessageHandler(tag, std::move(handler));
+      },
+      Qt::QueuedConnection);
+    return;
+  }
+
+  if (handler) {
+    _impl->messageHandlers[tag] = std::make_shared<MessageHandler>(std::move(handler));
+  } else {
+    _impl->messageHandlers.erase(tag);
+  }
+}
+
+void QtAppInstanceManager::sendStreamToPrimary(QIODevice* device) {
+  if (isSecondaryInstance()) {
+    _impl->moveToEndpointThread(device);
+    _impl->post([this, device]() {
+      _impl->endpoint.sendStreamToServer(device);
+    });
+  }
+}
+
+void QtAppInstanceManager::sendStreamToSecondary(const quint64 id, QIODevice* device) {
+  if (isPrimaryInstance()) {
+    _impl->moveToEndpointThread(device);
+    _impl->post([this, id, device]() {
+      _impl->endpoint.sendStreamToClient(id, device);
+    });
+  }
+}
+
+QFuture<QByteArray> QtAppInstanceManager::sendRequestToPrimary(const QByteArray& data, int timeout) {
+  // The endpoint returns a canceled future if this is not a secondary instance.
+  return _impl->invoke([this, &data, timeout]() {
+    return _impl->endpoint.requestToServer(data, timeout);
+  });
+}
+
+QFuture<QByteArray> QtAppInstanceManager::sendRequestToSecondary(
+  const quint64 id, const QByteArray& data, int timeout) {
+  return _impl->invoke([this, id, &data, timeout]() {
+    return _impl->endpoint.requestToClient(id, data, timeout);
+  });
+}
+
+void QtAppInstanceManager::sendResponseToPrimary(const unsigned int requestId, const QByteArray& data) {
+  if (isSecondaryInstance()) {
+    _impl->post([this, requestId, data]() {
+      _impl->endpoint.replyToServer(requestId, data);
+    });
   }
 }
 
-void QtAppInstanceManager::sendMessageToSecondary(const unsigned int id, const QByteArray& data) {
+void QtAppInstanceManager::sendResponseToSecondary(
+  const quint64 id, const unsigned int requestId, const QByteArray& data) {
   if (isPrimaryInstance()) {
-    _impl->endpoint.sendToClient(id, data);
+    _impl->post([this, id, requestId, data]() {
+      _impl->endpoint.replyToClient(id, requestId, data);
+    });
   }
 }
 
+void QtAppInstanceManager::flush() {
+  _impl->post([this]() {
+    _impl->endpoint.flush();
+  });
+}
+
 QtAppInstanceManager::Mode QtAppInstanceManager::mode() const {
   return _impl->mode;
 }
 
 void QtAppInstanceManager::setMode(Mode mode) {
-  if (mode != _impl->mode) {
-    _impl->mode = mode;
-    emit modeChanged();
-
-    _impl->quitIfRequired();
+  if (_impl->mode.exchange(mode) != mode) {
+    _impl->postToOwner([this]() {
+      emit modeChanged();
+      _impl->quitIfRequired();
+    });
   }
 }
 
@@ -106,9 +679,117 @@ QtAppInstanceManager::AppExitMode QtAppInstanceManager::appExitMode() const {
 }
 
 void QtAppInstanceManager::setAppExitMode(AppExitMode appExitMode) {
-  if (appExitMode != _impl->appExitMode) {
-    _impl->appExitMode = appExitMode;
-    emit appExitModeChanged();
+  if (_impl->appExitMode.exchange(appExitMode) != appExitMode) {
+    _impl->postToOwner([this]() {
+      emit appExitModeChanged();
+    });
   }
 }
+
+QtAppInstanceManager::ReelectionPolicy QtAppInstanceManager::reelectionPolicy() const {
+  const auto policy = _impl->invoke([this]() {
+    return _impl->endpoint.reelectionPolicy();
+  });
+  return { policy.initialDelay, policy.maxDelay, policy.jitter, policy.rankDelay };
+}
+
+void QtAppInstanceManager::setReelectionPolicy(const ReelectionPolicy& policy) {
+  const auto endpointPolicy =
+    LocalEndpoint::ReelectionPolicy{ policy.initialDelay, policy.maxDelay, policy.jitter, policy.rankDelay };
+  _impl->post([this, endpointPolicy]() {
+    _impl->endpoint.setReelectionPolicy(endpointPolicy);
+  });
+}
+
+QtAppInstanceManager::HeartbeatPolicy QtAppInstanceManager::heartbeatPolicy() const {
+  const auto policy = _impl->invoke([this]() {
+    return _impl->endpoint.heartbeatPolicy();
+  });
+  return { policy.interval, policy.missedThreshold };
+}
+
+void QtAppInstanceManager::setHeartbeatPolicy(const HeartbeatPolicy& policy) {
+  const auto endpointPolicy = LocalEndpoint::HeartbeatPolicy{ policy.interval, policy.missedThreshold };
+  _impl->post([this, endpointPolicy]() {
+    _impl->endpoint.setHeartbeatPolicy(endpointPolicy);
+  });
+}
+
+QtAppInstanceManager::FlushPolicy QtAppInstanceManager::flushPolicy() const {
+  return static_cast<FlushPolicy>(_impl->invoke([this]() {
+    return _impl->endpoint.flushPolicy();
+  }));
+}
+
+void QtAppInstanceManager::setFlushPolicy(FlushPolicy flushPolicy) {
+  _impl->post([this, flushPolicy]() {
+    _impl->endpoint.setFlushPolicy(static_cast<LocalEndpoint::FlushPolicy>(flushPolicy));
+  });
+}
+
+void QtAppInstanceManager::setFlushThreshold(qint64 size, int delay) {
+  _impl->post([this, size, delay]() {
+    _impl->endpoint.setFlushThreshold(size, delay);
+  });
+}
+
+qint64 QtAppInstanceManager::bulkTransferThreshold() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.bulkTransferThreshold();
+  });
+}
+
+void QtAppInstanceManager::setBulkTransferThreshold(qint64 size) {
+  _impl->post([this, size]() {
+    _impl->endpoint.setBulkTransferThreshold(size);
+  });
+}
+
+QtAppInstanceManager::Compression QtAppInstanceManager::compression() const {
+  return static_cast<Compression>(_impl->invoke([this]() {
+    return _impl->endpoint.compression();
+  }));
+}
+
+void QtAppInstanceManager::setCompression(Compression compression) {
+  _impl->post([this, compression]() {
+    _impl->endpoint.setCompression(static_cast<LocalEndpoint::Compression>(compression));
+  });
+}
+
+qint64 QtAppInstanceManager::compressionThreshold() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.compressionThreshold();
+  });
+}
+
+void QtAppInstanceManager::setCompressionThreshold(qint64 size) {
+  _impl->post([this, size]() {
+    _impl->endpoint.setCompressionThreshold(size);
+  });
+}
+
+qint64 QtAppInstanceManager::streamChunkSize() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.streamChunkSize();
+  });
+}
+
+void QtAppInstanceManager::setStreamChunkSize(qint64 size) {
+  _impl->post([this, size]() {
+    _impl->endpoint.setStreamChunkSize(size);
+  });
+}
+
+int QtAppInstanceManager::maxMessagesPerRead() const {
+  return _impl->invoke([this]() {
+    return _impl->endpoint.maxFramesPerRead();
+  });
+}
+
+void QtAppInstanceManager::setMaxMessagesPerRead(int count) {
+  _impl->post([this, count]() {
+    _impl->endpoint.setMaxFramesPerRead(count);
+  });
+}
 } // namespace oclero
@@ -0,0 +1,147 @@
+#include <oclero/QtAppInstanceTrace.hpp>
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <chrono>
+
+namespace oclero::tracing {
+namespace {
+QString getEventName(Event event) {
+  switch (event) {
+    case Event::Enqueue:
+      return QStringLiteral("enqueue");
+    case Event::Write:
+      return QStringLiteral("write");
+    case Event::Read:
+      return QStringLiteral("read");
+    case Event::Dispatch:
+      return QStringLiteral("dispatch");
+    default:
+      return {};
+  }
+}
+
+// The format's timestamps are in microseconds.
+double toMicroseconds(qint64 nanoseconds) {
+  return static_cast<double>(nanoseconds) / 1000.0;
+}
+} // namespace
+
+qint64 now() {
+  // Monotonic and system-wide, so that the records of several processes can be compared.
+  const auto time = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+}
+
+ChromeTraceSink::ChromeTraceSink(qsizetype maxRecordCount)
+  : _maxRecordCount(maxRecordCount) {}
+
+void ChromeTraceSink::record(const Record& item) {
+  const auto threadId = static_cast<quint64>(reinterpret_cast<quintptr>(QThread::currentThreadId()));
+  const QMutexLocker locker(&_mutex);
+  if (_records.size() >= _maxRecordCount) {
+    ++_droppedRecordCount;
+    return;
+  }
+  _records.append({ item, threadId });
+}
+
+QList<Record> ChromeTraceSink::records() const {
+  const QMutexLocker locker(&_mutex);
+  QList<Record> result;
+  result.reserve(_records.size());
+  for (const auto& threadRecord : _records) {
+    result.append(threadRecord.record);
+  }
+  return result;
+}
+
+quint64 ChromeTraceSink::droppedRecordCount() const {
+  const QMutexLocker locker(&_mutex);
+  return _droppedRecordCount;
+}
+
+void ChromeTraceSink::clear() {
+  const QMutexLocker locker(&_mutex);
+  _records.clear();
+  _droppedRecordCount = 0u;
+}
+
+QByteArray ChromeTraceSink::toJson() const {
+  const auto pid = QCoreApplication::applicationPid();
+  const auto category = QStringLiteral("ipc");
+
+  QJsonArray events;
+  // Names the process, to tell primary and secondary instances apart when several files are opened together.
+  events.append(QJsonObject{
+    { QStringLiteral("name"), QStringLiteral("process_name") },
+    { QStringLiteral("ph"), QStringLiteral("M") },
+    { QStringLiteral("pid"), pid },
+    { QStringLiteral("args"),
+      QJsonObject{ { QStringLiteral("name"),
+        QStringLiteral("%1 (%2)").arg(QCoreApplication::applicationName()).arg(pid) } } },
+  });
+
+  const QMutexLocker locker(&_mutex);
+  for (const auto& [item, threadId] : _records) {
+    const auto timestamp = toMicroseconds(item.timestamp);
+    const auto tid = static_cast<qint64>(threadId);
+    events.append(QJsonObject{
+      { QStringLiteral("name"), getEventName(item.event) },
+      { QStringLiteral("cat"), category },
+      { QStringLiteral("ph"), QStringLiteral("X") },
+      { QStringLiteral("ts"), timestamp },
+      { QStringLiteral("dur"), toMicroseconds(item.duration) },
+      { QStringLiteral("pid"), pid },
+      { QStringLiteral("tid"), tid },
+      { QStringLiteral("args"),
+        QJsonObject{
+          { QStringLiteral("sequence"), static_cast<qint64>(item.sequence) },
+          { QStringLiteral("connection"), static_cast<qint64>(item.connectionId) },
+          { QStringLiteral("size"), item.size },
+          { QStringLiteral("type"), item.frameType },
+        } },
+    });
+
+    // Links the frame's sending and receiving. Ids are strings, as JSON numbers can't hold 64 bits.
+    const auto isFlowStart = item.event == Event::Enqueue;
+    if (item.flowId != 0u && (isFlowStart || item.event == Event::Read)) {
+      QJsonObject flow{
+        { QStringLiteral("name"), QStringLiteral("frame") },
+        { QStringLiteral("cat"), category },
+        { QStringLiteral("ph"), isFlowStart ? QStringLiteral("s") : QStringLiteral("f") },
+        { QStringLiteral("id"), QString::number(item.flowId, 16) },
+        { QStringLiteral("ts"), timestamp },
+        { QStringLiteral("pid"), pid },
+        { QStringLiteral("tid"), tid },
+      };
+      if (!isFlowStart) {
+        // Binds the end to the enclosing read event.
+        flow.insert(QStringLiteral("bp"), QStringLiteral("e"));
+      }
+      events.append(flow);
+    }
+  }
+
+  return QJsonDocument(QJsonObject{
+                         { QStringLiteral("traceEvents"), events },
+                         { QStringLiteral("displayTimeUnit"), QStringLiteral("ns") },
+                       })
+    .toJson(QJsonDocument::Compact);
+}
+
+bool ChromeTraceSink::writeToFile(const QString& filePath) const {
+  QFile file(filePath);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    return false;
+  }
+  const auto json = toJson();
+  return file.write(json) == json.size();
+}
+} // namespace oclero::tracing
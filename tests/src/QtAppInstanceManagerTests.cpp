@@ -1,14 +1,192 @@
 #include "QtAppInstanceManagerTests.hpp"
 
 #include <oclero/QtAppInstanceManager.hpp>
+#include <oclero/BufferPool.hpp>
+#include <oclero/Compression.hpp>
+#include <oclero/FrameDecoder.hpp>
+#include <oclero/LocalEndpointProtocol.hpp>
+#include <oclero/Metrics.hpp>
+#include <oclero/MpscRing.hpp>
+#include <QBuffer>
 #include <QCoreApplication>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPoint>
+#include <QProcess>
 #include <QTest>
+#include <QThread>
 #include <QTimer>
+#include <QVariant>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+
+#if defined(Q_OS_UNIX)
+#  include <signal.h>
+#endif
+
+// Counts the heap allocations of the test binary, for test_steadyStateAllocations(). Qt's containers allocate with
+// malloc(), which glibc lets the executable replace: elsewhere, only operator new is counted.
+namespace {
+std::atomic<quint64> heapAllocations{ 0u };
+} // namespace
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+
+void* malloc(size_t size) noexcept {
+  heapAllocations.fetch_add(1u, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept {
+  heapAllocations.fetch_add(1u, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) noexcept {
+  heapAllocations.fetch_add(1u, std::memory_order_relaxed);
+  return __libc_realloc(pointer, size);
+}
+}
+#else
+void* operator new(std::size_t size) {
+  heapAllocations.fetch_add(1u, std::memory_order_relaxed);
+  if (auto* const pointer = std::malloc(size == 0u ? 1u : size)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+  std::free(pointer);
+}
+#endif
 
 using namespace oclero;
 
+namespace {
+struct OpenFiles {
+  QList<QString> paths;
+  int line{ 0 };
+  QByteArray extra;
+
+  static constexpr quint32 messageTag = 1;
+  static constexpr auto fields = std::make_tuple(&OpenFiles::paths, &OpenFiles::line, &OpenFiles::extra);
+};
+
+enum class Selection : quint8 {
+  None,
+  Word,
+  Line,
+};
+
+struct CursorPosition {
+  int x{ 0 };
+  int y{ 0 };
+  Selection selection{ Selection::None };
+  bool visible{ true };
+
+  static constexpr quint32 messageTag = 2;
+  static constexpr auto fields = std::make_tuple(
+    &CursorPosition::x, &CursorPosition::y, &CursorPosition::selection, &CursorPosition::visible);
+};
+
+// Trivially copyable, but without fields: its padding and invariants are unknown.
+struct Unlisted {
+  int x{ 0 };
+  char c{ 0 };
+};
+
+enum class Unvalidated {
+  Value,
+};
+} // namespace
+
+namespace oclero::messages {
+template<>
+struct EnumValidator<Selection> {
+  static constexpr bool isValid(Selection selection) {
+    return selection <= Selection::Line;
+  }
+};
+} // namespace oclero::messages
+
+namespace {
+// Short, so that failures are detected quickly.
+constexpr auto HeartbeatInterval = 50;
+constexpr auto MissedHeartbeats = 3;
+
+// Heartbeats are enabled before the role is decided, so that a primary instance's lease expires with them.
+QtAppInstanceManager::StartupSettings getHeartbeatSettings() {
+  auto settings = QtAppInstanceManager::StartupSettings{};
+  settings.heartbeatPolicy = { HeartbeatInterval, MissedHeartbeats };
+  return settings;
+}
+
+#if defined(Q_OS_UNIX)
+// Runs an instance with heartbeats in a child process, and waits until it has the expected role.
+bool startChildInstance(QProcess& process, const QByteArray& role) {
+  process.start(QCoreApplication::applicationFilePath(), { QLatin1String(Tests::ChildInstanceArgument) });
+  QByteArray output;
+  while (!output.contains('\n') && process.waitForReadyRead(5000)) {
+    output += process.readAllStandardOutput();
+  }
+  return output.trimmed() == role;
+}
+#endif
+} // namespace
+
+int Tests::runChildInstance() {
+  QtAppInstanceManager instance(
+    QtAppInstanceManager::Mode::MultipleInstances, QtAppInstanceManager::AppExitMode::Auto, getHeartbeatSettings());
+  const auto hasRole = QTest::qWaitFor(
+    [&instance]() {
+      return instance.isPrimaryInstance() || instance.instanceId() != 0u;
+    },
+    5000);
+  if (!hasRole) {
+    return EXIT_FAILURE;
+  }
+  std::printf("%s\n", instance.isPrimaryInstance() ? "primary" : "secondary");
+  std::fflush(stdout);
+  return QCoreApplication::exec();
+}
+
+int Tests::runSingleInstance() {
+  QtAppInstanceManager instance(QtAppInstanceManager::Mode::SingleInstance);
+  // Connected after construction: a secondary instance must not have forwarded its arguments yet.
+  QObject::connect(&instance, &QtAppInstanceManager::argumentsForwarded, &instance,
+    [](QtAppInstanceManager::ForwardResult result) {
+      std::printf("%s\n", result == QtAppInstanceManager::ForwardResult::Delivered ? "delivered" : "failed");
+      std::fflush(stdout);
+    });
+  // A secondary instance exits in the first event loop iteration.
+  QTimer::singleShot(5000, &instance, []() {
+    QCoreApplication::exit(EXIT_FAILURE);
+  });
+  return QCoreApplication::exec();
+}
+
 void Tests::test_roles() {
   // Primary instance..
   QtAppInstanceManager primaryInstance;
@@ -51,7 +229,7 @@ void Tests::test_messages() {
 
   QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
     [&primaryInstance, &actualRequestData, &expectedRequest, &fail, &expectedResponse](
-      const unsigned int id, QByteArray const& data) {
+      const quint64 id, QByteArray const& data) {
       actualRequestData = data;
 
       // Answer to secondaryInstance.
@@ -180,3 +358,1436 @@ void Tests::test_forceSingleInstance() {
 
   QCOMPARE(livingSecondaryInstances, 0);
 }
+
+void Tests::test_flushPolicy() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  auto actualData = QByteArray{};
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&actualData](const quint64, QByteArray const& data) {
+      actualData = data;
+    });
+
+  // Secondary instance, that only writes messages when asked to.
+  QtAppInstanceManager secondaryInstance;
+  QTest::qWait(100);
+  constexpr auto largeSize = 1024 * 1024;
+  constexpr auto longDelay = 60 * 1000;
+  secondaryInstance.setFlushPolicy(QtAppInstanceManager::FlushPolicy::Threshold);
+  secondaryInstance.setFlushThreshold(largeSize, longDelay);
+  QCOMPARE(secondaryInstance.flushPolicy(), QtAppInstanceManager::FlushPolicy::Threshold);
+
+  // The message stays in the queue.
+  constexpr auto expectedData = "message";
+  secondaryInstance.sendMessageToPrimary(expectedData);
+  QTest::qWait(100);
+  QVERIFY(actualData.isEmpty());
+
+  // Flushing acts as a barrier.
+  secondaryInstance.flush();
+  if (!QTest::qWaitFor(
+        [&actualData]() {
+          return !actualData.isEmpty();
+        },
+        1000)) {
+    QFAIL("Message was not received by primary instance after flush.");
+  }
+  QCOMPARE(actualData, expectedData);
+}
+
+void Tests::test_teardownWithUnsentData() {
+  // Primary instance, that doesn't read while the secondary instance is destroyed.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  auto secondaryInstance = std::make_unique<QtAppInstanceManager>();
+  if (!QTest::qWaitFor(
+        [&primaryInstance]() {
+          return primaryInstance.secondaryInstanceCount() == 1;
+        },
+        1000)) {
+    QFAIL("Secondary instance did not connect to primary instance.");
+  }
+
+  // Far more than the socket can hold: most of it is still unsent when the secondary instance is destroyed.
+  secondaryInstance->sendMessageToPrimary(QByteArray(64 * 1024 * 1024, 'x'));
+  secondaryInstance->flush();
+
+  QElapsedTimer timer;
+  timer.start();
+  secondaryInstance.reset();
+  QVERIFY(timer.elapsed() < 500);
+
+  // The socket was aborted, not left behind waiting for the event loop.
+  if (!QTest::qWaitFor(
+        [&primaryInstance]() {
+          return primaryInstance.secondaryInstanceCount() == 0;
+        },
+        500)) {
+    QFAIL("Secondary instance's socket was not closed.");
+  }
+}
+
+void Tests::test_secondaryInstanceIdsNotReused() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  auto receivedIds = QList<quint64>{};
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&receivedIds](const quint64 id, QByteArray const&) {
+      receivedIds.append(id);
+    });
+
+  // Secondary instances are started one after the other, so the OS may reuse the same socket descriptor.
+  constexpr auto secondaryInstanceCount = 3;
+  for (auto i = 0; i < secondaryInstanceCount; ++i) {
+    QtAppInstanceManager secondaryInstance;
+    secondaryInstance.sendMessageToPrimary("message");
+    if (!QTest::qWaitFor(
+          [&receivedIds, i]() {
+            return receivedIds.size() == i + 1;
+          },
+          1000)) {
+      QFAIL("Message was not received by primary instance.");
+    }
+  }
+
+  // Each secondary instance must have had a different id.
+  for (auto i = 0; i < secondaryInstanceCount; ++i) {
+    QVERIFY(receivedIds.count(receivedIds.at(i)) == 1);
+  }
+}
+
+void Tests::test_broadcast() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  // Secondary instances send their index so the primary one knows their ids.
+  constexpr auto secondaryInstanceCount = 3;
+  std::array<quint64, secondaryInstanceCount> secondaryInstanceIds{};
+  auto registeredCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&secondaryInstanceIds, &registeredCount](const quint64 id, QByteArray const& data) {
+      secondaryInstanceIds[data.toInt()] = id;
+      registeredCount++;
+    });
+
+  std::array<std::unique_ptr<QtAppInstanceManager>, secondaryInstanceCount> secondaryInstances;
+  std::array<QByteArray, secondaryInstanceCount> receivedData;
+  for (auto i = 0; i < secondaryInstanceCount; ++i) {
+    secondaryInstances[i] = std::make_unique<QtAppInstanceManager>();
+    QObject::connect(secondaryInstances[i].get(), &QtAppInstanceManager::primaryInstanceMessageReceived,
+      secondaryInstances[i].get(), [&receivedData, i](QByteArray const& data) {
+        receivedData[i] = data;
+      });
+    secondaryInstances[i]->sendMessageToPrimary(QByteArray::number(i));
+  }
+  if (!QTest::qWaitFor(
+        [&registeredCount]() {
+          return registeredCount == secondaryInstanceCount;
+        },
+        1000)) {
+    QFAIL("Secondary instances messages were not received by primary instance.");
+  }
+
+  // Broadcast to all secondary instances but the first one.
+  constexpr auto expectedData = "broadcast";
+  primaryInstance.sendMessageToAllSecondaries(expectedData, { secondaryInstanceIds[0] });
+  if (!QTest::qWaitFor(
+        [&receivedData]() {
+          return !receivedData[1].isEmpty() && !receivedData[2].isEmpty();
+        },
+        1000)) {
+    QFAIL("Broadcast message was not received by secondary instances.");
+  }
+  QCOMPARE(receivedData[1], expectedData);
+  QCOMPARE(receivedData[2], expectedData);
+  QTest::qWait(100);
+  QVERIFY(receivedData[0].isEmpty());
+}
+
+void Tests::test_bulkTransfer() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  auto actualData = QByteArray{};
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&actualData](const quint64, QByteArray const& data) {
+      actualData = data;
+    });
+
+  // Secondary instance, that sends large messages through shared memory.
+  QtAppInstanceManager secondaryInstance;
+  secondaryInstance.setBulkTransferThreshold(1024);
+  QCOMPARE(secondaryInstance.bulkTransferThreshold(), qint64{ 1024 });
+
+  constexpr auto largeSize = 1024 * 1024;
+  auto expectedData = QByteArray(largeSize, Qt::Uninitialized);
+  for (auto i = 0; i < largeSize; ++i) {
+    expectedData[i] = static_cast<char>(i % 251);
+  }
+  secondaryInstance.sendMessageToPrimary(expectedData);
+
+  if (!QTest::qWaitFor(
+        [&actualData]() {
+          return !actualData.isEmpty();
+        },
+        1000)) {
+    QFAIL("Large message was not received by primary instance.");
+  }
+  QCOMPARE(actualData.size(), expectedData.size());
+  QVERIFY(actualData == expectedData);
+
+  // The message went through shared memory, not through the socket.
+  QCOMPARE(secondaryInstance.statistics().bulkTransfersSent, quint64{ 1u });
+  QCOMPARE(primaryInstance.statistics().bulkTransfersReceived, quint64{ 1u });
+  QVERIFY(secondaryInstance.statistics().bytesSent < static_cast<quint64>(largeSize));
+
+  // Smaller messages still go through the socket.
+  actualData.clear();
+  secondaryInstance.sendMessageToPrimary(QByteArrayLiteral("small"));
+  if (!QTest::qWaitFor(
+        [&actualData]() {
+          return !actualData.isEmpty();
+        },
+        1000)) {
+    QFAIL("Small message was not received by primary instance.");
+  }
+  QCOMPARE(actualData, QByteArrayLiteral("small"));
+  QCOMPARE(primaryInstance.statistics().bulkTransfersReceived, quint64{ 1u });
+}
+
+void Tests::test_pipelinedMessages() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  QList<QByteArray> receivedMessages;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&receivedMessages](const quint64, QByteArray const& data) {
+      receivedMessages.append(data);
+    });
+
+  // Secondary instance, that writes all its messages at once.
+  QtAppInstanceManager secondaryInstance;
+  secondaryInstance.setFlushPolicy(QtAppInstanceManager::FlushPolicy::EndOfIteration);
+  QCoreApplication::processEvents();
+
+  constexpr auto messageCount = 10000;
+  const auto sendMessages = [&secondaryInstance]() {
+    for (auto i = 0; i < messageCount; ++i) {
+      secondaryInstance.sendMessageToPrimary(QByteArray::number(i));
+    }
+  };
+  const auto checkMessages = [&receivedMessages]() {
+    for (auto i = 0; i < messageCount; ++i) {
+      if (receivedMessages[i] != QByteArray::number(i)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // All frames must be read, even though they arrive in a few readyRead() emissions only.
+  sendMessages();
+  if (!QTest::qWaitFor(
+        [&receivedMessages]() {
+          return receivedMessages.size() == messageCount;
+        },
+        1000)) {
+    QFAIL("Pipelined messages were not all received by primary instance.");
+  }
+  QVERIFY(checkMessages());
+
+  // Same with a frame budget: remaining frames are read in the next event loop iterations.
+  receivedMessages.clear();
+  primaryInstance.setMaxMessagesPerRead(100);
+  QCOMPARE(primaryInstance.maxMessagesPerRead(), 100);
+  sendMessages();
+  if (!QTest::qWaitFor(
+        [&receivedMessages]() {
+          return receivedMessages.size() == messageCount;
+        },
+        1000)) {
+    QFAIL("Pipelined messages were not all received by primary instance with a frame budget.");
+  }
+  QVERIFY(checkMessages());
+}
+
+void Tests::test_streams() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  auto actualData = QByteArray{};
+  auto chunkCount = 0;
+  auto lastChunkReceived = false;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceStreamChunkReceived, &primaryInstance,
+    [&](const quint64, QByteArray const& chunk, bool last) {
+      actualData += chunk;
+      ++chunkCount;
+      lastChunkReceived = last;
+    });
+
+  // Secondary instance, that sends a device in small chunks.
+  QtAppInstanceManager secondaryInstance;
+  secondaryInstance.setStreamChunkSize(1024);
+  QCOMPARE(secondaryInstance.streamChunkSize(), qint64{ 1024 });
+
+  constexpr auto streamSize = 100 * 1024;
+  auto expectedData = QByteArray(streamSize, Qt::Uninitialized);
+  for (auto i = 0; i < streamSize; ++i) {
+    expectedData[i] = static_cast<char>(i % 251);
+  }
+  QBuffer device(&expectedData);
+  device.open(QIODevice::ReadOnly);
+  secondaryInstance.sendStreamToPrimary(&device);
+
+  if (!QTest::qWaitFor(
+        [&lastChunkReceived]() {
+          return lastChunkReceived;
+        },
+        1000)) {
+    QFAIL("Stream was not received by primary instance.");
+  }
+  QCOMPARE(chunkCount, streamSize / 1024);
+  QVERIFY(actualData == expectedData);
+
+  // Sequential device, written in two bursts: the stream must not end before its input does.
+  actualData.clear();
+  lastChunkReceived = false;
+  QLocalServer pipeServer;
+  QVERIFY(pipeServer.listen(QStringLiteral("QtAppInstanceManagerTests-%1").arg(QCoreApplication::applicationPid())));
+  QLocalSocket pipeWriter;
+  pipeWriter.connectToServer(pipeServer.serverName());
+  QVERIFY(pipeServer.waitForNewConnection(1000));
+  auto* const pipeReader = pipeServer.nextPendingConnection();
+  QVERIFY(pipeReader != nullptr);
+  secondaryInstance.sendStreamToPrimary(pipeReader);
+
+  pipeWriter.write("first");
+  pipeWriter.flush();
+  if (!QTest::qWaitFor(
+        [&actualData]() {
+          return actualData == "first";
+        },
+        1000)) {
+    QFAIL("First burst was not received by primary instance.");
+  }
+  QTest::qWait(50);
+  QVERIFY(!lastChunkReceived);
+
+  pipeWriter.write("second");
+  pipeWriter.flush();
+  pipeWriter.disconnectFromServer();
+  if (!QTest::qWaitFor(
+        [&lastChunkReceived]() {
+          return lastChunkReceived;
+        },
+        1000)) {
+    QFAIL("Sequential stream was not ended when its input finished.");
+  }
+  QCOMPARE(actualData, QByteArray("firstsecond"));
+}
+
+void Tests::test_requests() {
+  // Primary instance, that answers requests but the ones that ask to be ignored.
+  QtAppInstanceManager primaryInstance;
+  QCoreApplication::processEvents();
+
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceRequestReceived, &primaryInstance,
+    [&primaryInstance](const quint64 id, const unsigned int requestId, QByteArray const& data) {
+      if (data != "ignore") {
+        primaryInstance.sendResponseToSecondary(id, requestId, "response:" + data);
+      }
+    });
+
+  // Secondary instance, that pipelines its requests.
+  QtAppInstanceManager secondaryInstance;
+
+  constexpr auto requestCount = 100;
+  QList<QFuture<QByteArray>> futures;
+  for (auto i = 0; i < requestCount; ++i) {
+    futures.append(secondaryInstance.sendRequestToPrimary(QByteArray::number(i)));
+  }
+  auto ignoredFuture = secondaryInstance.sendRequestToPrimary("ignore", 100);
+
+  if (!QTest::qWaitFor(
+        [&futures]() {
+          return std::all_of(futures.cbegin(), futures.cend(), [](const QFuture<QByteArray>& future) {
+            return future.isFinished();
+          });
+        },
+        1000)) {
+    QFAIL("Responses were not all received by secondary instance.");
+  }
+  for (auto i = 0; i < requestCount; ++i) {
+    QVERIFY(!futures[i].isCanceled());
+    QCOMPARE(futures[i].result(), "response:" + QByteArray::number(i));
+  }
+
+  // A request without response is canceled after its timeout.
+  if (!QTest::qWaitFor(
+        [&ignoredFuture]() {
+          return ignoredFuture.isFinished();
+        },
+        1000)) {
+    QFAIL("Request without response was not canceled.");
+  }
+  QVERIFY(ignoredFuture.isCanceled());
+
+  // Only secondary instances may send requests to the primary instance.
+  QVERIFY(primaryInstance.sendRequestToPrimary("data").isCanceled());
+}
+
+void Tests::test_startupTimings() {
+  // Primary instance: the role is decided synchronously, in the constructor.
+  QtAppInstanceManager primaryInstance;
+  const auto primaryTimings = primaryInstance.startupTimings();
+  QVERIFY(primaryTimings.roleResolved >= 0);
+  QCOMPARE(primaryTimings.connectedToPrimary, qint64{ -1 });
+
+  // The fast path is only for secondary instances.
+  QCOMPARE(primaryInstance.forwardToPrimary("data", 10), QtAppInstanceManager::ForwardResult::Failed);
+  QCOMPARE(primaryInstance.startupTimings().forwardedToPrimary, qint64{ -1 });
+
+  // Secondary instance.
+  QtAppInstanceManager secondaryInstance;
+  QVERIFY(secondaryInstance.startupTimings().roleResolved >= 0);
+  if (!QTest::qWaitFor(
+        [&secondaryInstance]() {
+          return secondaryInstance.startupTimings().connectedToPrimary >= 0;
+        },
+        1000)) {
+    QFAIL("Secondary instance did not connect to primary instance.");
+  }
+  QVERIFY(secondaryInstance.startupTimings().connectedToPrimary >= secondaryInstance.startupTimings().roleResolved);
+}
+
+void Tests::test_singleInstanceForwarding() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance(QtAppInstanceManager::Mode::SingleInstance);
+  QCoreApplication::processEvents();
+  QVERIFY(primaryInstance.isPrimaryInstance());
+
+  auto forwardedArguments = QByteArray{};
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&forwardedArguments](const quint64, QByteArray const& data) {
+      forwardedArguments = data;
+    });
+
+  // Secondary instance, in another process: it forwards its arguments, then exits by itself.
+  QProcess process;
+  process.start(QCoreApplication::applicationFilePath(),
+    { QLatin1String(Tests::SingleInstanceArgument), QStringLiteral("file.txt") });
+  if (!QTest::qWaitFor(
+        [&process]() {
+          return process.state() == QProcess::NotRunning;
+        },
+        5000)) {
+    process.kill();
+    process.waitForFinished();
+    QFAIL("Secondary instance did not exit.");
+  }
+  QCOMPARE(process.exitStatus(), QProcess::NormalExit);
+  QCOMPARE(process.exitCode(), EXIT_SUCCESS);
+  QCOMPARE(process.readAllStandardOutput().trimmed(), QByteArray("delivered"));
+  QCOMPARE(forwardedArguments, QByteArray("--single-instance file.txt"));
+}
+
+void Tests::test_reelection() {
+  // Primary instance.
+  auto primaryInstance = std::make_unique<QtAppInstanceManager>();
+  QCoreApplication::processEvents();
+
+  // Secondary instances. They all have the same PID, so their rank is given by their connection order.
+  constexpr auto secondaryInstanceCount = 3;
+  std::array<std::unique_ptr<QtAppInstanceManager>, secondaryInstanceCount> secondaryInstances;
+  for (auto& secondaryInstance : secondaryInstances) {
+    secondaryInstance = std::make_unique<QtAppInstanceManager>();
+    if (!QTest::qWaitFor(
+          [&secondaryInstance]() {
+            return secondaryInstance->startupTimings().connectedToPrimary >= 0;
+          },
+          1000)) {
+      QFAIL("Secondary instance did not connect to primary instance.");
+    }
+  }
+  QTest::qWait(100);
+
+  // Kill the primary instance: the first secondary instance should replace it, and the other ones reconnect to it.
+  primaryInstance.reset();
+  if (!QTest::qWaitFor(
+        [&secondaryInstances]() {
+          return secondaryInstances[0]->isPrimaryInstance()
+                 && secondaryInstances[0]->secondaryInstanceCount() == secondaryInstanceCount - 1;
+        },
+        1000)) {
+    QFAIL("Primary instance was not replaced by the secondary instance with the lowest rank.");
+  }
+  for (auto i = 1; i < secondaryInstanceCount; ++i) {
+    QVERIFY(secondaryInstances[i]->isSecondaryInstance());
+  }
+}
+
+void Tests::test_forwardAcknowledged() {
+  // Primary instance.
+  QtAppInstanceManager primaryInstance(QtAppInstanceManager::Mode::SingleInstance);
+  QCoreApplication::processEvents();
+  QVERIFY(primaryInstance.isPrimaryInstance());
+
+  auto receivedCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&receivedCount]() {
+      ++receivedCount;
+    });
+
+  // Many secondary instances start at once, and each one waits for its arguments to be acknowledged.
+  constexpr auto secondaryInstanceCount = 32;
+  auto deliveredCount = 0;
+  auto exitRequestedCount = 0;
+  std::array<std::unique_ptr<QtAppInstanceManager>, secondaryInstanceCount> secondaryInstances;
+  for (auto i = 0; i < secondaryInstanceCount; ++i) {
+    auto secondaryInstance = std::make_unique<QtAppInstanceManager>(
+      QtAppInstanceManager::Mode::SingleInstance, QtAppInstanceManager::AppExitMode::Manual);
+    QObject::connect(secondaryInstance.get(), &QtAppInstanceManager::argumentsForwarded, &primaryInstance,
+      [&deliveredCount, &exitRequestedCount](QtAppInstanceManager::ForwardResult result) {
+        // The outcome is known before the exit is requested.
+        QCOMPARE(exitRequestedCount, deliveredCount);
+        if (result == QtAppInstanceManager::ForwardResult::Delivered) {
+          ++deliveredCount;
+        }
+      });
+    QObject::connect(secondaryInstance.get(), &QtAppInstanceManager::appExitRequested, &primaryInstance,
+      [&exitRequestedCount]() {
+        ++exitRequestedCount;
+      });
+    secondaryInstances[i] = std::move(secondaryInstance);
+  }
+
+  QTRY_COMPARE_WITH_TIMEOUT(exitRequestedCount, secondaryInstanceCount, 5000);
+  QCOMPARE(deliveredCount, secondaryInstanceCount);
+  QCOMPARE(receivedCount, secondaryInstanceCount);
+}
+
+void Tests::test_ioThread() {
+  // Both instances run their connections in their own I/O thread.
+  QtAppInstanceManager primaryInstance;
+  primaryInstance.setIoThreadEnabled(true);
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+
+  QtAppInstanceManager secondaryInstance;
+  secondaryInstance.setIoThreadEnabled(true);
+  QVERIFY(secondaryInstance.ioThreadEnabled());
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isSecondaryInstance(), 1000);
+
+  // Signals are emitted in the manager's thread.
+  QList<QByteArray> receivedMessages;
+  auto wrongThread = false;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&](const quint64 id, const QByteArray& data) {
+      wrongThread |= QThread::currentThread() != primaryInstance.thread();
+      receivedMessages.append(data);
+      primaryInstance.sendMessageToSecondary(id, data);
+    });
+  auto echoedCount = 0;
+  QObject::connect(&secondaryInstance, &QtAppInstanceManager::primaryInstanceMessageReceived, &secondaryInstance,
+    [&](const QByteArray&) {
+      wrongThread |= QThread::currentThread() != secondaryInstance.thread();
+      ++echoedCount;
+    });
+
+  // Messages may be sent from any thread, and keep their order.
+  constexpr auto messageCount = 100;
+  std::unique_ptr<QThread> worker(QThread::create([&secondaryInstance]() {
+    for (auto i = 0; i < messageCount; ++i) {
+      secondaryInstance.sendMessageToPrimary(QByteArray::number(i));
+    }
+  }));
+  worker->start();
+  QVERIFY(worker->wait(1000));
+
+  QTRY_COMPARE_WITH_TIMEOUT(echoedCount, messageCount, 5000);
+  QVERIFY(!wrongThread);
+  for (auto i = 0; i < messageCount; ++i) {
+    QCOMPARE(receivedMessages[i], QByteArray::number(i));
+  }
+  QCOMPARE(primaryInstance.secondaryInstanceCount(), 1);
+
+  // Settings may be changed from any thread: their signals are still emitted in the manager's thread.
+  auto appExitModeChangedCount = 0;
+  QObject::connect(&secondaryInstance, &QtAppInstanceManager::appExitModeChanged, &secondaryInstance, [&]() {
+    wrongThread |= QThread::currentThread() != secondaryInstance.thread();
+    ++appExitModeChangedCount;
+  });
+  std::unique_ptr<QThread> settingsWorker(QThread::create([&secondaryInstance]() {
+    secondaryInstance.setAppExitMode(QtAppInstanceManager::AppExitMode::Manual);
+    secondaryInstance.setForwardTimeout(500);
+  }));
+  settingsWorker->start();
+  QVERIFY(settingsWorker->wait(1000));
+  QTRY_COMPARE_WITH_TIMEOUT(appExitModeChangedCount, 1, 1000);
+  QVERIFY(!wrongThread);
+  QCOMPARE(secondaryInstance.appExitMode(), QtAppInstanceManager::AppExitMode::Manual);
+  QCOMPARE(secondaryInstance.forwardTimeout(), 500);
+
+  // Calls made from another thread, e.g. responses, keep their order with the messages sent by the same thread.
+  constexpr auto requestCount = 20;
+  QList<unsigned int> requestIds;
+  QObject::connect(&secondaryInstance, &QtAppInstanceManager::primaryInstanceRequestReceived, &secondaryInstance,
+    [&requestIds](const unsigned int requestId, const QByteArray&) {
+      requestIds.append(requestId);
+    });
+  QList<QFuture<QByteArray>> responses;
+  for (auto i = 0; i < requestCount; ++i) {
+    responses.append(primaryInstance.sendRequestToSecondary(secondaryInstance.instanceId(), QByteArray::number(i)));
+  }
+  QTRY_COMPARE_WITH_TIMEOUT(requestIds.size(), requestCount, 1000);
+
+  auto overtakenCount = 0;
+  auto afterResponseCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&](const quint64, const QByteArray& data) {
+      if (data.startsWith("after-")) {
+        overtakenCount += responses[data.mid(6).toInt()].isFinished() ? 0 : 1;
+        ++afterResponseCount;
+      }
+    });
+  std::unique_ptr<QThread> responseWorker(QThread::create([&secondaryInstance, &requestIds]() {
+    for (auto i = 0; i < requestCount; ++i) {
+      secondaryInstance.sendResponseToPrimary(requestIds[i], {});
+      secondaryInstance.sendMessageToPrimary("after-" + QByteArray::number(i));
+    }
+  }));
+  responseWorker->start();
+  QVERIFY(responseWorker->wait(1000));
+  QTRY_COMPARE_WITH_TIMEOUT(afterResponseCount, requestCount, 1000);
+  QCOMPARE(overtakenCount, 0);
+
+  // Streamed devices are moved to the I/O thread, which reads them.
+  auto streamedData = QByteArray{};
+  auto lastChunkReceived = false;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceStreamChunkReceived, &primaryInstance,
+    [&](const quint64, const QByteArray& chunk, bool last) {
+      streamedData += chunk;
+      lastChunkReceived = last;
+    });
+  auto* const device = new QBuffer();
+  device->setData(QByteArray(4096, 's'));
+  device->open(QIODevice::ReadOnly);
+  secondaryInstance.sendStreamToPrimary(device);
+  QVERIFY(device->thread() != secondaryInstance.thread());
+  QTRY_VERIFY_WITH_TIMEOUT(lastChunkReceived, 1000);
+  QCOMPARE(streamedData, QByteArray(4096, 's'));
+  device->deleteLater();
+
+  // Connections keep working when the I/O thread is disabled.
+  secondaryInstance.setIoThreadEnabled(false);
+  QVERIFY(!secondaryInstance.ioThreadEnabled());
+  secondaryInstance.sendMessageToPrimary("last");
+  QTRY_COMPARE_WITH_TIMEOUT(echoedCount, messageCount + requestCount + 1, 1000);
+}
+
+void Tests::test_mpscRing() {
+  MpscRing<int> ring(1000);
+  QCOMPARE(ring.capacity(), std::size_t{ 1024 });
+
+  // Full ring.
+  auto value = 0;
+  for (auto i = 0; i < 1024; ++i) {
+    QVERIFY(ring.tryPush(int{ i }));
+  }
+  QVERIFY(!ring.tryPush(int{ 0 }));
+  for (auto i = 0; i < 1024; ++i) {
+    QVERIFY(ring.tryPop(value));
+    QCOMPARE(value, i);
+  }
+  QVERIFY(!ring.tryPop(value));
+
+  // Concurrent producers: values of each producer arrive in order, and none is lost.
+  constexpr auto producerCount = 4;
+  constexpr auto valueCount = 100000;
+  std::array<std::unique_ptr<QThread>, producerCount> producers;
+  for (auto producer = 0; producer < producerCount; ++producer) {
+    producers[producer].reset(QThread::create([&ring, producer]() {
+      for (auto i = 0; i < valueCount; ++i) {
+        while (!ring.tryPush(producer * valueCount + i)) {
+          QThread::yieldCurrentThread();
+        }
+      }
+    }));
+    producers[producer]->start();
+  }
+
+  std::array<int, producerCount> nextValues{};
+  auto poppedCount = 0;
+  auto outOfOrder = false;
+  while (poppedCount < producerCount * valueCount) {
+    if (!ring.tryPop(value)) {
+      QThread::yieldCurrentThread();
+      continue;
+    }
+    const auto producer = value / valueCount;
+    outOfOrder |= value % valueCount != nextValues[producer]++;
+    ++poppedCount;
+  }
+  for (auto& producer : producers) {
+    QVERIFY(producer->wait(1000));
+  }
+  QVERIFY(!outOfOrder);
+  QVERIFY(!ring.tryPop(value));
+}
+
+void Tests::test_bufferPool() {
+  BufferPool pool(2, 1024);
+  auto buffer = pool.acquire(100);
+  QCOMPARE(buffer.size(), qsizetype{ 100 });
+  pool.release(std::move(buffer));
+
+  // A smaller buffer reuses the pooled one.
+  buffer = pool.acquire(50);
+  QCOMPARE(buffer.size(), qsizetype{ 50 });
+  QCOMPARE(pool.statistics().allocations, quint64{ 1u });
+  QCOMPARE(pool.statistics().reuses, quint64{ 1u });
+
+  // A buffer kept by someone else doesn't return to the pool.
+  const auto copy = buffer;
+  pool.release(std::move(buffer));
+  buffer = pool.acquire(50);
+  QCOMPARE(pool.statistics().allocations, quint64{ 2u });
+
+  // Too large buffers aren't pooled.
+  pool.release(pool.acquire(2048));
+  pool.acquire(2048);
+  QCOMPARE(pool.statistics().allocations, quint64{ 4u });
+}
+
+void Tests::test_steadyStateAllocations() {
+  QtAppInstanceManager primaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  QtAppInstanceManager secondaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isSecondaryInstance(), 1000);
+
+  // Receivers that don't keep the data let the buffers be reused.
+  const auto payload = QByteArray(64, 'x');
+  auto receivedCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&primaryInstance, &receivedCount, &payload](const quint64 id, const QByteArray& data) {
+      receivedCount += data == payload ? 1 : 0;
+      primaryInstance.sendMessageToSecondary(id, data);
+    });
+  auto echoedCount = 0;
+  QObject::connect(&secondaryInstance, &QtAppInstanceManager::primaryInstanceMessageReceived, &secondaryInstance,
+    [&echoedCount, &payload](const QByteArray& data) {
+      echoedCount += data == payload ? 1 : 0;
+    });
+
+  const auto sendAndWait = [&](int count) {
+    for (auto i = 0; i < count; ++i) {
+      secondaryInstance.sendMessageToPrimary(payload);
+      const auto expectedCount = echoedCount + 1;
+      if (!QTest::qWaitFor(
+            [&echoedCount, expectedCount]() {
+              return echoedCount == expectedCount;
+            },
+            1000)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // Warm up: the first messages fill the pools.
+  QVERIFY(sendAndWait(10));
+  const auto primaryStatistics = primaryInstance.bufferStatistics();
+  const auto secondaryStatistics = secondaryInstance.bufferStatistics();
+
+  // Each round trip encodes and decodes the message twice: without the pools, that would be at least 4 allocations.
+  // Fewer than one per round trip leaves room for the event loop's own ones.
+  constexpr auto messageCount = 100;
+  const auto allocationsBefore = heapAllocations.load(std::memory_order_relaxed);
+  QVERIFY(sendAndWait(messageCount));
+  const auto allocations = heapAllocations.load(std::memory_order_relaxed) - allocationsBefore;
+  QVERIFY2(allocations < static_cast<quint64>(messageCount), QByteArray::number(allocations).constData());
+
+  QCOMPARE(receivedCount, 10 + messageCount);
+  QCOMPARE(primaryInstance.bufferStatistics().allocations, primaryStatistics.allocations);
+  QCOMPARE(secondaryInstance.bufferStatistics().allocations, secondaryStatistics.allocations);
+  QVERIFY(primaryInstance.bufferStatistics().reuses >= primaryStatistics.reuses + 200u);
+  QVERIFY(secondaryInstance.bufferStatistics().reuses >= secondaryStatistics.reuses + 200u);
+}
+
+void Tests::test_typedMessages() {
+  static_assert(messages::isEncodable<OpenFiles>);
+  static_assert(messages::isEncodable<CursorPosition>);
+  static_assert(!messages::isEncodable<QList<QVariant>>);
+  static_assert(!messages::isEncodable<Unlisted>);
+  static_assert(!messages::isEncodable<Unvalidated>);
+
+  // Encoding.
+  const auto openFiles = OpenFiles{ { QStringLiteral("a.txt"), QStringLiteral("b.txt") }, 42, QByteArray("xyz") };
+  const auto encoded = messages::encode(openFiles);
+  OpenFiles decoded;
+  QVERIFY(messages::decode(encoded, decoded));
+  QCOMPARE(decoded.paths, openFiles.paths);
+  QCOMPARE(decoded.line, openFiles.line);
+  QCOMPARE(decoded.extra, openFiles.extra);
+  QVERIFY(!messages::decode(encoded.left(encoded.size() - 1), decoded));
+  QVERIFY(!messages::decode(encoded + 'x', decoded));
+
+  // Enums and booleans are checked when decoded.
+  const auto encodedPosition = messages::encode(CursorPosition{ 1, 2, Selection::Line, false });
+  QCOMPARE(encodedPosition.size(), qsizetype{ 2 * sizeof(int) + 2 });
+  CursorPosition decodedPosition;
+  QVERIFY(messages::decode(encodedPosition, decodedPosition));
+  QVERIFY(decodedPosition.selection == Selection::Line);
+  QCOMPARE(decodedPosition.visible, false);
+  auto invalidSelection = encodedPosition;
+  invalidSelection[2 * sizeof(int)] = 3;
+  QVERIFY(!messages::decode(invalidSelection, decodedPosition));
+  auto invalidBool = encodedPosition;
+  invalidBool[2 * sizeof(int) + 1] = 2;
+  QVERIFY(!messages::decode(invalidBool, decodedPosition));
+
+  QtAppInstanceManager primaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  QtAppInstanceManager secondaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isSecondaryInstance(), 1000);
+
+  // Each type goes to its own callback.
+  auto receivedOpenFiles = OpenFiles{};
+  auto openFilesSenderId = quint64{ 0u };
+  primaryInstance.onMessage<OpenFiles>([&](const quint64 senderId, const OpenFiles& message) {
+    openFilesSenderId = senderId;
+    receivedOpenFiles = message;
+  });
+  auto receivedPositions = QList<QPoint>{};
+  secondaryInstance.onMessage<CursorPosition>([&](const quint64 senderId, const CursorPosition& message) {
+    QCOMPARE(senderId, quint64{ 0u });
+    receivedPositions.append(QPoint(message.x, message.y));
+  });
+
+  secondaryInstance.sendToPrimary(openFiles);
+  QTRY_COMPARE_WITH_TIMEOUT(receivedOpenFiles.paths, openFiles.paths, 1000);
+  QCOMPARE(receivedOpenFiles.line, openFiles.line);
+  QVERIFY(openFilesSenderId != 0u);
+
+  primaryInstance.sendToSecondary(openFilesSenderId, CursorPosition{ 1, 2 });
+  primaryInstance.sendToAllSecondaries(CursorPosition{ 3, 4 });
+  QTRY_COMPARE_WITH_TIMEOUT(receivedPositions.size(), 2, 1000);
+  QCOMPARE(receivedPositions.at(0), QPoint(1, 2));
+  QCOMPARE(receivedPositions.at(1), QPoint(3, 4));
+
+  // Typed messages don't reach the untyped signals, and messages without callback are dropped.
+  openFilesSenderId = 0u;
+  auto untypedMessageCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&untypedMessageCount]() {
+      ++untypedMessageCount;
+    });
+  primaryInstance.removeMessageHandler<OpenFiles>();
+  secondaryInstance.sendToPrimary(openFiles);
+  secondaryInstance.sendMessageToPrimary(QByteArray("end"));
+  QTRY_COMPARE_WITH_TIMEOUT(untypedMessageCount, 1, 1000);
+  QCOMPARE(openFilesSenderId, quint64{ 0u });
+}
+
+void Tests::test_topics() {
+  QtAppInstanceManager primaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  std::array<std::unique_ptr<QtAppInstanceManager>, 3> secondaryInstances;
+  for (auto& secondaryInstance : secondaryInstances) {
+    secondaryInstance = std::make_unique<QtAppInstanceManager>();
+    QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance->isSecondaryInstance(), 1000);
+  }
+
+  // What each instance received. The primary instance is the last one.
+  struct Received {
+    QStringList messages;
+    quint64 lastPublisherId{ 0u };
+    int syncCount{ 0 };
+  };
+  std::array<Received, 4> received;
+  const auto connectInstance = [](QtAppInstanceManager& instance, Received& receivedByInstance) {
+    QObject::connect(&instance, &QtAppInstanceManager::topicMessageReceived, &instance,
+      [&receivedByInstance](const QString& topic, const quint64 publisherId, const QByteArray& data) {
+        receivedByInstance.messages.append(topic + ':' + QString::fromUtf8(data));
+        receivedByInstance.lastPublisherId = publisherId;
+      });
+    QObject::connect(&instance, &QtAppInstanceManager::primaryInstanceMessageReceived, &instance,
+      [&receivedByInstance]() {
+        ++receivedByInstance.syncCount;
+      });
+  };
+  for (auto i = size_t{ 0 }; i < secondaryInstances.size(); ++i) {
+    connectInstance(*secondaryInstances[i], received[i]);
+  }
+  connectInstance(primaryInstance, received[3]);
+  auto primarySyncCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&primarySyncCount]() {
+      ++primarySyncCount;
+    });
+
+  // Frames are handled in order: once a message sent afterwards is received, the previous frames were handled too.
+  const auto syncSecondaryInstances = [&]() {
+    const auto expectedCount = primarySyncCount + static_cast<int>(secondaryInstances.size());
+    for (auto& secondaryInstance : secondaryInstances) {
+      secondaryInstance->sendMessageToPrimary("sync");
+    }
+    return QTest::qWaitFor(
+      [&primarySyncCount, expectedCount]() {
+        return primarySyncCount == expectedCount;
+      },
+      1000);
+  };
+  const auto syncPrimaryInstance = [&]() {
+    const auto expectedCount = received[0].syncCount + 1;
+    primaryInstance.sendMessageToAllSecondaries("sync");
+    return QTest::qWaitFor(
+      [&received, expectedCount]() {
+        return std::all_of(received.begin(), received.end() - 1, [expectedCount](const Received& item) {
+          return item.syncCount == expectedCount;
+        });
+      },
+      1000);
+  };
+
+  secondaryInstances[0]->subscribe("a");
+  secondaryInstances[1]->subscribe("a");
+  secondaryInstances[2]->subscribe("b");
+  primaryInstance.subscribe("a");
+  QVERIFY(secondaryInstances[0]->isSubscribed("a"));
+  QVERIFY(!secondaryInstances[0]->isSubscribed("b"));
+  QVERIFY(syncSecondaryInstances());
+
+  // Published by a secondary instance, and relayed to the other subscribers only.
+  secondaryInstances[0]->publish("a", "1");
+  QTRY_COMPARE_WITH_TIMEOUT(received[3].messages, QStringList{ "a:1" }, 1000);
+  QVERIFY(received[3].lastPublisherId != 0u);
+  QTRY_COMPARE_WITH_TIMEOUT(received[1].messages, QStringList{ "a:1" }, 1000);
+  QCOMPARE(received[1].lastPublisherId, received[3].lastPublisherId);
+
+  // Published by the primary instance.
+  primaryInstance.publish("b", "2");
+  QTRY_COMPARE_WITH_TIMEOUT(received[2].messages, QStringList{ "b:2" }, 1000);
+  QCOMPARE(received[2].lastPublisherId, quint64{ 0u });
+
+  // Unsubscribed instances don't receive anything anymore.
+  secondaryInstances[1]->unsubscribe("a");
+  QVERIFY(syncSecondaryInstances());
+  secondaryInstances[2]->publish("a", "3");
+  QVERIFY(syncSecondaryInstances());
+  QVERIFY(syncPrimaryInstance());
+  QCOMPARE(received[0].messages, (QStringList{ "a:3" }));
+  QCOMPARE(received[1].messages, QStringList{ "a:1" });
+  QCOMPARE(received[2].messages, QStringList{ "b:2" });
+  QCOMPARE(received[3].messages, (QStringList{ "a:1", "a:3" }));
+}
+
+void Tests::test_peerConnections() {
+  QtAppInstanceManager primaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  QtAppInstanceManager secondaryInstance1;
+  QtAppInstanceManager secondaryInstance2;
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance1.instanceId() != 0u, 1000);
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance2.instanceId() != 0u, 1000);
+  const auto id1 = secondaryInstance1.instanceId();
+  const auto id2 = secondaryInstance2.instanceId();
+  QVERIFY(id1 != id2);
+  QCOMPARE(primaryInstance.instanceId(), quint64{ 0u });
+
+  // Nothing goes through the primary instance.
+  auto primaryMessageCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&primaryMessageCount]() {
+      ++primaryMessageCount;
+    });
+
+  QList<std::pair<quint64, QByteArray>> received1;
+  QObject::connect(&secondaryInstance1, &QtAppInstanceManager::secondaryInstanceMessageReceived, &secondaryInstance1,
+    [&received1](const quint64 id, const QByteArray& data) {
+      received1.append({ id, data });
+    });
+  QList<std::pair<quint64, QByteArray>> received2;
+  QObject::connect(&secondaryInstance2, &QtAppInstanceManager::secondaryInstanceMessageReceived, &secondaryInstance2,
+    [&received2, &secondaryInstance2](const quint64 id, const QByteArray& data) {
+      received2.append({ id, data });
+      // Answered through the connection opened by the other instance.
+      secondaryInstance2.sendMessageToSecondary(id, "pong");
+    });
+
+  // Messages sent before the connection is opened are kept in order.
+  const auto largeMessage = QByteArray(1024 * 1024, 'x');
+  secondaryInstance1.sendMessageToSecondary(id2, "ping");
+  secondaryInstance1.sendMessageToSecondary(id2, largeMessage);
+  QTRY_COMPARE_WITH_TIMEOUT(received2.size(), 2, 2000);
+  QCOMPARE(received2.at(0), std::make_pair(id1, QByteArray("ping")));
+  QCOMPARE(received2.at(1).second.size(), largeMessage.size());
+  QVERIFY(received2.at(1).second == largeMessage);
+  QTRY_COMPARE_WITH_TIMEOUT(received1.size(), 2, 1000);
+  QCOMPARE(received1.at(0), std::make_pair(id2, QByteArray("pong")));
+
+  // Unknown instances can't be reached: no connection is opened, and nothing is sent to the other ones.
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceRequestReceived, &primaryInstance,
+    [&primaryInstance](const quint64 id, const unsigned int requestId, const QByteArray& data) {
+      primaryInstance.sendResponseToSecondary(id, requestId, data);
+    });
+  secondaryInstance1.sendMessageToSecondary(id2 + 100u, "lost");
+  secondaryInstance1.sendMessageToPrimary("end");
+  // Answered after the lookup, on the same connection.
+  auto future = secondaryInstance1.sendRequestToPrimary("sync");
+  QTRY_VERIFY_WITH_TIMEOUT(future.isFinished(), 1000);
+  QCOMPARE(primaryMessageCount, 1);
+  const auto connections = secondaryInstance1.statistics().connections;
+  QCOMPARE(connections.size(), qsizetype{ 2 });
+  const auto peerConnection = std::find_if(connections.begin(), connections.end(), [id2](const auto& connection) {
+    return connection.id == id2;
+  });
+  QVERIFY(peerConnection != connections.end());
+  QCOMPARE(peerConnection->messagesSent, quint64{ 2u });
+  QCOMPARE(received1.size(), 2);
+  QCOMPARE(received2.size(), 2);
+
+  // Ids are not truncated, and tokens depend on both the secret and the id.
+  const auto largeId = quint64{ 0x100000002u };
+  auto decodedId = quint64{};
+  auto token = QByteArray{};
+  auto name = QByteArray{};
+  const auto secret = QByteArray(protocol::PeerSecretSize, 's');
+  const auto largeIdToken = protocol::makePeerToken(secret, largeId);
+  const auto lookup = protocol::encodePeerLookup(largeId, largeIdToken, "name");
+  QVERIFY(protocol::decodePeerLookup(lookup, decodedId, token, name));
+  QCOMPARE(decodedId, largeId);
+  QCOMPARE(token, largeIdToken);
+  QCOMPARE(name, QByteArray("name"));
+  QCOMPARE(largeIdToken.size(), qsizetype{ protocol::PeerTokenSize });
+  QVERIFY(largeIdToken != protocol::makePeerToken(secret, 2u));
+  QVERIFY(largeIdToken != protocol::makePeerToken(QByteArray(protocol::PeerSecretSize, 't'), largeId));
+  QVERIFY(protocol::decodePeerLookup(protocol::encodePeerLookup(largeId), decodedId, token, name));
+  QVERIFY(name.isEmpty());
+}
+
+void Tests::test_compression() {
+  // Codec round trips, including data too short to contain any match, and overlapping matches.
+  auto repetitive = QByteArray{};
+  for (auto i = 0; i < 10000; ++i) {
+    repetitive += QByteArray::number(i % 100) + ",\"key\":\"value\";";
+  }
+  const auto inputs = QList<QByteArray>{ {}, "a", "abcdefghijkl", QByteArray(100000, 'x'), repetitive };
+  for (const auto& input : inputs) {
+    const auto compressed = compression::compressLz4(input);
+    QCOMPARE(compression::lz4DecompressedSize(compressed), input.size());
+    QByteArray decompressed(input.size(), Qt::Uninitialized);
+    QVERIFY(compression::decompressLz4(compressed, decompressed.data(), decompressed.size()));
+    QCOMPARE(decompressed, input);
+  }
+  const auto compressed = compression::compressLz4(repetitive);
+  QVERIFY(compressed.size() < repetitive.size() / 4);
+
+  // Corrupted data is rejected.
+  QByteArray decompressed(repetitive.size(), Qt::Uninitialized);
+  QVERIFY(!compression::decompressLz4(compressed.left(compressed.size() - 1), decompressed.data(),
+    decompressed.size()));
+  QVERIFY(!compression::decompressLz4(compressed, decompressed.data(), decompressed.size() - 1));
+  QCOMPARE(compression::lz4DecompressedSize(QByteArray("\xFF\xFF\xFF\xFF\x00", 5)), qsizetype{ -1 });
+
+  // Payloads whose size doesn't fit the 4-byte prefix are never compressed.
+  QVERIFY(compression::isCompressible(0));
+  QVERIFY(!compression::isCompressible(-1));
+  if constexpr (sizeof(qsizetype) > sizeof(quint32)) {
+    constexpr auto maxPrefixedSize = qint64{ std::numeric_limits<quint32>::max() };
+    QVERIFY(compression::isCompressible(static_cast<qsizetype>(maxPrefixedSize)));
+    QVERIFY(!compression::isCompressible(static_cast<qsizetype>(maxPrefixedSize + 1)));
+  }
+
+  // The size prefix of zlib payloads is checked against the same ratio, before qUncompress() allocates anything.
+  const auto zlibCompressed = qCompress(repetitive);
+  QCOMPARE(compression::zlibDecompressedSize(zlibCompressed), repetitive.size());
+  auto corruptedPrefix = zlibCompressed;
+  corruptedPrefix[0] = '\x7F';
+  QCOMPARE(compression::zlibDecompressedSize(corruptedPrefix), qsizetype{ -1 });
+  QCOMPARE(compression::zlibDecompressedSize(qCompress(QByteArray(1024 * 1024, 'x'))), qsizetype{ -1 });
+
+  // Both codecs, between instances.
+  QtAppInstanceManager primaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  QList<QByteArray> received;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&received](const quint64, const QByteArray& data) {
+      received.append(data);
+    });
+
+  for (const auto codec : { QtAppInstanceManager::Compression::Lz4, QtAppInstanceManager::Compression::Zlib }) {
+    received.clear();
+    QtAppInstanceManager secondaryInstance;
+    secondaryInstance.setCompression(codec);
+    secondaryInstance.setCompressionThreshold(1024);
+    QCOMPARE(secondaryInstance.compression(), codec);
+    QCOMPARE(secondaryInstance.compressionThreshold(), qint64{ 1024 });
+    QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isSecondaryInstance(), 1000);
+
+    // Data compressed beyond the accepted ratio is sent as is.
+    const auto uniform = QByteArray(1024 * 1024, 'x');
+    secondaryInstance.sendMessageToPrimary(repetitive);
+    secondaryInstance.sendMessageToPrimary("small");
+    secondaryInstance.sendMessageToPrimary(uniform);
+    QTRY_COMPARE_WITH_TIMEOUT(received.size(), qsizetype{ 3 }, 2000);
+    QCOMPARE(received.at(0).size(), repetitive.size());
+    QVERIFY(received.at(0) == repetitive);
+    QCOMPARE(received.at(1), QByteArray("small"));
+    QVERIFY(received.at(2) == uniform);
+  }
+}
+
+void Tests::test_sharding() {
+  // The shard count is known before the role is decided.
+  auto settings = QtAppInstanceManager::StartupSettings{};
+  settings.shardCount = 2;
+  const auto mode = QtAppInstanceManager::Mode::MultipleInstances;
+  const auto appExitMode = QtAppInstanceManager::AppExitMode::Auto;
+
+  // Instances become the primary instance of the first shard without one.
+  QtAppInstanceManager primaryInstance1(mode, appExitMode, settings);
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance1.isPrimaryInstance(), 1000);
+  QCOMPARE(primaryInstance1.shardCount(), 2);
+  QCOMPARE(primaryInstance1.shardIndex(), 0);
+  QtAppInstanceManager primaryInstance2(mode, appExitMode, settings);
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance2.isPrimaryInstance(), 1000);
+  QCOMPARE(primaryInstance2.shardIndex(), 1);
+
+  const auto getPrimaryInstance = [&](const QtAppInstanceManager& secondaryInstance) -> QtAppInstanceManager& {
+    return secondaryInstance.shardIndex() == 0 ? primaryInstance1 : primaryInstance2;
+  };
+  const auto getOtherPrimaryInstance = [&](const QtAppInstanceManager& secondaryInstance) -> QtAppInstanceManager& {
+    return secondaryInstance.shardIndex() == 0 ? primaryInstance2 : primaryInstance1;
+  };
+
+  // Then, secondary instances go to the least loaded shard.
+  QtAppInstanceManager secondaryInstance1(mode, appExitMode, settings);
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance1.isSecondaryInstance(), 1000);
+  QTRY_COMPARE_WITH_TIMEOUT(getPrimaryInstance(secondaryInstance1).secondaryInstanceCount(), 1, 1000);
+  QTRY_COMPARE_WITH_TIMEOUT(getOtherPrimaryInstance(secondaryInstance1).secondaryInstanceCount(), 0, 1000);
+
+  QtAppInstanceManager secondaryInstance2(mode, appExitMode, settings);
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance2.isSecondaryInstance(), 1000);
+  QVERIFY(secondaryInstance2.shardIndex() != secondaryInstance1.shardIndex());
+  QTRY_COMPARE_WITH_TIMEOUT(primaryInstance1.secondaryInstanceCount(), 1, 1000);
+  QTRY_COMPARE_WITH_TIMEOUT(primaryInstance2.secondaryInstanceCount(), 1, 1000);
+
+  // Counts are published by each primary instance, so any instance can read them.
+  QCOMPARE(secondaryInstance1.secondaryInstanceCount(0), 1);
+  QCOMPARE(secondaryInstance1.secondaryInstanceCount(1), 1);
+  QCOMPARE(secondaryInstance1.secondaryInstanceCount(2), 0);
+  QCOMPARE(secondaryInstance1.totalSecondaryInstanceCount(), 2);
+  QCOMPARE(primaryInstance1.totalSecondaryInstanceCount(), 2);
+
+  // Messages stay within the shard.
+  QList<QByteArray> received;
+  QObject::connect(&getPrimaryInstance(secondaryInstance2), &QtAppInstanceManager::secondaryInstanceMessageReceived,
+    &primaryInstance1, [&received](const quint64, const QByteArray& data) {
+      received.append(data);
+    });
+  auto otherReceivedCount = 0;
+  QObject::connect(&getOtherPrimaryInstance(secondaryInstance2),
+    &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance1, [&otherReceivedCount]() {
+      ++otherReceivedCount;
+    });
+  secondaryInstance2.sendMessageToPrimary("hello");
+  QTRY_COMPARE_WITH_TIMEOUT(received, QList<QByteArray>{ "hello" }, 1000);
+  QCOMPARE(otherReceivedCount, 0);
+
+  // Adding shards later doesn't move the instances that already have one.
+  const auto shardIndex = secondaryInstance1.shardIndex();
+  secondaryInstance1.setShardCount(3);
+  QTRY_COMPARE_WITH_TIMEOUT(secondaryInstance1.shardCount(), 3, 1000);
+  QVERIFY(secondaryInstance1.isSecondaryInstance());
+  QCOMPARE(secondaryInstance1.shardIndex(), shardIndex);
+  QCOMPARE(secondaryInstance1.statistics().reconnects, quint64{ 0u });
+  QCOMPARE(getPrimaryInstance(secondaryInstance1).secondaryInstanceCount(), 1);
+}
+
+void Tests::test_statistics() {
+  // Power-of-two buckets, in microseconds.
+  QCOMPARE(LatencyHistogram::bucketIndex(0), 0);
+  QCOMPARE(LatencyHistogram::bucketIndex(1999), 0);
+  QCOMPARE(LatencyHistogram::bucketIndex(2000), 1);
+  QCOMPARE(LatencyHistogram::bucketIndex(1000 * 1000), 9);
+  QCOMPARE(LatencyHistogram::bucketIndex(std::numeric_limits<qint64>::max()), LatencyHistogram::BucketCount - 1);
+
+  auto primaryInstance = std::make_unique<QtAppInstanceManager>();
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance->isPrimaryInstance(), 1000);
+  QObject::connect(primaryInstance.get(), &QtAppInstanceManager::secondaryInstanceRequestReceived,
+    primaryInstance.get(), [&primaryInstance](const quint64 id, const unsigned int requestId) {
+      primaryInstance->sendResponseToSecondary(id, requestId, "response");
+    });
+  QtAppInstanceManager secondaryInstance;
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.instanceId() != 0u, 1000);
+
+  constexpr auto messageCount = 3;
+  constexpr auto messageSize = 100;
+  for (auto i = 0; i < messageCount; ++i) {
+    secondaryInstance.sendMessageToPrimary(QByteArray(messageSize, 'x'));
+  }
+  auto future = secondaryInstance.sendRequestToPrimary("request");
+  QTRY_VERIFY_WITH_TIMEOUT(future.isFinished(), 1000);
+  QVERIFY(!future.isCanceled());
+
+  // Both ends agree on the traffic of their connection.
+  const auto id = secondaryInstance.instanceId();
+  const auto secondaryStatistics = secondaryInstance.statistics();
+  QCOMPARE(secondaryStatistics.connections.size(), qsizetype{ 1 });
+  const auto& connection = secondaryStatistics.connections.first();
+  QCOMPARE(connection.id, quint64{ 0u });
+  // Control frames, e.g. the succession rank sent by the primary instance, are counted apart from messages.
+  QCOMPARE(connection.messagesSent, quint64{ messageCount + 1u });
+  QCOMPARE(connection.messagesReceived, quint64{ 1u });
+  QVERIFY(connection.controlFramesReceived >= 1u);
+  QVERIFY(connection.bytesSent >= quint64{ messageCount * messageSize });
+  QCOMPARE(connection.messagesSent, secondaryStatistics.messagesSent);
+  QCOMPARE(connection.controlFramesReceived, secondaryStatistics.controlFramesReceived);
+  QCOMPARE(connection.bytesReceived, secondaryStatistics.bytesReceived);
+  QCOMPARE(connection.bytesToWrite, qint64{ 0 });
+  QVERIFY(secondaryStatistics.handshakeDuration >= 0);
+  const auto& histogram = secondaryStatistics.latencyHistogram;
+  QCOMPARE(std::accumulate(histogram.begin(), histogram.end(), quint64{ 0u }), quint64{ 1u });
+
+  const auto findConnection = [&primaryInstance, id]() {
+    const auto statistics = primaryInstance->statistics();
+    const auto it = std::find_if(statistics.connections.begin(), statistics.connections.end(),
+      [id](const QtAppInstanceManager::ConnectionStatistics& item) {
+        return item.id == id;
+      });
+    return it != statistics.connections.end() ? *it : QtAppInstanceManager::ConnectionStatistics{};
+  };
+  QTRY_COMPARE_WITH_TIMEOUT(findConnection().bytesReceived, connection.bytesSent, 1000);
+  QCOMPARE(findConnection().messagesReceived, connection.messagesSent);
+  QCOMPARE(findConnection().controlFramesSent, connection.controlFramesReceived);
+  QCOMPARE(findConnection().bytesSent, connection.bytesReceived);
+  QCOMPARE(secondaryStatistics.reconnects, quint64{ 0u });
+
+  // Re-election.
+  primaryInstance.reset();
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isPrimaryInstance(), 1000);
+  const auto statistics = secondaryInstance.statistics();
+  QCOMPARE(statistics.reconnects, quint64{ 1u });
+  QVERIFY(statistics.reelectionTime > 0);
+  QVERIFY(statistics.connections.isEmpty());
+}
+
+void Tests::test_tracing() {
+  // Export, whatever the build options.
+  tracing::ChromeTraceSink sink(2);
+  tracing::Record record;
+  record.event = tracing::Event::Enqueue;
+  record.sequence = 1u;
+  record.flowId = 0x1234u;
+  record.timestamp = 5000;
+  record.duration = 2000;
+  sink.record(record);
+  record.event = tracing::Event::Write;
+  sink.record(record);
+  sink.record(record);
+  QCOMPARE(sink.records().size(), qsizetype{ 2 });
+  QCOMPARE(sink.droppedRecordCount(), quint64{ 1u });
+
+  const auto document = QJsonDocument::fromJson(sink.toJson());
+  const auto events = document.object().value(QStringLiteral("traceEvents")).toArray();
+  // Process name, two events, and the start of the flow.
+  QCOMPARE(events.size(), qsizetype{ 4 });
+  const auto enqueueEvent = events.at(1).toObject();
+  QCOMPARE(enqueueEvent.value(QStringLiteral("name")).toString(), QStringLiteral("enqueue"));
+  QCOMPARE(enqueueEvent.value(QStringLiteral("ph")).toString(), QStringLiteral("X"));
+  QCOMPARE(enqueueEvent.value(QStringLiteral("ts")).toDouble(), 5.0);
+  QCOMPARE(enqueueEvent.value(QStringLiteral("dur")).toDouble(), 2.0);
+  QCOMPARE(events.at(2).toObject().value(QStringLiteral("ph")).toString(), QStringLiteral("s"));
+  QCOMPARE(events.at(2).toObject().value(QStringLiteral("id")).toString(), QStringLiteral("1234"));
+
+  // Sequence numbers are written in the frame headers on 16 bits, and extended to 64 bits by the receiver.
+  QByteArray encoded(protocol::FrameHeaderSize + 1, Qt::Uninitialized);
+  protocol::encodeFrameInto(encoded.data(), "x", protocol::FrameType::Message, 0u, 7u, 0x1234u);
+  QCOMPARE(protocol::readFrameHeader(encoded.constData()).sequence, quint16{ 0x1234u });
+  QCOMPARE(protocol::readFrameHeader(encoded.constData()).tag, quint32{ 7u });
+  QCOMPARE(protocol::nextFrameSequence(0u), quint64{ 1u });
+  QCOMPARE(protocol::nextFrameSequence(0xFFFFu), quint64{ 0x10001u });
+  QCOMPARE(protocol::extendFrameSequence(0xFFFEu, 0xFFFFu), quint64{ 0xFFFFu });
+  QCOMPARE(protocol::extendFrameSequence(0xFFFFu, 1u), quint64{ 0x10001u });
+  // Frames dropped by the sender.
+  QCOMPARE(protocol::extendFrameSequence(0x10001u, 5u), quint64{ 0x10005u });
+  QCOMPARE(protocol::extendFrameSequence(0x1FFF0u, 2u), quint64{ 0x20002u });
+
+  if (!tracing::Enabled) {
+    QSKIP("The library is built without QTAPPINSTANCEMANAGER_TRACING.");
+  }
+
+  // The same frame is identified on both ends.
+  const auto primarySink = std::make_shared<tracing::ChromeTraceSink>();
+  const auto secondarySink = std::make_shared<tracing::ChromeTraceSink>();
+  QtAppInstanceManager primaryInstance;
+  primaryInstance.setTraceSink(primarySink);
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  auto receivedCount = 0;
+  QObject::connect(&primaryInstance, &QtAppInstanceManager::secondaryInstanceMessageReceived, &primaryInstance,
+    [&receivedCount]() {
+      ++receivedCount;
+    });
+  QtAppInstanceManager secondaryInstance;
+  secondaryInstance.setTraceSink(secondarySink);
+  // Sent before the handshake, after the secondary instance's first control frames.
+  secondaryInstance.sendMessageToPrimary("early");
+  QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.instanceId() != 0u, 1000);
+  secondaryInstance.sendMessageToPrimary("hello");
+  QTRY_COMPARE_WITH_TIMEOUT(receivedCount, 2, 1000);
+  secondaryInstance.setTraceSink(nullptr);
+  primaryInstance.setTraceSink(nullptr);
+
+  const auto findRecord = [](const QList<tracing::Record>& records, tracing::Event event, quint64 flowId) {
+    return std::find_if(records.begin(), records.end(), [event, flowId](const tracing::Record& item) {
+      return item.event == event && item.flowId == flowId && item.frameType == 0u && item.size > 0;
+    }) != records.end();
+  };
+  const auto secondaryRecords = secondarySink->records();
+  const auto primaryRecords = primarySink->records();
+  QVERIFY(std::any_of(secondaryRecords.begin(), secondaryRecords.end(), [](const tracing::Record& item) {
+    return item.event == tracing::Event::Write;
+  }));
+  auto enqueuedCount = 0;
+  for (const auto& enqueued : secondaryRecords) {
+    if (enqueued.event == tracing::Event::Enqueue && enqueued.frameType == 0u) {
+      ++enqueuedCount;
+      QVERIFY(enqueued.sequence != 0u);
+      QVERIFY(enqueued.flowId != 0u);
+      QCOMPARE(enqueued.connectionId, quint64{ 0u });
+      QVERIFY(enqueued.timestamp > 0);
+      QVERIFY(findRecord(primaryRecords, tracing::Event::Read, enqueued.flowId));
+      QVERIFY(findRecord(primaryRecords, tracing::Event::Dispatch, enqueued.flowId));
+    }
+  }
+  QCOMPARE(enqueuedCount, 2);
+}
+
+void Tests::test_heartbeats() {
+#if !defined(Q_OS_UNIX)
+  QSKIP("Stopping a process requires SIGSTOP.");
+#else
+  const auto mode = QtAppInstanceManager::Mode::MultipleInstances;
+  const auto appExitMode = QtAppInstanceManager::AppExitMode::Auto;
+  // Missed heartbeats, plus one interval to notice it, plus a margin for loaded machines.
+  constexpr auto maxFailoverTime = HeartbeatInterval * (MissedHeartbeats + 1) + 500;
+
+  // A killed primary instance closes its socket, while a stopped one must be detected by its missing heartbeats.
+  for (const auto signalNumber : { SIGKILL, SIGSTOP }) {
+    QProcess primaryProcess;
+    QVERIFY(startChildInstance(primaryProcess, "primary"));
+    const auto pid = static_cast<pid_t>(primaryProcess.processId());
+    QtAppInstanceManager secondaryInstance(mode, appExitMode, getHeartbeatSettings());
+    QCOMPARE(secondaryInstance.heartbeatPolicy().interval, HeartbeatInterval);
+    QCOMPARE(secondaryInstance.heartbeatPolicy().missedThreshold, MissedHeartbeats);
+    QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.instanceId() != 0u, 1000);
+    // Lets the instances exchange heartbeats.
+    QTest::qWait(HeartbeatInterval * 2);
+    // Heartbeats are control frames, not messages.
+    const auto statistics = secondaryInstance.statistics();
+    QVERIFY(statistics.controlFramesReceived > 0u);
+    QCOMPARE(statistics.messagesReceived, quint64{ 0u });
+
+    QElapsedTimer failoverTimer;
+    failoverTimer.start();
+    QCOMPARE(::kill(pid, signalNumber), 0);
+    QTRY_VERIFY_WITH_TIMEOUT(secondaryInstance.isPrimaryInstance(), 5000);
+    const auto failoverTime = failoverTimer.elapsed();
+    const auto action = signalNumber == SIGKILL ? "Killed" : "Stopped";
+    qInfo() << action << "primary instance replaced in" << failoverTime << "ms";
+    QVERIFY(failoverTime < maxFailoverTime);
+
+    if (signalNumber == SIGSTOP) {
+      // Once resumed, it notices that it was replaced, and becomes a secondary instance.
+      QCOMPARE(::kill(pid, SIGCONT), 0);
+      QTRY_COMPARE_WITH_TIMEOUT(secondaryInstance.secondaryInstanceCount(), 1, 2000);
+      QVERIFY(secondaryInstance.isPrimaryInstance());
+    }
+    primaryProcess.kill();
+    QVERIFY(primaryProcess.waitForFinished(5000));
+  }
+
+  // A stopped secondary instance is disconnected, and connects again once resumed.
+  QtAppInstanceManager primaryInstance(mode, appExitMode, getHeartbeatSettings());
+  QTRY_VERIFY_WITH_TIMEOUT(primaryInstance.isPrimaryInstance(), 1000);
+  // A single missed heartbeat would be mistaken for a late one.
+  primaryInstance.setHeartbeatPolicy({ HeartbeatInterval, 1 });
+  QCOMPARE(primaryInstance.heartbeatPolicy().missedThreshold, 2);
+  primaryInstance.setHeartbeatPolicy({ HeartbeatInterval, MissedHeartbeats });
+  QProcess secondaryProcess;
+  QVERIFY(startChildInstance(secondaryProcess, "secondary"));
+  const auto pid = static_cast<pid_t>(secondaryProcess.processId());
+  QTRY_COMPARE_WITH_TIMEOUT(primaryInstance.secondaryInstanceCount(), 1, 1000);
+  QTest::qWait(HeartbeatInterval * 2);
+  QCOMPARE(::kill(pid, SIGSTOP), 0);
+  QTRY_COMPARE_WITH_TIMEOUT(primaryInstance.secondaryInstanceCount(), 0, maxFailoverTime);
+  QCOMPARE(::kill(pid, SIGCONT), 0);
+  QTRY_COMPARE_WITH_TIMEOUT(primaryInstance.secondaryInstanceCount(), 1, 2000);
+  secondaryProcess.kill();
+  QVERIFY(secondaryProcess.waitForFinished(5000));
+#endif
+}
+
+void Tests::test_frameDecoder() {
+  const auto expectedPayload1 = QByteArray("message");
+  const auto expectedPayload2 = QByteArray(100, 'x');
+  constexpr auto expectedTag = 42u;
+  auto data = protocol::encodeFrame(protocol::Version::Framed, expectedPayload1);
+  data += protocol::encodeFrame(protocol::Version::Framed, expectedPayload2, protocol::FrameType::Chunk,
+    protocol::FrameFlag::LastChunk, expectedTag);
+
+  // Bytes arrive one at a time: partial headers and bodies must not lose progress.
+  auto receivedData = QByteArray{};
+  QBuffer device(&receivedData);
+  device.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+
+  FrameDecoder decoder(protocol::Version::Framed);
+  QList<FrameDecoder::Frame> frames;
+  for (const auto byte : data) {
+    receivedData.append(byte);
+    auto frame = FrameDecoder::Frame{};
+    if (decoder.decode(device, frame) == FrameDecoder::Status::FrameReady) {
+      frames.append(frame);
+    }
+  }
+
+  QCOMPARE(frames.size(), qsizetype{ 2 });
+  QVERIFY(frames[0].header.type == protocol::FrameType::Message);
+  QCOMPARE(frames[0].payload, expectedPayload1);
+  QVERIFY(frames[1].header.type == protocol::FrameType::Chunk);
+  QCOMPARE(frames[1].header.flags, quint8{ protocol::FrameFlag::LastChunk });
+  QCOMPARE(frames[1].header.tag, expectedTag);
+  QCOMPARE(frames[1].payload, expectedPayload2);
+  QCOMPARE(device.bytesAvailable(), qint64{ 0 });
+}
+
+void Tests::test_frameDecoderLegacy() {
+  // Frames written by the former protocol: body size, then QByteArray serialized by QDataStream.
+  const auto expectedPayload = QByteArray("message");
+  auto data = QByteArray{};
+  {
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_DefaultCompiledVersion);
+    stream << static_cast<quint64>(expectedPayload.size()) << expectedPayload;
+    stream << static_cast<quint64>(0u) << QByteArray{};
+  }
+
+  QBuffer device(&data);
+  device.open(QIODevice::ReadOnly);
+
+  FrameDecoder decoder(protocol::Version::Legacy);
+  auto frame = FrameDecoder::Frame{};
+  QVERIFY(decoder.decode(device, frame) == FrameDecoder::Status::FrameReady);
+  QCOMPARE(frame.payload, expectedPayload);
+  QVERIFY(decoder.decode(device, frame) == FrameDecoder::Status::FrameReady);
+  QVERIFY(frame.payload.isEmpty());
+  QVERIFY(decoder.decode(device, frame) == FrameDecoder::Status::NeedMoreData);
+}
@@ -8,10 +8,43 @@ class Tests : public QObject {
 public:
   using QObject::QObject;
 
+  /// Makes the test executable run an instance with heartbeats instead of the tests, for test_heartbeats().
+  static constexpr auto ChildInstanceArgument = "--child-instance";
+  static int runChildInstance();
+  /// Makes the test executable run an instance in Mode::SingleInstance, for test_singleInstanceForwarding().
+  static constexpr auto SingleInstanceArgument = "--single-instance";
+  static int runSingleInstance();
+
 private slots:
   void test_roles();
   void test_messages();
   void test_primaryInstanceKilled();
   void test_secondaryInstanceCount();
   void test_forceSingleInstance();
+  void test_flushPolicy();
+  void test_teardownWithUnsentData();
+  void test_secondaryInstanceIdsNotReused();
+  void test_broadcast();
+  void test_bulkTransfer();
+  void test_pipelinedMessages();
+  void test_streams();
+  void test_requests();
+  void test_startupTimings();
+  void test_singleInstanceForwarding();
+  void test_reelection();
+  void test_forwardAcknowledged();
+  void test_ioThread();
+  void test_mpscRing();
+  void test_bufferPool();
+  void test_steadyStateAllocations();
+  void test_typedMessages();
+  void test_topics();
+  void test_peerConnections();
+  void test_compression();
+  void test_sharding();
+  void test_statistics();
+  void test_tracing();
+  void test_heartbeats();
+  void test_frameDecoder();
+  void test_frameDecoderLegacy();
 };
@@ -12,6 +12,12 @@ int main(int argc, char* argv[]) {
   QCoreApplication::setOrganizationName("oclero");
   QCoreApplication app(argc, argv);
 
+  if (app.arguments().contains(QLatin1String(Tests::ChildInstanceArgument))) {
+    return Tests::runChildInstance();
+  } else if (app.arguments().contains(QLatin1String(Tests::SingleInstanceArgument))) {
+    return Tests::runSingleInstance();
+  }
+
   Tests tests;
   const auto success = QTest::qExec(&tests) == 0;
   return success ? EXIT_SUCCESS : EXIT_FAILURE;